@@ -0,0 +1,525 @@
+/*
+ * capture.c	Writing the capture file.
+ *
+ *		Entry points:
+ *
+ *		cap_open(name)     - start capturing to name, appending
+ *		cap_close()        - write out what is left and close it
+ *		cap_isopen()       - is there a capture file
+ *		cap_write(s, len)  - add data to the capture
+ *		cap_putc(c)        - add one character
+ *		cap_option(key, value) - rotation, sync and compression
+ *		                     settings, from -O capture-...
+ *
+ *		Data is added to a ring buffer and handed to a writer
+ *		thread: right away, at the end of a line or once a block
+ *		has been collected, as set with the buffering mode. A
+ *		slow disk then only holds up the screen when the ring is
+ *		full.
+ *
+ *		The name of the file may contain strftime() escapes.
+ *		The file is rotated when it reaches a size, or every so
+ *		many seconds: a new name is made from the time, or if
+ *		that is the same name the old file is renamed to name.1,
+ *		name.2 and so on. Rotated files can be compressed (with
+ *		zlib, by the writer thread).
+ *
+ *		Without pthreads the writing is done right away, as
+ *		before, and the time to rotate is only looked at when
+ *		there is something to write.
+ *
+ *		This file is part of the minicom communications package,
+ *		Copyright 1991-1995 Miquel van Smoorenburg.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <config.h>
+#include <limits.h>
+
+#include "port.h"
+#include "minicom.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <poll.h>
+#endif
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+/* Must be a power of two. */
+#define CAP_RING	(1 << 20)
+/* With full buffering, data is handed over in blocks of this size. */
+#define CAP_BLOCK	65536
+
+enum { SYNC_OFF, SYNC_ROTATE, SYNC_ALWAYS, SYNC_EVERY };
+
+/* Settings, see cap_option(). */
+static long long rot_size;	/* Rotate at this size, 0 = never */
+static long rot_time;		/* Rotate every so many seconds, 0 = never */
+static int sync_mode;
+static int sync_secs;		/* For SYNC_EVERY */
+static int cap_gzip;		/* Compress rotated files */
+
+static char *ring;
+/* head is where the main thread adds data, ready how far the writer
+ * may write, tail how far it did. All three only ever increase; the
+ * index is taken modulo CAP_RING. */
+static size_t head, ready, tail;
+static int cap_opened;
+
+/* The writer's. */
+static char *cap_name;		/* As given */
+static char cap_path[PATH_MAX];	/* The file being written */
+static int cap_fd = -1;
+static long long cap_size;
+static time_t cap_next;		/* Time to rotate, 0 = none */
+static time_t cap_synced;	/* Last fsync() */
+static int cap_dirty;		/* Written since then */
+static pid_t cap_pid;
+
+#define LOAD(v)		__atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x)	__atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+
+/* When to rotate a file opened at time now, 0 for never. */
+static time_t cap_rottime(time_t now)
+{
+  return rot_time ? (now / rot_time + 1) * rot_time : 0;
+}
+
+/* The name of the capture file at time t. */
+static void cap_expand(char *buf, size_t len, time_t t)
+{
+  struct tm tm;
+
+  if (strchr(cap_name, '%') && localtime_r(&t, &tm) &&
+      strftime(buf, len, cap_name, &tm) > 0)
+    return;
+  snprintf(buf, len, "%s", cap_name);
+}
+
+/* Open the file to write to at time now. */
+static int cap_file(time_t now)
+{
+  struct stat st;
+
+  cap_expand(cap_path, sizeof(cap_path), now);
+  cap_fd = open(cap_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+  if (cap_fd < 0)
+    return -1;
+  fcntl(cap_fd, F_SETFD, FD_CLOEXEC);
+  cap_size = fstat(cap_fd, &st) == 0 ? st.st_size : 0;
+  cap_next = cap_rottime(now);
+  cap_synced = now;
+  cap_dirty = 0;
+  return 0;
+}
+
+static void cap_sync(time_t now)
+{
+  if (cap_dirty && cap_fd >= 0)
+    fsync(cap_fd);
+  cap_dirty = 0;
+  cap_synced = now;
+}
+
+/* Replace path by path.gz. */
+static void cap_compress(const char *path)
+{
+#ifdef HAVE_ZLIB_H
+  char gz[PATH_MAX + 3];
+  char buf[16384];
+  gzFile out;
+  ssize_t n;
+  int fd, ok = 1;
+
+  snprintf(gz, sizeof(gz), "%s.gz", path);
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return;
+  if ((out = gzopen(gz, "wb")) == NULL) {
+    close(fd);
+    return;
+  }
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    if (gzwrite(out, buf, n) != n) {
+      ok = 0;
+      break;
+    }
+  close(fd);
+  if (gzclose(out) != Z_OK || n < 0)
+    ok = 0;
+
+  /* Keep whichever one is complete. */
+  unlink(ok ? path : gz);
+#else
+  (void)path;
+#endif
+}
+
+/*
+ * Close the file. The next one is opened when there is something to
+ * write to it; if it would get the same name, this one is moved aside.
+ */
+static void cap_rotate(time_t now)
+{
+  char name[PATH_MAX + 16], gz[PATH_MAX + 20];
+  int n;
+
+  if (sync_mode != SYNC_OFF)
+    cap_sync(now);
+  close(cap_fd);
+  cap_fd = -1;
+  cap_dirty = 0;
+
+  cap_expand(name, sizeof(name), now);
+  if (strcmp(name, cap_path) == 0) {
+    for (n = 1; ; n++) {
+      snprintf(name, sizeof(name), "%s.%d", cap_path, n);
+      snprintf(gz, sizeof(gz), "%s.gz", name);
+      if (access(name, F_OK) < 0 && access(gz, F_OK) < 0)
+        break;
+    }
+    if (rename(cap_path, name) < 0)
+      return;
+  } else
+    strcpy(name, cap_path);
+  if (cap_gzip)
+    cap_compress(name);
+}
+
+/* Write out what was handed over. */
+static void cap_out(time_t now)
+{
+  size_t r = LOAD(ready), t = tail, n, m, off;
+  ssize_t w;
+  char *nl;
+  int cut;
+
+  if (cap_next && now >= cap_next) {
+    if (cap_fd >= 0 && cap_size)
+      cap_rotate(now);
+    cap_next = cap_rottime(now);
+  }
+
+  while (t != r) {
+    if (cap_fd < 0 && cap_file(now) < 0)
+      break;
+    off = t & (CAP_RING - 1);
+    n = r - t;
+    if (n > CAP_RING - off)
+      n = CAP_RING - off;
+
+    /* Rotate at the end of the line that goes past the size, or
+     * a block later if there is no end to it. */
+    cut = 0;
+    if (rot_size && cap_size + (long long)n > rot_size) {
+      m = cap_size < rot_size ? rot_size - cap_size : 0;
+      if ((nl = memchr(ring + off + m, '\n', n - m)) != NULL) {
+        n = nl + 1 - (ring + off);
+        cut = 1;
+      } else if (cap_size + (long long)n >= rot_size + CAP_BLOCK) {
+        n = cap_size < rot_size + CAP_BLOCK ?
+            rot_size + CAP_BLOCK - cap_size : 0;
+        cut = 1;
+      }
+    }
+
+    w = n ? write(cap_fd, ring + off, n) : 0;
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0 || (w == 0 && n)) {
+      /* Full disk or such: drop it. */
+      t = r;
+      break;
+    }
+    t += w;
+    cap_size += w;
+    cap_dirty |= w > 0;
+    if (cut && (size_t)w == n)
+      cap_rotate(now);
+  }
+  /* Nowhere to write it. */
+  if (cap_fd < 0)
+    t = r;
+  STORE(tail, t);
+
+  if (sync_mode == SYNC_ALWAYS ||
+      (sync_mode == SYNC_EVERY && now - cap_synced >= sync_secs))
+    cap_sync(now);
+}
+
+#ifdef HAVE_PTHREAD_H
+static pthread_t cap_tid;
+static int cap_thread;		/* The writer is running */
+static int stopping;
+static int pending;		/* A wakeup is in the pipe */
+static int wake_pipe[2] = { -1, -1 };
+
+/* Wake up the writer, unless it has a wakeup coming already. */
+static void notify(void)
+{
+  char c = 0;
+
+  if (__atomic_exchange_n(&pending, 1, __ATOMIC_SEQ_CST) == 0
+      && write(wake_pipe[1], &c, 1) < 0)
+    pending = 0;
+}
+
+/* How long the writer may sleep, in ms. */
+static int cap_timeout(time_t now)
+{
+  time_t t = cap_next;
+
+  if (sync_mode == SYNC_EVERY && cap_dirty &&
+      (t == 0 || cap_synced + sync_secs < t))
+    t = cap_synced + sync_secs;
+  if (t == 0)
+    return -1;
+  if (t <= now)
+    return 0;
+  return t - now > 60 ? 60000 : (t - now) * 1000;
+}
+
+static void *cap_loop(void *arg)
+{
+  struct pollfd pfd;
+  char c[64];
+  int stop;
+
+  (void)arg;
+  pfd.fd = wake_pipe[0];
+  pfd.events = POLLIN;
+  while (1) {
+    /* Clear the wakeup before looking, as rx_read() does. */
+    if (__atomic_exchange_n(&pending, 0, __ATOMIC_SEQ_CST))
+      while (read(wake_pipe[0], c, sizeof(c)) > 0)
+        ;
+    stop = LOAD(stopping);
+    cap_out(time(NULL));
+    if (stop)
+      break;
+    if (poll(&pfd, 1, cap_timeout(time(NULL))) < 0 && errno != EINTR)
+      break;
+  }
+  return NULL;
+}
+
+static void cap_start(void)
+{
+  sigset_t all, old;
+  int i;
+
+  if (pipe(wake_pipe) < 0)
+    return;
+  for (i = 0; i < 2; i++) {
+    fcntl(wake_pipe[i], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+  stopping = 0;
+  pending = 0;
+
+  /* Signals are for the main thread only. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  i = pthread_create(&cap_tid, NULL, cap_loop, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (i != 0) {
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    return;
+  }
+  cap_thread = 1;
+}
+
+static void cap_stop(void)
+{
+  if (!cap_thread)
+    return;
+  STORE(stopping, 1);
+  notify();
+  pthread_join(cap_tid, NULL);
+  close(wake_pipe[0]);
+  close(wake_pipe[1]);
+  cap_thread = 0;
+}
+#else
+#define cap_thread	0
+#define notify()
+#define cap_start()
+#define cap_stop()
+#endif
+
+/* Let the writer have everything that was added. */
+static void cap_handoff(void)
+{
+  STORE(ready, head);
+  if (cap_thread)
+    notify();
+  else
+    cap_out(time(NULL));
+}
+
+static void cap_exit(void)
+{
+  if (getpid() == cap_pid)
+    cap_close();
+}
+
+/*
+ * Start capturing to name, adding to the file if it exists.
+ */
+int cap_open(const char *name)
+{
+  if (cap_opened)
+    cap_close();
+  if (ring == NULL && (ring = malloc(CAP_RING)) == NULL)
+    return -1;
+  free(cap_name);
+  if ((cap_name = strdup(name)) == NULL)
+    return -1;
+  if (cap_file(time(NULL)) < 0)
+    return -1;
+
+  head = ready = tail = 0;
+  cap_opened = 1;
+  cap_start();
+  if (cap_pid == 0 && atexit(cap_exit) == 0)
+    cap_pid = getpid();
+  return 0;
+}
+
+/*
+ * Write out everything and close the file.
+ */
+void cap_close(void)
+{
+  if (!cap_opened)
+    return;
+  STORE(ready, head);
+  cap_stop();
+  cap_out(time(NULL));
+  if (sync_mode != SYNC_OFF)
+    cap_sync(time(NULL));
+  if (cap_fd >= 0)
+    close(cap_fd);
+  cap_fd = -1;
+  cap_opened = 0;
+}
+
+int cap_isopen(void)
+{
+  return cap_opened;
+}
+
+void cap_write(const char *s, size_t len)
+{
+  size_t off, n, room;
+  int hand = 0;
+
+  if (!cap_opened)
+    return;
+
+  while (len > 0) {
+    room = CAP_RING - (head - LOAD(tail));
+    if (room == 0) {
+      /* The disk can't keep up: wait for it. */
+      cap_handoff();
+      if (cap_thread)
+        usleep(1000);
+      continue;
+    }
+    off = head & (CAP_RING - 1);
+    n = CAP_RING - off;
+    if (n > room)
+      n = room;
+    if (n > len)
+      n = len;
+    memcpy(ring + off, s, n);
+    if (capbuf == _IOLBF && memchr(s, '\n', n))
+      hand = 1;
+    head += n;
+    s += n;
+    len -= n;
+  }
+
+  if (capbuf == _IONBF || hand || head - ready >= CAP_BLOCK)
+    cap_handoff();
+}
+
+void cap_putc(int c)
+{
+  char ch = c;
+
+  cap_write(&ch, 1);
+}
+
+static const long long sizes[] = { 1024, 1024 * 1024, 1024 * 1024 * 1024 };
+static const long long times[] = { 1, 60, 3600, 86400 };
+
+/* A number, with one of units after it for the multiplier in mult. */
+static long long cap_number(const char *s, const char *units,
+                            const long long *mult)
+{
+  const char *u;
+  char *end;
+  long long n;
+
+  n = strtoll(s, &end, 10);
+  if (end == s || n < 0)
+    return -1;
+  if (*end == 0)
+    return n;
+  if (end[1] || (u = strchr(units, *end)) == NULL)
+    return -1;
+  return n * mult[u - units];
+}
+
+/*
+ * Set capture option key (from -O capture-key=value). Returns -1 if
+ * the key or the value is not known.
+ */
+int cap_option(const char *key, const char *value)
+{
+  long long n;
+
+  if (!strcmp(key, "gzip")) {
+#ifdef HAVE_ZLIB_H
+    cap_gzip = value == NULL || !strcmp(value, "on");
+    return 0;
+#else
+    return -1;
+#endif
+  }
+  if (value == NULL)
+    return -1;
+
+  if (!strcmp(key, "size")) {
+    if ((n = cap_number(value, "kMG", sizes)) < 0)
+      return -1;
+    rot_size = n;
+  } else if (!strcmp(key, "time")) {
+    if ((n = cap_number(value, "smhd", times)) < 0)
+      return -1;
+    rot_time = n;
+  } else if (!strcmp(key, "sync")) {
+    if (!strcmp(value, "off"))
+      sync_mode = SYNC_OFF;
+    else if (!strcmp(value, "rotate"))
+      sync_mode = SYNC_ROTATE;
+    else if (!strcmp(value, "always"))
+      sync_mode = SYNC_ALWAYS;
+    else if ((n = cap_number(value, "smhd", times)) > 0) {
+      sync_mode = SYNC_EVERY;
+      sync_secs = n;
+    } else
+      return -1;
+  } else
+    return -1;
+  return 0;
+}
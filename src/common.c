@@ -12,7 +12,6 @@
  *
  *		Functions
  *		char *pfix_home(char *)   - prefix filename with home directory
- *		void do_log(const char *) - write a line to the logfile
  *
  *		moved from config.c to a separate file, so they are easier
  *		to use in both the Minicom main program and runscript.
@@ -49,39 +48,6 @@ char *pfix_home(char *s)
   return s;
 }
 
-void do_log(const char *line, ...)
-{
-#ifdef LOGFILE
-/* Write a line to the log file.   jl 22.06.97 */
-  FILE *logfile;
-  char *logname = pfix_home(logfname);
-  struct tm *ptr;
-  time_t    ttime;
-  va_list   ap;
-
-  if (logfname[0] == 0)
-    return;
-  logfile = fopen(logname,"a");
-  if (!logfile)
-    return;
-
-  va_start(ap, line);
-  ttime = time(NULL);
-  ptr = localtime(&ttime);
-
-  fprintf(logfile,"%04d%02d%02d %02d:%02d:%02d ",
-	  (ptr->tm_year)+1900, (ptr->tm_mon)+1, ptr->tm_mday,
-	  ptr->tm_hour, ptr->tm_min, ptr->tm_sec);
-  vfprintf(logfile, line, ap);
-  va_end(ap);
-  fprintf(logfile, "\n");
-  fclose(logfile);
-#else
-  /* dummy, don't do anything */
-  (void)line;
-#endif
-}
-
 /* mbtowc (), except that mbtowc (.. , "", ..) == 1, errors are treated as
  * (wchar_t)*s */
 size_t one_mbtowc(wchar_t *pwc, const char *s, size_t n)
@@ -1128,8 +1128,9 @@ static void do_menu_keyboard_and_misc(void)
   int c;
   int once = 0;
   int clr = 1;
-  int miny = 8, maxy = 17;
+  int miny = 7, maxy = 18;
   int old_stat = P_STATLINE[0];
+  char old_histdir[PARS_VAL_LEN];
   FILE *fp;
   const char *command_key           = _(" A - Command key is         :");
   const char *backspace_key         = _(" B - Backspace key sends    :");
@@ -1137,6 +1138,8 @@ static void do_menu_keyboard_and_misc(void)
   const char *macros_file           = _(" L - Macros file            :");
   const char *macros_enabled        = _(" N - Macros enabled         :");
   const char *character_conversion  = _(" O - Character conversion   :");
+  const char *history_directory     = _(" P - History directory      :");
+  const char *history_compress      = _(" Q - Compress old history   :");
   const char *question              = _("Change which setting?  (Esc to exit)");
 
   w = mc_wopen(6, miny, 70, maxy, BDOUBLE, stdattr, mfcolor, mbcolor, 0, 0, 1);
@@ -1150,6 +1153,9 @@ static void do_menu_keyboard_and_misc(void)
   mc_wprintf(w, _(" M - Edit Macros\n"));
   mc_wprintf(w, "%s %s\n", macros_enabled, _(P_MACENAB));
   mc_wprintf(w, "%s %s\n", character_conversion, P_CONVF);
+  mc_wprintf(w, "%s %.30s\n", history_directory, P_HISTDIR);
+  mc_wprintf(w, "%s %s\n", history_compress, _(P_HISTGZIP));
+  strcpy(old_histdir, P_HISTDIR);
 
   mc_wredraw(w, 1);
 
@@ -1173,14 +1179,22 @@ static void do_menu_keyboard_and_misc(void)
         /* fmg - sanity checks... "we found the enemy and he is us" :-) */
         /* MARK updated 02/17/95, Warn user to restart */
         /* minicom if they changed history buffer size */
-        if (atoi(P_HISTSIZE) != num_hist_lines) {
+        if (atoi(P_HISTSIZE) != num_hist_lines ||
+            strcmp(P_HISTDIR, old_histdir) != 0) {
           w1 = mc_wopen(14, 9, 70, 15, BSINGLE, stdattr, mfcolor, mbcolor, 0, 0, 1);
           mc_wtitle(w1, TMID, _("History Buffer Size"));
-          mc_wputs(w1, _(
-             "\n You have changed the history buffer size.\n"
-             " You will need to save the configuration file and\n"
-             " restart minicom for the change to take effect.\n"
-             "\n Hit a key to Continue... "));
+          if (atoi(P_HISTSIZE) != num_hist_lines)
+            mc_wputs(w1, _(
+               "\n You have changed the history buffer size.\n"
+               " You will need to save the configuration file and\n"
+               " restart minicom for the change to take effect.\n"
+               "\n Hit a key to Continue... "));
+          else
+            mc_wputs(w1, _(
+               "\n You have changed the history directory.\n"
+               " You will need to save the configuration file and\n"
+               " restart minicom for the change to take effect.\n"
+               "\n Hit a key to Continue... "));
           mc_wredraw(w1, 1);
           c = wxgetch();
           mc_wclose(w1, 1);
@@ -1242,19 +1256,18 @@ static void do_menu_keyboard_and_misc(void)
         break;
       case 'K': /* MARK updated 02/17/95 - Config history size */
         pgets(w, mbswidth(history_buffer_size) + 1, 2,
-              P_HISTSIZE, 6, 6, 0);
+              P_HISTSIZE, 9, 9, 0);
 
         /* In case gibberish or a value was out of bounds, */
-        /* limit history buffer size between 0 to 5000 lines */
-        /* 5000 line history at 80 columns consumes about */
-        /* 800 kilobytes including chars and attrs bytes! */
+        /* limit history buffer size between 0 to 250000 lines, */
+        /* or more with a history directory (see history.c). */
         if (atoi(P_HISTSIZE) <= 0) 
           strcpy(P_HISTSIZE,"0");
-        else if (atoi(P_HISTSIZE) >= 5000)
-          strcpy(P_HISTSIZE,"5000");
+        else if (atoi(P_HISTSIZE) >= (P_HISTDIR[0] ? HIST_MAXDISK : HIST_MAXMEM))
+          sprintf(P_HISTSIZE, "%d", P_HISTDIR[0] ? HIST_MAXDISK : HIST_MAXMEM);
 
         mc_wlocate(w, mbswidth(history_buffer_size) + 1, 2);
-        mc_wprintf(w, "%s     ", P_HISTSIZE);
+        mc_wprintf(w, "%s        ", P_HISTSIZE);
         break;
       case 'L': /* fmg - get local macros storage file */
         pgets(w, mbswidth(macros_file) + 1, 3, P_MACROS, 64, 64, 1);
@@ -1293,6 +1306,16 @@ static void do_menu_keyboard_and_misc(void)
         mc_wlocate(w, mbswidth(character_conversion) + 1, 6);
         mc_wprintf(w, "%-16.16s", _(P_CONVF));
         break;
+      case 'P':
+        pgets(w, mbswidth(history_directory) + 1, 7, P_HISTDIR, 30, 64, 1);
+        break;
+      case 'Q':
+        psets(P_HISTGZIP, yesno(P_HISTGZIP[0] == 'N'));
+        mc_wlocate(w, mbswidth(history_compress) + 1, 8);
+        mc_wprintf(w, "%s ", _(P_HISTGZIP));
+        /* Applies to what is written from now on. */
+        mc_histgzip(P_HISTGZIP[0] == 'Y');
+        break;
      }
   }
 }
@@ -1315,9 +1338,11 @@ int dotermmenu(void)
   const char *msg_nl_delay        = _(" D -   Newline tx delay (ms) :");
   const char *msg_answerback      = _(" E -          ENQ answerback :");
   const char *msg_ch_delay        = _(" F - Character tx delay (ms) :");
+  const char *frame_rate          = _(" G - Screen updates/sec (Hz) :");
+  const char *sync_output         = _(" H -    Synchronized updates :");
   const char *question            = _("Change which setting?");
 
-  w = mc_wopen(15, 7, 64, 15, BDOUBLE, stdattr, mfcolor, mbcolor, 0, 0, 1);
+  w = mc_wopen(15, 7, 64, 17, BDOUBLE, stdattr, mfcolor, mbcolor, 0, 0, 1);
   mc_wtitle(w, TMID, _("Terminal settings"));
   mc_wprintf(w, "\n");
   mc_wprintf(w, "%s %s\n", terminal_emulation, terminal == VT100 ? "VT102" : "ANSI");
@@ -1326,13 +1351,15 @@ int dotermmenu(void)
   mc_wprintf(w, "%s %d\n", msg_nl_delay, vt_nl_delay);
   mc_wprintf(w, "%s %s\n", msg_answerback, P_ANSWERBACK);
   mc_wprintf(w, "%s %d\n", msg_ch_delay, vt_ch_delay);
-  mc_wlocate(w, 4, 7);
+  mc_wprintf(w, "%s %s\n", frame_rate, P_FRAMERATE);
+  mc_wprintf(w, "%s %s\n", sync_output, _(P_SYNCOUTPUT));
+  mc_wlocate(w, 4, 9);
   mc_wputs(w, question);
 
   mc_wredraw(w, 1);
 
   while (1) {
-    mc_wlocate(w, mbswidth(question) + 5, 7);
+    mc_wlocate(w, mbswidth(question) + 5, 9);
     c = rwxgetch();
     switch(c) {
       case '\n':
@@ -1402,6 +1429,22 @@ int dotermmenu(void)
         sprintf(buf, "%d", vt_ch_delay);
         psets(P_MSG_CH_DELAY, buf);
         break;
+      case 'G':
+        mc_wlocate(w, mbswidth(frame_rate) + 1, 7);
+        mc_wgets(w, P_FRAMERATE, 5, 5);
+        mc_wlocate(w, mbswidth(frame_rate) + 1, 7);
+        sprintf(buf, "%d", atoi(P_FRAMERATE) < 0 ? 0 : atoi(P_FRAMERATE));
+        mc_wprintf(w, "%-4s", buf);
+        // Rewrite P_FRAMERATE in case of invalid input
+        psets(P_FRAMERATE, buf);
+        mc_wsetframe(atoi(P_FRAMERATE), strcasecmp(P_SYNCOUTPUT, "yes") == 0);
+        break;
+      case 'H':
+        psets(P_SYNCOUTPUT, yesno(P_SYNCOUTPUT[0] == 'N'));
+        mc_wlocate(w, mbswidth(sync_output) + 1, 8);
+        mc_wprintf(w, "%s ", _(P_SYNCOUTPUT));
+        mc_wsetframe(atoi(P_FRAMERATE), strcasecmp(P_SYNCOUTPUT, "yes") == 0);
+        break;
       default:
         break;
     }
@@ -181,7 +181,13 @@ enum config_type {
 #define P_MSG_CH_DELAY          mpars[101].value /* msg_ch_delay */
 #define P_MSG_NL_DELAY          mpars[102].value /* msg_nl_delay */
 
-#define MPARS_MAX 103
+#define P_FRAMERATE             mpars[103].value /* Screen updates per second */
+#define P_SYNCOUTPUT            mpars[104].value /* DEC 2026 synchronized output */
+
+#define P_HISTDIR               mpars[105].value /* Keep history on disk here */
+#define P_HISTGZIP              mpars[106].value /* Compress older history */
+
+#define MPARS_MAX 107
 
 extern struct pars mpars[MPARS_MAX + 1]; // + 1 is for end-marker
 
@@ -162,11 +162,13 @@ const char* change_baud(const char *s)
  * Send a string to the modem.
  * If how == 0, '~'  sleeps 1 second.
  * If how == 1, "^~" sleeps 1 second.
+ * Queued output goes first, so nothing overtakes it.
  */
 void mputs(const char *s, int how)
 {
   char c;
 
+  tx_drain();
   while (*s) {
     if (*s == '^' && (*(s + 1))) {
       s++;
@@ -441,6 +443,7 @@ MainLoop:
 
     /* Start the dial */
     m_flush(portfd);
+    rx_flush();
     switch (d->dialtype) {
       case 0:
         mputs(P_MDIALPRE, 0);
@@ -480,6 +483,7 @@ MainLoop:
           mputs(P_MDIALCAN, 0);
           dialfailed(_("Cancelled"), 4);
           m_flush(portfd);
+          rx_flush();
           break;
         }
         keyboard(KSTOP, 0);
@@ -0,0 +1,1639 @@
+/*
+ * history.c	Scrollback history of a window.
+ *
+ *		Entry points:
+ *
+ *		mc_histdir(dir, compress) - keep new histories on disk
+ *		mc_histgzip(compress) - compress older segments or not
+ *		mc_histnew(lines, cols, attr, color) - make a history
+ *		mc_histfree(h)      - free it
+ *		mc_histadd(w, line, wrapped) - add a line of w->xs cells
+ *		mc_histline(w, i)   - line i as ELMs, valid until the next call
+ *		mc_histcount(w)     - number of lines added so far
+ *		mc_histkeep(h, lines, cols) - reuse h for a new window
+ *		mc_histsearch(pat, flags, err, errlen) - prepare a search
+ *		mc_histsearchfree(s) - free it
+ *		mc_histmatch(s, line, len) - does a line match
+ *		mc_histgrep(w, s, max, &hits) - matching lines of the history
+ *
+ *		Lines are kept as records of varying length instead of
+ *		w->xs ELMs each. Trailing blanks are left out, the text
+ *		takes one, two or four bytes a character, whatever the
+ *		line needs, and attributes are stored per run of cells
+ *		that have the same ones. A line is only turned back into
+ *		ELMs when it is shown.
+ *
+ *		In memory the records are appended to one buffer, oldest
+ *		first; the space of lines that dropped out of the history
+ *		is reclaimed by moving the rest down when the buffer fills.
+ *
+ *		With a history directory the records go to segment files
+ *		of SEG_SIZE bytes instead, which are written and read
+ *		through mmap(). Only the segment being written and a few
+ *		recently read ones are mapped, so memory use does not
+ *		depend on the size of the history. Segments are removed
+ *		as a whole once all their lines are too old, and older
+ *		ones can be compressed (by a thread, with zlib).
+ *
+ *		When the window changes size, the history is kept. The
+ *		lines already in it are not converted: lines that went on
+ *		in the next one (the cursor wrapped at the end) are put
+ *		together again and cut up at the new width when they are
+ *		shown. Where the rows of the new width start is found
+ *		going back from the newest line, as far back as has been
+ *		looked at, and remembered for every RMARK_ROWS rows.
+ *
+ *		For searching, each block of SIG_LINES lines has a bit
+ *		set for every trigram (case folded) in its lines. Blocks
+ *		that lack a trigram of the pattern are skipped without
+ *		looking at their lines. On disk the bits are kept in the
+ *		segment, next to the offsets.
+ *
+ *		This file is part of the minicom communications package,
+ *		Copyright 1991-1995 Miquel van Smoorenburg.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <config.h>
+
+#include <sys/mman.h>
+#include <limits.h>
+#include <regex.h>
+#include <wctype.h>
+
+#include "port.h"
+#include "minicom.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+/*
+ * A record:
+ *
+ *	1 byte	 bytes per character (1, 2 or 4), REC_WRAPPED added
+ *	         if the line went on in the next one
+ *	2 bytes	 number of cells stored, n
+ *	2 bytes	 number of attribute runs
+ *	3 bytes	 attr and color of the cells after the first n (blanks)
+ *	5 bytes	 per run: length, attr and color
+ *	         the n characters
+ *
+ * Numbers are stored low byte first.
+ */
+#define REC_HEAD	8
+#define REC_RUN		5
+#define REC_WRAPPED	0x80
+
+#define HIST_MINBUF	65536
+
+/* Trigram bits of a block of lines. */
+#define SIG_LINES	16
+#define SIG_BYTES	256
+
+/*
+ * A segment file has the records from the start, and from the end
+ * backwards a SEG_BLK for each block of lines: its trigram bits, and
+ * the offset of each record (4 bytes).
+ */
+#define SEG_SIZE	(1 << 20)
+#define SEG_BLK		(SIG_BYTES + 4 * SIG_LINES)
+#define SEG_TAIL(n)	(SEG_BLK * (((n) + SIG_LINES - 1) / SIG_LINES))
+#define SEG_SIG(p, b)	((p) + SEG_SIZE - SEG_BLK * ((b) + 1))
+#define SEG_OFF(p, k)	(SEG_SIG(p, (k) / SIG_LINES) + SIG_BYTES + \
+			 4 * ((k) % SIG_LINES))
+#define SEG_CACHE	4	/* Segments kept readable */
+#define SEG_HOT		2	/* Newest segments that are never compressed */
+
+#define RMARK_ROWS	256
+
+struct seg {
+  long long first;		/* First line in it */
+  int count;			/* Number of lines */
+  int used;			/* Bytes of records */
+  int id;			/* In the file name */
+  int gz;			/* Compressed */
+};
+
+struct segcache {
+  int id;			/* Segment, -1 if none */
+  unsigned char *p;
+  int mapped;			/* mmap()ed, else malloc()ed */
+  unsigned last;		/* Last use */
+};
+
+/* Lines from first on were added at cols cells. */
+struct width {
+  long long first;
+  int cols;
+};
+
+/* Where a row of the reflowed history comes from. */
+struct rpos {
+  long long line;		/* First line of the wrapped line */
+  int piece;			/* Which part of it, of the new width */
+};
+
+/* Segments to compress, copied for the thread that does it. */
+struct zjob {
+  char dir[PATH_MAX];
+  int no;
+  struct seg *seg;
+  int n;
+  int thread;			/* Started in tid */
+  int done;			/* Set by the thread at the end */
+#ifdef HAVE_PTHREAD_H
+  pthread_t tid;
+#endif
+};
+
+struct _hist {
+  int lines, cols;
+  char attr;			/* Of lines that were never filled */
+  unsigned short color;
+  ELM *line;			/* Returned by mc_histline() */
+  long long total;		/* Lines added */
+
+  /* After a resize. */
+  struct width *width;		/* Oldest first */
+  int nwidth;
+  long long rtotal;		/* Lines added before it, 0 if none */
+  struct rpos *rmark;		/* Every RMARK_ROWS'th row, newest first */
+  int nrmark, maxrmark;
+  int rdone;			/* No rows after the last mark */
+  struct rpos rhint;		/* The row looked up last */
+  int rhintrow;
+  ELM *tmp;			/* A line at the width it was added at */
+
+  /* In memory. */
+  int *off;			/* Record of each line, -1 if none */
+  unsigned char *sig;		/* Trigram bits of the blocks, a ring */
+  int nsig;
+  unsigned char *buf;		/* The records */
+  size_t size, used;
+  size_t max;			/* No more than the ELMs would take */
+
+  /* On disk. */
+  char *path;			/* Segment file names, NULL if in memory */
+  int plen;			/* Length of the directory part */
+  int no;			/* Tells histories apart in the names */
+  struct seg *seg;		/* Oldest first */
+  int nseg, maxseg;
+  int nextid;
+  int hint;			/* Segment of the last line looked up */
+  unsigned char *wmap;		/* Segment being written */
+  struct segcache cache[SEG_CACHE];
+  unsigned clock;
+  struct zjob *zjob;		/* Segments being compressed, or NULL */
+  struct _hist *next;
+};
+
+static char *hist_base;		/* As configured */
+static char *hist_dir;		/* Our own directory in it */
+static int hist_gzip;
+static int hist_no;
+static HIST *hist_disk;		/* Histories on disk */
+static pid_t hist_pid;		/* Not to clean up after a child */
+
+static void put16(unsigned char *p, unsigned v)
+{
+  p[0] = v & 255;
+  p[1] = (v >> 8) & 255;
+}
+
+static unsigned get16(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static void put32(unsigned char *p, unsigned v)
+{
+  put16(p, v & 0xffff);
+  put16(p + 2, v >> 16);
+}
+
+static unsigned get32(const unsigned char *p)
+{
+  return get16(p) | (get16(p + 2) << 16);
+}
+
+/*
+ * Size of the record for line, and what goes in its head.
+ */
+static int rec_size(HIST *h, const ELM *line, int *np, int *nrunsp,
+                    int *widthp)
+{
+  const ELM *fill = line + h->cols - 1;
+  int n, nruns, i;
+  unsigned big = 0;
+
+  /* Leave out the blanks at the end. */
+  for (n = h->cols; n > 0; n--)
+    if (line[n - 1].value != ' ' || line[n - 1].attr != fill->attr ||
+        line[n - 1].color != fill->color)
+      break;
+
+  nruns = 0;
+  for (i = 0; i < n; i++) {
+    if (i == 0 || line[i].attr != line[i - 1].attr ||
+        line[i].color != line[i - 1].color)
+      nruns++;
+    /* Stray bytes may be stored as negative values. */
+    if ((unsigned)line[i].value > big)
+      big = line[i].value;
+  }
+  *np = n;
+  *nrunsp = nruns;
+  *widthp = big < 256 ? 1 : big < 65536 ? 2 : 4;
+  return REC_HEAD + nruns * REC_RUN + n * *widthp;
+}
+
+/*
+ * Store the record for line at p.
+ */
+static void rec_put(HIST *h, unsigned char *p, const ELM *line,
+                    int n, int nruns, int width, int wrapped)
+{
+  const ELM *fill = line + h->cols - 1;
+  unsigned char *runs;
+  unsigned c;
+  int i, r;
+
+  p[0] = width | (wrapped ? REC_WRAPPED : 0);
+  put16(p + 1, n);
+  put16(p + 3, nruns);
+  p[5] = fill->attr;
+  put16(p + 6, fill->color);
+  runs = p + REC_HEAD;
+  p = runs + nruns * REC_RUN;
+
+  for (i = 0, r = -1; i < n; i++) {
+    if (i == 0 || line[i].attr != line[i - 1].attr ||
+        line[i].color != line[i - 1].color) {
+      r++;
+      put16(runs + r * REC_RUN, 0);
+      runs[r * REC_RUN + 2] = line[i].attr;
+      put16(runs + r * REC_RUN + 3, line[i].color);
+    }
+    put16(runs + r * REC_RUN, get16(runs + r * REC_RUN) + 1);
+
+    c = line[i].value;
+    switch (width) {
+      case 4:
+        *p++ = (c >> 24) & 255;
+        *p++ = (c >> 16) & 255;
+        /* FALLTHRU */
+      case 2:
+        *p++ = (c >> 8) & 255;
+        /* FALLTHRU */
+      default:
+        *p++ = c & 255;
+    }
+  }
+}
+
+/*
+ * Turn the record at head into cols ELMs at e; NULL gives a blank line.
+ */
+static void rec_decode(HIST *h, const unsigned char *head, ELM *e, int cols)
+{
+  const unsigned char *p, *runs;
+  int nruns, width, len, x = 0, r;
+  char attr = h->attr;
+  unsigned short color = h->color;
+  unsigned c;
+
+  if (head) {
+    width = head[0] & ~REC_WRAPPED;
+    nruns = get16(head + 3);
+    runs = head + REC_HEAD;
+
+    for (r = 0, p = runs + nruns * REC_RUN; r < nruns; r++) {
+      len = get16(runs + r * REC_RUN);
+      attr = runs[r * REC_RUN + 2];
+      color = get16(runs + r * REC_RUN + 3);
+      for (; len > 0; len--, x++) {
+        c = *p++;
+        if (width >= 2)
+          c = (c << 8) | *p++;
+        if (width == 4) {
+          c = (c << 8) | *p++;
+          c = (c << 8) | *p++;
+        }
+        if (x < cols) {
+          e[x].value = c;
+          e[x].attr = attr;
+          e[x].color = color;
+        }
+      }
+    }
+    attr = head[5];
+    color = get16(head + 6);
+  }
+
+  for (; x < cols; x++) {
+    e[x].value = ' ';
+    e[x].attr = attr;
+    e[x].color = color;
+  }
+}
+
+static ELM *rec_get(HIST *h, const unsigned char *head)
+{
+  rec_decode(h, head, h->line, h->cols);
+  return h->line;
+}
+
+/* Case folded, for searching. */
+static unsigned fold(unsigned c)
+{
+  if (c < 128)
+    return tolower(c);
+  return c <= 0x10ffff ? (unsigned)towlower(c) : c;
+}
+
+static unsigned tri_bit(unsigned a, unsigned b, unsigned c)
+{
+  unsigned x = a * 0x9e3779b1u ^ b * 0x85ebca77u ^ c * 0xc2b2ae3du;
+
+  return (x ^ (x >> 15)) & (SIG_BYTES * 8 - 1);
+}
+
+/*
+ * Set the bits for the trigrams in the first n cells of line.
+ */
+static void sig_add(unsigned char *sig, const ELM *line, int n)
+{
+  unsigned a, b, c, x;
+  int i;
+
+  if (n < 3)
+    return;
+  a = fold(line[0].value);
+  b = fold(line[1].value);
+  for (i = 2; i < n; i++, a = b, b = c) {
+    c = fold(line[i].value);
+    x = tri_bit(a, b, c);
+    sig[x >> 3] |= 1 << (x & 7);
+  }
+}
+
+/*
+ * Make room for need more bytes. The space before the oldest record
+ * still in use is reclaimed first; the buffer grows when that is not
+ * worth it, and lines are dropped when it may not grow any further.
+ */
+static int hist_room(HIST *h, int next, size_t need)
+{
+  unsigned char *p;
+  size_t start, size;
+  int i, n;
+
+  while (h->used + need > h->size) {
+    /* The oldest line with a record, going round from next. */
+    start = h->used;
+    for (n = 0, i = next; n < h->lines; n++, i = (i + 1) % h->lines)
+      if (h->off[i] >= 0) {
+        start = h->off[i];
+        break;
+      }
+
+    if (start > 0 && (start >= h->size / 4 || h->size >= h->max)) {
+      memmove(h->buf, h->buf + start, h->used - start);
+      h->used -= start;
+      for (i = 0; i < h->lines; i++)
+        if (h->off[i] >= 0)
+          h->off[i] -= start;
+      continue;
+    }
+
+    if (h->size < h->max) {
+      size = h->size ? 2 * h->size : HIST_MINBUF;
+      while (size < h->used + need)
+        size *= 2;
+      if (size > h->max && h->used + need <= h->max)
+        size = h->max;
+      if ((p = realloc(h->buf, size)) != NULL) {
+        h->buf = p;
+        h->size = size;
+        continue;
+      }
+    }
+
+    /* Full (or no memory): drop the oldest line. */
+    if (n == h->lines)
+      return -1;
+    h->off[i] = -1;
+  }
+  return 0;
+}
+
+/* With gz 2, the name of a compressed file being written. */
+static void seg_name(HIST *h, int id, int gz)
+{
+  static const char *const ext[] = { "", ".gz", ".gz.new" };
+
+  sprintf(h->path + h->plen, "/%d.%d%s", h->no, id, ext[gz]);
+}
+
+static void seg_uncache(HIST *h, int id)
+{
+  struct segcache *c;
+
+  for (c = h->cache; c < h->cache + SEG_CACHE; c++) {
+    if (c->id != id || c->p == NULL)
+      continue;
+    if (c->mapped)
+      munmap(c->p, SEG_SIZE);
+    else
+      free(c->p);
+    c->p = NULL;
+    c->id = -1;
+  }
+}
+
+#define LOAD(v)		__atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x)	__atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+
+/*
+ * Compress segment s of job j: the records and the tail are written to
+ * a .gz.new file, without the unused space between them, which is
+ * renamed to .gz when it is complete.
+ */
+static void seg_gzip(struct zjob *j, const struct seg *s)
+{
+#ifdef HAVE_ZLIB_H
+  char raw[PATH_MAX], gz[PATH_MAX], tmp[PATH_MAX];
+  unsigned char *p;
+  gzFile out;
+  int fd, ok;
+
+  snprintf(raw, sizeof(raw), "%s/%d.%d", j->dir, j->no, s->id);
+  snprintf(gz, sizeof(gz), "%s.gz", raw);
+  snprintf(tmp, sizeof(tmp), "%s.gz.new", raw);
+  if ((fd = open(raw, O_RDONLY)) < 0)
+    return;
+  p = mmap(NULL, SEG_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return;
+
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+    munmap(p, SEG_SIZE);
+    return;
+  }
+  if ((out = gzdopen(fd, "wb")) == NULL) {
+    close(fd);
+    ok = 0;
+  } else {
+    ok = gzwrite(out, p, s->used) == s->used &&
+         gzwrite(out, p + SEG_SIZE - SEG_TAIL(s->count),
+                 SEG_TAIL(s->count)) == SEG_TAIL(s->count);
+    ok = gzclose(out) == Z_OK && ok;
+  }
+  munmap(p, SEG_SIZE);
+  if (!ok || rename(tmp, gz) < 0)
+    unlink(tmp);
+#else
+  (void)j;
+  (void)s;
+#endif
+}
+
+static void *seg_zloop(void *arg)
+{
+  struct zjob *j = arg;
+  int k;
+
+  for (k = 0; k < j->n; k++)
+    seg_gzip(j, j->seg + k);
+  STORE(j->done, 1);
+  return NULL;
+}
+
+/*
+ * Take over the segments that were compressed once the job is done;
+ * with wait, wait for it.
+ */
+static void seg_reap(HIST *h, int wait)
+{
+  struct zjob *j = h->zjob;
+  int id, k, i;
+
+  if (j == NULL || (!wait && !LOAD(j->done)))
+    return;
+#ifdef HAVE_PTHREAD_H
+  if (j->thread)
+    pthread_join(j->tid, NULL);
+#endif
+  h->zjob = NULL;
+
+  for (k = 0; k < j->n; k++) {
+    id = j->seg[k].id;
+    seg_name(h, id, 2);
+    unlink(h->path);
+    seg_name(h, id, 1);
+    /* Segment ids go up by one. */
+    i = h->nseg ? id - h->seg[0].id : -1;
+    if (i < 0 || i >= h->nseg) {
+      /* Expired in the meantime. */
+      unlink(h->path);
+      continue;
+    }
+    if (access(h->path, F_OK) < 0)
+      continue;
+    h->seg[i].gz = 1;
+    seg_name(h, id, 0);
+    unlink(h->path);
+  }
+  free(j->seg);
+  free(j);
+}
+
+/*
+ * Compress n segments from k on in a thread, so adding lines does not
+ * have to wait for it; without pthreads, right away. seg_reap() takes
+ * it from there.
+ */
+static void seg_compress(HIST *h, int k, int n)
+{
+  struct zjob *j;
+#ifdef HAVE_PTHREAD_H
+  sigset_t all, old;
+#endif
+
+  if ((j = calloc(1, sizeof(struct zjob))) == NULL)
+    return;
+  if ((j->seg = malloc(n * sizeof(struct seg))) == NULL) {
+    free(j);
+    return;
+  }
+  snprintf(j->dir, sizeof(j->dir), "%.*s", h->plen, h->path);
+  j->no = h->no;
+  j->n = n;
+  memcpy(j->seg, h->seg + k, n * sizeof(struct seg));
+  h->zjob = j;
+
+#ifdef HAVE_PTHREAD_H
+  /* Signals are for the main thread only. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  j->thread = pthread_create(&j->tid, NULL, seg_zloop, j) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (j->thread)
+    return;
+#endif
+  seg_zloop(j);
+  seg_reap(h, 1);
+}
+
+/*
+ * Start a new segment file to write to.
+ */
+static int seg_new(HIST *h)
+{
+  struct seg *s;
+  void *p;
+  int fd, err, k;
+
+  if (h->wmap) {
+    munmap(h->wmap, SEG_SIZE);
+    h->wmap = NULL;
+  }
+  if (h->nseg == h->maxseg) {
+    s = realloc(h->seg, (h->maxseg + 16) * sizeof(struct seg));
+    if (s == NULL)
+      return -1;
+    h->seg = s;
+    h->maxseg += 16;
+  }
+
+  seg_name(h, h->nextid, 0);
+  if ((fd = open(h->path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+    return -1;
+  /* Claim the space now: a full disk would be a SIGBUS later on. */
+#ifdef HAVE_POSIX_FALLOCATE
+  err = posix_fallocate(fd, 0, SEG_SIZE);
+#else
+  err = ftruncate(fd, SEG_SIZE);
+#endif
+  p = MAP_FAILED;
+  if (err == 0)
+    p = mmap(NULL, SEG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    unlink(h->path);
+    return -1;
+  }
+  h->wmap = p;
+
+  s = h->seg + h->nseg++;
+  s->first = h->total;
+  s->count = 0;
+  s->used = 0;
+  s->id = h->nextid++;
+  s->gz = 0;
+
+  /* The ones not compressed yet, if no job is still at it. */
+  seg_reap(h, 0);
+  if (hist_gzip && h->zjob == NULL) {
+    for (k = 0; k < h->nseg - SEG_HOT && h->seg[k].gz; k++)
+      ;
+    if (k < h->nseg - SEG_HOT)
+      seg_compress(h, k, h->nseg - SEG_HOT - k);
+  }
+  return 0;
+}
+
+/*
+ * Remove the oldest segments while all their lines are too old.
+ */
+static void seg_expire(HIST *h)
+{
+  struct seg *s = h->seg;
+  int n = 0;
+
+  while (n < h->nseg - 1 && s[n].first + s[n].count <= h->total - h->lines) {
+    seg_uncache(h, s[n].id);
+    seg_name(h, s[n].id, s[n].gz);
+    unlink(h->path);
+    n++;
+  }
+  if (n) {
+    h->nseg -= n;
+    memmove(s, s + n, h->nseg * sizeof(struct seg));
+    h->hint = 0;
+  }
+}
+
+/*
+ * Read compressed segment s from fd (closed) into a buffer of SEG_SIZE.
+ */
+static unsigned char *seg_gunzip(struct seg *s, int fd)
+{
+#ifdef HAVE_ZLIB_H
+  unsigned char *p;
+  gzFile in;
+  int ok;
+
+  if ((in = gzdopen(fd, "rb")) == NULL) {
+    close(fd);
+    return NULL;
+  }
+  ok = (p = malloc(SEG_SIZE)) != NULL &&
+       gzread(in, p, s->used) == s->used &&
+       gzread(in, p + SEG_SIZE - SEG_TAIL(s->count),
+              SEG_TAIL(s->count)) == SEG_TAIL(s->count);
+  gzclose(in);
+  if (!ok) {
+    free(p);
+    return NULL;
+  }
+  return p;
+#else
+  (void)s;
+  close(fd);
+  return NULL;
+#endif
+}
+
+/*
+ * Contents of segment k, read in if needed. The one being written is
+ * always there.
+ */
+static unsigned char *seg_data(HIST *h, int k)
+{
+  struct seg *s = h->seg + k;
+  struct segcache *c, *lru = h->cache;
+  unsigned char *p;
+  int fd;
+
+  if (k == h->nseg - 1 && h->wmap)
+    return h->wmap;
+
+  for (c = h->cache; c < h->cache + SEG_CACHE; c++) {
+    if (c->id == s->id && c->p) {
+      c->last = ++h->clock;
+      return c->p;
+    }
+    if (c->p == NULL || (lru->p && c->last < lru->last))
+      lru = c;
+  }
+  seg_uncache(h, lru->id);
+
+  seg_name(h, s->id, s->gz);
+  if ((fd = open(h->path, O_RDONLY)) < 0)
+    return NULL;
+  if (!s->gz) {
+    p = mmap(NULL, SEG_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+      return NULL;
+  } else if ((p = seg_gunzip(s, fd)) == NULL)
+    return NULL;
+  lru->id = s->id;
+  lru->p = p;
+  lru->mapped = !s->gz;
+  lru->last = ++h->clock;
+  return p;
+}
+
+/*
+ * The record of line number l, NULL if there is none.
+ */
+static const unsigned char *seg_line(HIST *h, long long l)
+{
+  struct seg *s = h->seg;
+  unsigned char *p;
+  int lo, hi, k;
+
+  if (h->nseg == 0 || l < s[0].first)
+    return NULL;
+
+  /* Mostly the same segment as last time, or one next to it. */
+  k = h->hint;
+  if (k >= h->nseg || l < s[k].first || l >= s[k].first + s[k].count) {
+    if (k + 1 < h->nseg && l >= s[k + 1].first &&
+        l < s[k + 1].first + s[k + 1].count)
+      k++;
+    else if (k > 0 && k < h->nseg && l >= s[k - 1].first && l < s[k].first)
+      k--;
+    else {
+      for (lo = 0, hi = h->nseg - 1; lo < hi; ) {
+        k = (lo + hi + 1) / 2;
+        if (s[k].first <= l)
+          lo = k;
+        else
+          hi = k - 1;
+      }
+      k = lo;
+    }
+  }
+  h->hint = k;
+  if (l >= s[k].first + s[k].count || (p = seg_data(h, k)) == NULL)
+    return NULL;
+  return p + get32(SEG_OFF(p, l - s[k].first));
+}
+
+static void seg_add(HIST *h, const ELM *line, int wrapped)
+{
+  struct seg *s = h->nseg ? h->seg + h->nseg - 1 : NULL;
+  int n, nruns, width, size;
+
+  size = rec_size(h, line, &n, &nruns, &width);
+  if (s == NULL || h->wmap == NULL ||
+      s->used + size + SEG_TAIL(s->count + 1) > SEG_SIZE) {
+    if (seg_new(h) < 0) {
+      /* Lost; it shows up as a blank line. */
+      h->total++;
+      seg_expire(h);
+      return;
+    }
+    s = h->seg + h->nseg - 1;
+  }
+  rec_put(h, h->wmap + s->used, line, n, nruns, width, wrapped);
+  put32(SEG_OFF(h->wmap, s->count), s->used);
+  sig_add(SEG_SIG(h->wmap, s->count / SIG_LINES), line, n);
+  s->used += size;
+  s->count++;
+  h->total++;
+  seg_expire(h);
+}
+
+/*
+ * The record of line number l, NULL if there is none.
+ */
+static const unsigned char *hist_rec(HIST *h, long long l)
+{
+  if (l < 0 || l < h->total - h->lines || l >= h->total)
+    return NULL;
+  if (h->path)
+    return seg_line(h, l);
+  return h->off[l % h->lines] >= 0 ? h->buf + h->off[l % h->lines] : NULL;
+}
+
+/*
+ * The trigram bits of the block of line l, NULL if not known.
+ */
+static const unsigned char *hist_sig(HIST *h, long long l)
+{
+  unsigned char *p;
+
+  if (!h->path)
+    return h->sig + (l / SIG_LINES % h->nsig) * SIG_BYTES;
+  if (seg_line(h, l) == NULL || (p = seg_data(h, h->hint)) == NULL)
+    return NULL;
+  return SEG_SIG(p, (l - h->seg[h->hint].first) / SIG_LINES);
+}
+
+/* The width line l was added at. */
+static int line_cols(HIST *h, long long l)
+{
+  int k = h->nwidth - 1;
+
+  while (k > 0 && h->width[k].first > l)
+    k--;
+  return h->width[k].cols;
+}
+
+/*
+ * Does line l go on in the next one? Not if that one came after the
+ * resize.
+ */
+static int line_wrapped(HIST *h, long long l)
+{
+  const unsigned char *p;
+
+  if (l >= h->rtotal - 1 || (p = hist_rec(h, l)) == NULL)
+    return 0;
+  return (p[0] & REC_WRAPPED) != 0;
+}
+
+/*
+ * The wrapped line that ends with line end - 1: its first line, and in
+ * how many rows of the current width it goes. Returns -1 if there is
+ * none left.
+ */
+static int wrapped_line(HIST *h, long long end, long long *firstp,
+                        int *rowsp)
+{
+  const unsigned char *p;
+  long long lo = h->total - h->lines, l = end - 1, len;
+
+  if (l < lo || l < 0)
+    return -1;
+  len = (p = hist_rec(h, l)) != NULL ? get16(p + 1) : 0;
+  while (l > lo && l > 0 && line_wrapped(h, l - 1))
+    len += line_cols(h, --l);
+  *firstp = l;
+  *rowsp = len ? (len + h->cols - 1) / h->cols : 1;
+  return 0;
+}
+
+/*
+ * Go n rows back (to older ones) from pos. Returns -1 if there are not
+ * that many.
+ */
+static int reflow_back(HIST *h, struct rpos *pos, int n)
+{
+  long long first;
+  int rows;
+
+  while (n > pos->piece) {
+    n -= pos->piece + 1;
+    if (wrapped_line(h, pos->line, &first, &rows) < 0)
+      return -1;
+    pos->line = first;
+    pos->piece = rows - 1;
+  }
+  pos->piece -= n;
+  return 0;
+}
+
+/*
+ * Where row j of the reflowed lines comes from, counting from the
+ * newest one. Returns -1 if there is no such row.
+ */
+static int reflow_row(HIST *h, int j, struct rpos *pos)
+{
+  struct rpos *m;
+  int k = j / RMARK_ROWS, rows;
+
+  while (h->nrmark <= k) {
+    if (h->rdone)
+      return -1;
+    if (h->nrmark == h->maxrmark) {
+      if ((m = realloc(h->rmark, (h->maxrmark + 64) *
+                       sizeof(struct rpos))) == NULL)
+        return -1;
+      h->rmark = m;
+      h->maxrmark += 64;
+    }
+    if (h->nrmark == 0) {
+      if (wrapped_line(h, h->rtotal, &pos->line, &rows) < 0) {
+        h->rdone = 1;
+        return -1;
+      }
+      pos->piece = rows - 1;
+    } else {
+      *pos = h->rmark[h->nrmark - 1];
+      if (reflow_back(h, pos, RMARK_ROWS) < 0) {
+        h->rdone = 1;
+        return -1;
+      }
+    }
+    h->rmark[h->nrmark++] = *pos;
+  }
+
+  /* Mostly the row next to the one before. */
+  if (h->rhintrow >= k * RMARK_ROWS && h->rhintrow <= j) {
+    *pos = h->rhint;
+    rows = j - h->rhintrow;
+  } else {
+    *pos = h->rmark[k];
+    rows = j - k * RMARK_ROWS;
+  }
+  if (reflow_back(h, pos, rows) < 0)
+    return -1;
+  h->rhint = *pos;
+  h->rhintrow = j;
+  return 0;
+}
+
+/*
+ * Put the row at pos in h->line.
+ */
+static ELM *reflow_get(HIST *h, const struct rpos *pos)
+{
+  const unsigned char *p = NULL;
+  long long l = pos->line;
+  long long at = 0;		/* Where line l starts in the wrapped line */
+  long long start = (long long)pos->piece * h->cols;
+  int x = 0, i, cols, wrapped;
+
+  while (x < h->cols) {
+    cols = line_cols(h, l);
+    wrapped = line_wrapped(h, l);
+    if (wrapped && at + cols <= start + x) {
+      at += cols;
+      l++;
+      continue;
+    }
+    p = hist_rec(h, l);
+    rec_decode(h, p, h->tmp, cols);
+    for (i = start + x - at; x < h->cols && i < cols; i++, x++)
+      h->line[x] = h->tmp[i];
+    if (!wrapped)
+      break;
+    at += cols;
+    l++;
+  }
+
+  /* The rest is blank, like the end of the last line. */
+  for (; x < h->cols; x++) {
+    h->line[x].value = ' ';
+    h->line[x].attr = p && (int)get16(p + 1) < cols ? p[5] : h->attr;
+    h->line[x].color = p && (int)get16(p + 1) < cols ? get16(p + 6) : h->color;
+  }
+  return h->line;
+}
+
+static void hist_exit(void)
+{
+  if (getpid() != hist_pid)
+    return;
+  while (hist_disk)
+    mc_histfree(hist_disk);
+  if (hist_dir)
+    rmdir(hist_dir);
+}
+
+/*
+ * Compress older segments from now on, or not.
+ */
+void mc_histgzip(int compress)
+{
+#ifdef HAVE_ZLIB_H
+  hist_gzip = compress;
+#else
+  (void)compress;
+#endif
+}
+
+/*
+ * Keep histories made from now on in dir, or in memory if dir is NULL
+ * or empty. A directory of our own is made in dir for the segment
+ * files, and removed again at exit. With compress, older segments are
+ * compressed if minicom has zlib. Returns -1 if dir cannot be used.
+ */
+int mc_histdir(const char *dir, int compress)
+{
+  char *p;
+
+  mc_histgzip(compress);
+  if (dir && *dir && hist_base && strcmp(dir, hist_base) == 0)
+    return 0;
+
+  if (hist_dir && hist_disk == NULL)
+    rmdir(hist_dir);
+  free(hist_base);
+  free(hist_dir);
+  hist_base = hist_dir = NULL;
+  if (dir == NULL || *dir == 0)
+    return 0;
+
+  if ((p = malloc(strlen(dir) + 20)) == NULL)
+    return -1;
+  sprintf(p, "%s/minicom.XXXXXX", dir);
+  if (mkdtemp(p) == NULL || (hist_base = strdup(dir)) == NULL) {
+    free(p);
+    return -1;
+  }
+  hist_dir = p;
+  if (hist_pid == 0 && atexit(hist_exit) == 0)
+    hist_pid = getpid();
+  return 0;
+}
+
+/*
+ * Make a history of lines lines of cols cells. Lines that were never
+ * added show up as blanks in attr and color.
+ */
+HIST *mc_histnew(int lines, int cols, char attr, unsigned short color)
+{
+  HIST *h;
+  int i;
+
+  if ((h = calloc(1, sizeof(HIST))) == NULL)
+    return NULL;
+  h->lines = lines;
+  h->cols = cols;
+  h->attr = attr;
+  h->color = color;
+  h->rhintrow = -1;
+  if ((h->line = malloc(cols * sizeof(ELM))) == NULL ||
+      (h->width = malloc(sizeof(struct width))) == NULL) {
+    mc_histfree(h);
+    return NULL;
+  }
+  h->width[0].first = 0;
+  h->width[0].cols = cols;
+  h->nwidth = 1;
+
+  if (hist_dir) {
+    h->plen = strlen(hist_dir);
+    if ((h->path = malloc(h->plen + 40)) == NULL) {
+      mc_histfree(h);
+      return NULL;
+    }
+    strcpy(h->path, hist_dir);
+    h->no = hist_no++;
+    for (i = 0; i < SEG_CACHE; i++)
+      h->cache[i].id = -1;
+    h->next = hist_disk;
+    hist_disk = h;
+    return h;
+  }
+
+  h->max = (size_t)lines * cols * sizeof(ELM);
+  if (h->max < HIST_MINBUF)
+    h->max = HIST_MINBUF;
+  h->nsig = lines / SIG_LINES + 2;
+  if ((h->off = malloc(lines * sizeof(int))) == NULL ||
+      (h->sig = malloc(h->nsig * SIG_BYTES)) == NULL) {
+    mc_histfree(h);
+    return NULL;
+  }
+  for (i = 0; i < lines; i++)
+    h->off[i] = -1;
+  return h;
+}
+
+void mc_histfree(HIST *h)
+{
+  HIST **hp, *o;
+  int k;
+
+  if (h == NULL)
+    return;
+  if (h->path) {
+    for (hp = &hist_disk; *hp; hp = &(*hp)->next)
+      if (*hp == h) {
+        *hp = h->next;
+        break;
+      }
+    seg_reap(h, 1);
+    for (k = 0; k < h->nseg; k++) {
+      seg_uncache(h, h->seg[k].id);
+      seg_name(h, h->seg[k].id, h->seg[k].gz);
+      unlink(h->path);
+    }
+    if (h->wmap)
+      munmap(h->wmap, SEG_SIZE);
+    /* The last one in a directory that is no longer used. */
+    h->path[h->plen] = 0;
+    for (o = hist_disk; o; o = o->next)
+      if (o->plen == h->plen && strncmp(o->path, h->path, h->plen) == 0)
+        break;
+    if (o == NULL && (hist_dir == NULL || strcmp(h->path, hist_dir)))
+      rmdir(h->path);
+    free(h->seg);
+    free(h->path);
+  }
+  free(h->width);
+  free(h->rmark);
+  free(h->tmp);
+  free(h->off);
+  free(h->sig);
+  free(h->buf);
+  free(h->line);
+  free(h);
+}
+
+/*
+ * Add line (w->xs cells) to the history of w, in place of its oldest
+ * line. With wrapped, it goes on in the next line.
+ */
+void mc_histadd(WIN *w, const ELM *line, int wrapped)
+{
+  HIST *h = w->histbuf;
+  unsigned char *sig;
+  int n, nruns, width, size;
+
+  if (h->path)
+    seg_add(h, line, wrapped);
+  else {
+    h->off[w->histline] = -1;
+    size = rec_size(h, line, &n, &nruns, &width);
+    if (hist_room(h, (w->histline + 1) % h->lines, size) == 0) {
+      h->off[w->histline] = h->used;
+      rec_put(h, h->buf + h->used, line, n, nruns, width, wrapped);
+      h->used += size;
+    }
+
+    /* A block in the ring is reused once all its lines are too old. */
+    sig = h->sig + (h->total / SIG_LINES % h->nsig) * SIG_BYTES;
+    if (h->total % SIG_LINES == 0)
+      memset(sig, 0, SIG_BYTES);
+    sig_add(sig, line, n);
+    h->total++;
+  }
+
+  w->histline++;
+  if (w->histline >= w->histlines)
+    w->histline = 0;
+}
+
+/*
+ * Number of lines added to the history of w so far. The difference
+ * between two calls is how far the lines in it have moved up.
+ */
+long long mc_histcount(WIN *w)
+{
+  return w->histbuf ? w->histbuf->total : 0;
+}
+
+/*
+ * Line i of the history of w, as w->xs ELMs. The line stays valid until
+ * the next call.
+ */
+ELM *mc_histline(WIN *w, int i)
+{
+  HIST *h = w->histbuf;
+  struct rpos pos;
+  int d;
+
+  /* Slot w->histline has the oldest line, the one before it the newest. */
+  d = (w->histline - i + h->lines) % h->lines;
+  if (d == 0)
+    d = h->lines;
+  if (h->total - d >= h->rtotal)
+    return rec_get(h, hist_rec(h, h->total - d));
+  if (reflow_row(h, d - (h->total - h->rtotal) - 1, &pos) < 0)
+    return rec_get(h, NULL);
+  return reflow_get(h, &pos);
+}
+
+/*
+ * Let h be the history of a new window of lines lines of cols cells.
+ * That can be if it has as many lines and is kept where new histories
+ * are; the lines in it are then reflowed to cols. Returns -1 if a new
+ * history has to be made.
+ */
+int mc_histkeep(HIST *h, int lines, int cols)
+{
+  struct width *wd;
+  ELM *e;
+  long long lo = h->total - h->lines;
+  int k, max;
+
+  if (h->lines != lines)
+    return -1;
+  if (h->path ? hist_dir == NULL || strncmp(h->path, hist_dir, h->plen) ||
+                hist_dir[h->plen] : hist_dir != NULL)
+    return -1;
+  if (cols == h->cols)
+    return 0;
+
+  /* The widths of lines that are gone are not needed any more. */
+  while (h->nwidth > 1 && h->width[1].first <= lo) {
+    h->nwidth--;
+    memmove(h->width, h->width + 1, h->nwidth * sizeof(struct width));
+  }
+  if ((wd = realloc(h->width, (h->nwidth + 1) * sizeof(struct width))) == NULL)
+    return -1;
+  h->width = wd;
+  if ((e = realloc(h->line, cols * sizeof(ELM))) == NULL)
+    return -1;
+  h->line = e;
+  for (k = 0, max = 0; k < h->nwidth; k++)
+    if (h->width[k].cols > max)
+      max = h->width[k].cols;
+  if ((e = realloc(h->tmp, max * sizeof(ELM))) == NULL)
+    return -1;
+  h->tmp = e;
+
+  wd = h->width + h->nwidth++;
+  wd->first = h->total;
+  wd->cols = cols;
+  h->cols = cols;
+  if (!h->path && (size_t)lines * cols * sizeof(ELM) > h->max)
+    h->max = (size_t)lines * cols * sizeof(ELM);
+
+  h->rtotal = h->total;
+  h->nrmark = 0;
+  h->rdone = 0;
+  h->rhintrow = -1;
+  return 0;
+}
+
+struct _hsearch {
+  int flags;
+  wchar_t *pat;			/* Plain text, folded for HS_ICASE */
+  regex_t re;
+  unsigned *tri;		/* Trigram bits a matching line has */
+  int ntri;
+  wchar_t *text;		/* The line being matched */
+  char *mtext;			/* The same as a string, for regexec() */
+  int size;
+};
+
+/*
+ * A line that contains run must have its trigrams.
+ */
+static int add_run(HSEARCH *s, const wchar_t *run, int n)
+{
+  unsigned *p;
+  int i;
+
+  if (n < 3)
+    return 0;
+  if ((p = realloc(s->tri, (s->ntri + n - 2) * sizeof(unsigned))) == NULL)
+    return -1;
+  s->tri = p;
+  for (i = 0; i + 2 < n; i++)
+    s->tri[s->ntri++] = tri_bit(fold(run[i]), fold(run[i + 1]),
+                                fold(run[i + 2]));
+  return 0;
+}
+
+/*
+ * The runs of plain characters in an extended regular expression, as
+ * far as every match must contain them: not inside groups, not when
+ * followed by *, ? or {}, and none if there is an alternative outside
+ * a group.
+ */
+static int re_runs(HSEARCH *s, const wchar_t *pat)
+{
+  wchar_t *run;
+  int n = 0, depth = 0, alt = 0, r = 0;
+
+  if ((run = calloc(wcslen(pat) + 1, sizeof(wchar_t))) == NULL)
+    return -1;
+
+  for (; *pat && r == 0; pat++) {
+    switch (*pat) {
+      case '\\':
+        if (pat[1] == 0)
+          break;
+        pat++;
+        if (depth == 0 && wcschr(L".[]()*+?{}|^$\\", *pat)) {
+          run[n++] = *pat;
+          continue;
+        }
+        break;
+      case '[':
+        /* Skip the bracket expression, classes like [:alpha:] too. */
+        pat++;
+        if (*pat == '^')
+          pat++;
+        if (*pat == ']')
+          pat++;
+        for (; *pat && *pat != ']'; pat++)
+          if (*pat == '[' && pat[1] && wcschr(L":.=", pat[1])) {
+            pat += 2;
+            while (pat[0] && pat[1] && pat[1] != ']')
+              pat++;
+            if (pat[0] && pat[1])
+              pat++;
+          }
+        if (*pat == 0)
+          pat--;
+        break;
+      case '(':
+        depth++;
+        break;
+      case ')':
+        depth--;
+        break;
+      case '|':
+        if (depth == 0)
+          alt = 1;
+        break;
+      case '{':
+        while (pat[1] && *pat != '}')
+          pat++;
+        /* FALLTHRU */
+      case '*':
+      case '?':
+        /* The character before may not be there. */
+        if (n)
+          n--;
+        break;
+      case '+':
+      case '.':
+      case '^':
+      case '$':
+        break;
+      default:
+        if (depth == 0) {
+          run[n++] = *pat;
+          continue;
+        }
+        break;
+    }
+    r = add_run(s, run, n);
+    n = 0;
+  }
+  if (r == 0)
+    r = add_run(s, run, n);
+  if (alt)
+    s->ntri = 0;
+  free(run);
+  return r;
+}
+
+/*
+ * Prepare a search for pat: plain text, or with HS_REGEX an extended
+ * regular expression. With HS_ICASE case does not matter. Returns NULL
+ * if pat is no good, with the reason in err.
+ */
+HSEARCH *mc_histsearch(const wchar_t *pat, int flags, char *err,
+                       size_t errlen)
+{
+  HSEARCH *s;
+  size_t len = wcslen(pat), i;
+  char *mpat;
+  int r;
+
+  snprintf(err, errlen, "%s", strerror(ENOMEM));
+  if ((s = calloc(1, sizeof(HSEARCH))) == NULL)
+    return NULL;
+  s->flags = flags;
+
+  if (flags & HS_REGEX) {
+    if ((mpat = malloc(len * MB_CUR_MAX + 1)) == NULL) {
+      free(s);
+      return NULL;
+    }
+    if (wcstombs(mpat, pat, len * MB_CUR_MAX + 1) == (size_t)-1) {
+      snprintf(err, errlen, "%s", strerror(EILSEQ));
+      free(mpat);
+      free(s);
+      return NULL;
+    }
+    r = regcomp(&s->re, mpat, REG_EXTENDED | REG_NOSUB |
+                              (flags & HS_ICASE ? REG_ICASE : 0));
+    free(mpat);
+    if (r != 0) {
+      regerror(r, &s->re, err, errlen);
+      free(s);
+      return NULL;
+    }
+    if (re_runs(s, pat) < 0) {
+      mc_histsearchfree(s);
+      return NULL;
+    }
+    return s;
+  }
+
+  if ((s->pat = malloc((len + 1) * sizeof(wchar_t))) == NULL) {
+    free(s);
+    return NULL;
+  }
+  for (i = 0; i <= len; i++)
+    s->pat[i] = flags & HS_ICASE ? (wchar_t)fold(pat[i]) : pat[i];
+  if (add_run(s, pat, len) < 0) {
+    mc_histsearchfree(s);
+    return NULL;
+  }
+  return s;
+}
+
+void mc_histsearchfree(HSEARCH *s)
+{
+  if (s == NULL)
+    return;
+  if (s->flags & HS_REGEX)
+    regfree(&s->re);
+  free(s->pat);
+  free(s->tri);
+  free(s->text);
+  free(s->mtext);
+  free(s);
+}
+
+/*
+ * Does a line of len cells match?
+ */
+int mc_histmatch(HSEARCH *s, const ELM *line, int len)
+{
+  mbstate_t ps;
+  wchar_t *t;
+  char *m;
+  size_t k;
+  int i;
+
+  /* Blanks at the end do not count. */
+  while (len > 0 && line[len - 1].value == ' ')
+    len--;
+  if (len + 1 > s->size) {
+    if ((t = realloc(s->text, (len + 1) * sizeof(wchar_t))) == NULL)
+      return 0;
+    s->text = t;
+    if ((m = realloc(s->mtext, len * MB_CUR_MAX + 1)) == NULL)
+      return 0;
+    s->mtext = m;
+    s->size = len + 1;
+  }
+
+  if (!(s->flags & HS_REGEX)) {
+    for (i = 0; i < len; i++)
+      s->text[i] = s->flags & HS_ICASE ? (wchar_t)fold(line[i].value) :
+                                         line[i].value;
+    s->text[len] = 0;
+    return wcsstr(s->text, s->pat) != NULL;
+  }
+
+  memset(&ps, 0, sizeof(ps));
+  for (i = 0, m = s->mtext; i < len; i++) {
+    if (line[i].value <= 0 || (k = wcrtomb(m, line[i].value, &ps)) ==
+        (size_t)-1) {
+      memset(&ps, 0, sizeof(ps));
+      *m++ = '?';
+    } else
+      m += k;
+  }
+  *m = 0;
+  return regexec(&s->re, s->mtext, 0, NULL, 0) == 0;
+}
+
+/*
+ * May a line of a block with trigram bits sig match?
+ */
+static int sig_maybe(const unsigned char *sig, HSEARCH *s)
+{
+  int i;
+
+  for (i = 0; i < s->ntri; i++)
+    if (!(sig[s->tri[i] >> 3] & (1 << (s->tri[i] & 7))))
+      return 0;
+  return 1;
+}
+
+/* The hits of mc_histgrep(): the newest max of them. */
+struct grep {
+  int *hits;
+  int n, size, max;
+  int head;			/* The oldest, once there are max */
+  int count;			/* All hits */
+};
+
+/*
+ * Add hit no. Going back (newest first) the older ones are only
+ * counted once there are max; going forward the oldest is replaced.
+ */
+static int grep_add(struct grep *g, int no, int back)
+{
+  int *p, size;
+
+  g->count++;
+  if (g->n == g->max) {
+    if (!back) {
+      g->hits[g->head] = no;
+      g->head = (g->head + 1) % g->max;
+    }
+    return 0;
+  }
+  if (g->n == g->size) {
+    size = g->size ? 2 * g->size : 256;
+    if (size > g->max)
+      size = g->max;
+    if ((p = realloc(g->hits, size * sizeof(int))) == NULL)
+      return -1;
+    g->hits = p;
+    g->size = size;
+  }
+  g->hits[g->n++] = no;
+  return 0;
+}
+
+static void grep_rev(int *v, int n)
+{
+  int k, t;
+
+  for (k = 0; k < n / 2; k++) {
+    t = v[k];
+    v[k] = v[n - k - 1];
+    v[n - k - 1] = t;
+  }
+}
+
+/*
+ * Find the lines of the history of w that match s. The newest max of
+ * them are put in *hitsp in the numbering of mc_histline() counted
+ * from w->histline, oldest first. Returns the number of lines that
+ * match, which may be more than max, or -1 if out of memory.
+ */
+int mc_histgrep(WIN *w, HSEARCH *s, int max, int **hitsp)
+{
+  HIST *h = w->histbuf;
+  long long base = h->total - h->lines, from, l, end, first;
+  const unsigned char *p;
+  struct seg *sg;
+  struct rpos pos;
+  struct grep g;
+  int k, b, row, rows;
+
+  memset(&g, 0, sizeof(g));
+  g.max = max > 0 ? max : 1;
+
+  /* The reflowed lines, newest first; a line on its own may be skipped
+   * on the trigrams of its block. */
+  from = base;
+  if (h->rtotal > base) {
+    from = h->rtotal;
+    row = h->total - h->rtotal;
+    for (end = h->rtotal; row < h->lines &&
+         wrapped_line(h, end, &first, &rows) == 0; end = first) {
+      if (end - first == 1 && (p = hist_sig(h, first)) != NULL &&
+          !sig_maybe(p, s)) {
+        row += rows;
+        continue;
+      }
+      pos.line = first;
+      for (pos.piece = rows - 1; pos.piece >= 0 && row < h->lines;
+           pos.piece--, row++)
+        if (mc_histmatch(s, reflow_get(h, &pos), h->cols) &&
+            grep_add(&g, h->lines - row - 1, 1) < 0)
+          goto nomem;
+    }
+    grep_rev(g.hits, g.n);
+  }
+
+  if (h->path) {
+    for (k = 0; k < h->nseg; k++) {
+      sg = h->seg + k;
+      if (sg->first + sg->count <= from || (p = seg_data(h, k)) == NULL)
+        continue;
+      for (b = 0; b * SIG_LINES < sg->count; b++) {
+        if (!sig_maybe(SEG_SIG(p, b), s))
+          continue;
+        l = sg->first + b * SIG_LINES;
+        end = l + SIG_LINES < sg->first + sg->count ?
+              l + SIG_LINES : sg->first + sg->count;
+        for (; l < end; l++)
+          if (l >= from &&
+              mc_histmatch(s, rec_get(h, p + get32(SEG_OFF(p, l - sg->first))),
+                           h->cols) &&
+              grep_add(&g, l - base, 0) < 0)
+            goto nomem;
+      }
+    }
+  } else {
+    for (l = from > 0 ? from : 0; l < h->total; l = end) {
+      end = (l / SIG_LINES + 1) * SIG_LINES;
+      if (end > h->total)
+        end = h->total;
+      if (!sig_maybe(h->sig + (l / SIG_LINES % h->nsig) * SIG_BYTES, s))
+        continue;
+      for (; l < end; l++) {
+        k = l % h->lines;
+        if (h->off[k] >= 0 &&
+            mc_histmatch(s, rec_get(h, h->buf + h->off[k]), h->cols) &&
+            grep_add(&g, l - base, 0) < 0)
+          goto nomem;
+      }
+    }
+  }
+  /* Oldest first again. */
+  grep_rev(g.hits, g.head);
+  grep_rev(g.hits + g.head, g.n - g.head);
+  grep_rev(g.hits, g.n);
+  *hitsp = g.hits;
+  return g.count;
+
+nomem:
+  free(g.hits);
+  *hitsp = NULL;
+  return -1;
+}
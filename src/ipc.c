@@ -25,20 +25,79 @@
 #include "minicom.h"
 #include "intl.h"
 
+/* When the data read_buf() returned came in. */
+static struct rxtime rb_times[RXTIMES];
+static const struct rxtime *rb_tp = rb_times;
+static int rb_ntimes;
+
+static void rb_stamp(int off)
+{
+  if (rb_ntimes == RXTIMES)
+    return;
+  rb_times[rb_ntimes].off = off;
+  clock_gettime(CLOCK_MONOTONIC, &rb_times[rb_ntimes].mono);
+  clock_gettime(CLOCK_REALTIME, &rb_times[rb_ntimes].real);
+  rb_ntimes++;
+}
+
 int read_buf(int fd, char *buf, int bufsize)
 {
-  int i = read(fd, buf, bufsize - 1);
+  int i;
+
+  rb_tp = rb_times;
+  rb_ntimes = 0;
+
+  /* If the reader thread has it, there is nothing to wait for. */
+  if (rx_active(fd)) {
+    i = rx_read(buf, bufsize - 1);
+    if (i < 0 && errno == EAGAIN) {
+      buf[0] = 0;
+      return -1;
+    }
+    /* The thread took the time of each read(). */
+    rb_ntimes = rx_times(&rb_tp);
+  } else {
+    i = read(fd, buf, bufsize - 1);
+    if (i > 0)
+      rb_stamp(0);
+  }
 
   if (i < 1 && portfd_is_socket && portfd == fd) {
     term_socket_close();
     i = 0;
   }
 
+  /* Take everything the kernel already has that fits, so that a
+   * flood is handled in as few passes through the main loop as
+   * possible. */
+  while (i > 0 && i < bufsize - 1 && !rx_active(fd)) {
+    int n = m_readchk(fd);
+
+    if (n <= 0)
+      break;
+    if (n > bufsize - 1 - i)
+      n = bufsize - 1 - i;
+    if ((n = read(fd, buf + i, n)) <= 0)
+      break;
+    rb_stamp(i);
+    i += n;
+  }
+
   buf[i > 0 ? i : 0] = 0;
 
   return i;
 }
 
+/*
+ * When the data that read_buf() returned last came in: the time of
+ * each read() it took.
+ */
+int read_buf_times(const struct rxtime **t)
+{
+  *t = rb_tp;
+  return rb_ntimes;
+}
+
 /* Check if there is IO pending. */
 static int check_io(int fd1, int fd2, int tmout, char *buf,
                     int bufsize, int *bytes_read)
@@ -83,9 +142,58 @@ static int check_io(int fd1, int fd2, int tmout, char *buf,
   return n;
 }
 
+/*
+ * Wait for the modem, the keyboard or one of the other event sources
+ * registered with the reactor, at most tmout milliseconds.
+ */
+static int check_io_reactor(int tmout, char *buf, int bufsize,
+                            int *bytes_read)
+{
+  int fd = portfd_connected();
+  int n, i = 0;
+
+  /* Have the port read by the reader thread and wait for that, or
+   * else watch the port itself. Both are no-ops if already done.
+   * device_close() and term_socket_close() undo it again. */
+  if (fd >= 0 && rx_start(fd) == 0)
+    reactor_add(rx_notify_fd(), IO_PORT, NULL, NULL);
+  else
+    reactor_add(fd, IO_PORT, NULL, NULL);
+
+  if (io_pending)
+    n = IO_INPUT;
+  else
+    n = reactor_wait(tmout);
+
+  if ((n & IO_PORT) && fd >= 0) {
+    i = read_buf(fd, buf, bufsize);
+    /* Woken up for data that was already taken. */
+    if (i < 0 && errno == EAGAIN) {
+      i = 0;
+      n &= ~IO_PORT;
+    }
+  } else
+    n &= ~IO_PORT;
+
+  if (bytes_read)
+    *bytes_read = i;
+
+  return n;
+}
+
 int check_io_frontend(char *buf, int buf_size, int *bytes_read)
 {
-  return check_io(portfd_connected(), 0, 1000, buf, buf_size, bytes_read);
+  return check_io_reactor(1000, buf, buf_size, bytes_read);
+}
+
+/*
+ * Like check_io_frontend(), but sleep until something happens. The
+ * status line clock and window size changes are reported as IO_TICK
+ * and IO_RESIZE.
+ */
+int check_io_events(char *buf, int buf_size, int *bytes_read)
+{
+  return check_io_reactor(-1, buf, buf_size, bytes_read);
 }
 
 bool check_io_input(int timeout_ms)
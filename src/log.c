@@ -0,0 +1,398 @@
+/*
+ * log.c	Writing the log file.
+ *
+ *		Entry points:
+ *
+ *		do_log(fmt, ...)   - write a line to the logfile
+ *		log_option(key, value) - buffering and format, from
+ *		                     -O log-...
+ *		log_reopen()       - reopen the file before the next line
+ *		log_tick()         - write out buffered lines that are due
+ *		log_close()        - write out what is left and close it
+ *
+ *		The file is kept open. Each line is written as it is
+ *		logged (line buffering, the default), collected and
+ *		written in blocks (full), or handed to a writer thread
+ *		(async), so logging never waits for the disk. After a
+ *		SIGUSR1, e.g. from logrotate, the file is opened again
+ *		by name. (Not SIGHUP: that is how we learn that our
+ *		terminal went away.)
+ *
+ *		Lines are either text, as always, or JSON objects with
+ *		the time of day, a monotonic time in ns and the pid.
+ *
+ *		This file is part of the minicom communications package,
+ *		Copyright 1991-1995 Miquel van Smoorenburg.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <config.h>
+#include <limits.h>
+
+#include "port.h"
+#include "minicom.h"
+#include <stdarg.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* With full buffering, lines are written in blocks of this size. */
+#define LOG_BLOCK	4096
+
+enum { LOG_LINE, LOG_FULL, LOG_ASYNC };
+
+static int log_mode = LOG_LINE;
+static int log_json;
+
+static volatile sig_atomic_t log_hupped;	/* Set by log_reopen() */
+
+/* Lines not written yet. */
+static char *lbuf;
+static size_t llen, lsize;
+static char log_want[PATH_MAX];	/* Where they should go */
+static int log_newfile;		/* Close the file first */
+static time_t log_written;	/* When lbuf was last written */
+static time_t log_since;	/* When the oldest line in it came */
+static pid_t log_pid;
+
+/* The writer's. */
+static char log_path[PATH_MAX];	/* The file log_fd is */
+static int log_fd = -1;
+
+static void log_out(const char *path, const char *s, size_t len, int newfile)
+{
+  ssize_t n;
+
+  if (log_fd >= 0 && (newfile || strcmp(path, log_path))) {
+    close(log_fd);
+    log_fd = -1;
+  }
+  if (len == 0)
+    return;
+  if (log_fd < 0) {
+    log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (log_fd < 0)
+      return;
+    strcpy(log_path, path);
+  }
+  while (len > 0) {
+    if ((n = write(log_fd, s, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    s += n;
+    len -= n;
+  }
+}
+
+#ifdef HAVE_PTHREAD_H
+static pthread_t log_tid;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static int log_thread;		/* The writer is running */
+static int stopping;
+
+static void *log_loop(void *arg)
+{
+  char path[PATH_MAX], *buf = NULL, *p;
+  size_t size = 0, len;
+  int newfile;
+
+  (void)arg;
+  pthread_mutex_lock(&log_lock);
+  while (1) {
+    while (llen == 0 && !log_newfile && !stopping)
+      pthread_cond_wait(&log_cond, &log_lock);
+    if (llen == 0 && !log_newfile)
+      break;
+
+    /* Take the lines and leave an empty buffer. */
+    p = lbuf;
+    lbuf = buf;
+    buf = p;
+    len = lsize;
+    lsize = size;
+    size = len;
+    len = llen;
+    llen = 0;
+    newfile = log_newfile;
+    log_newfile = 0;
+    strcpy(path, log_want);
+
+    pthread_mutex_unlock(&log_lock);
+    log_out(path, buf, len, newfile);
+    pthread_mutex_lock(&log_lock);
+  }
+  pthread_mutex_unlock(&log_lock);
+  free(buf);
+  return NULL;
+}
+
+static void log_start(void)
+{
+  sigset_t all, old;
+
+  if (log_thread)
+    return;
+  stopping = 0;
+
+  /* Signals are for the main thread only. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if (pthread_create(&log_tid, NULL, log_loop, NULL) == 0)
+    log_thread = 1;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void log_stop(void)
+{
+  if (!log_thread)
+    return;
+  pthread_mutex_lock(&log_lock);
+  stopping = 1;
+  pthread_cond_signal(&log_cond);
+  pthread_mutex_unlock(&log_lock);
+  pthread_join(log_tid, NULL);
+  log_thread = 0;
+}
+
+#define LOCK()		pthread_mutex_lock(&log_lock)
+#define UNLOCK()	pthread_mutex_unlock(&log_lock)
+#define WAKE()		pthread_cond_signal(&log_cond)
+#else
+#define log_thread	0
+#define log_start()	do { } while (0)
+#define log_stop()
+#define LOCK()
+#define UNLOCK()
+#define WAKE()
+#endif
+
+/* Write out lbuf, unless the writer thread does that. */
+static void log_flush(void)
+{
+  if (log_thread) {
+    WAKE();
+    return;
+  }
+  log_out(log_want, lbuf, llen, log_newfile);
+  llen = 0;
+  log_newfile = 0;
+  log_written = time(NULL);
+}
+
+static void log_exit(void)
+{
+  if (getpid() == log_pid)
+    log_close();
+}
+
+/*
+ * Write out everything and close the file.
+ */
+void log_close(void)
+{
+  log_stop();
+  log_flush();
+  if (log_fd >= 0)
+    close(log_fd);
+  log_fd = -1;
+}
+
+/*
+ * Open the file again before the next line. Safe to call from a
+ * signal handler.
+ */
+void log_reopen(void)
+{
+  log_hupped = 1;
+}
+
+#ifdef LOGFILE
+/* Add a string to s for a JSON value, with quotes. */
+static char *json_str(char *s, const char *v)
+{
+  static const char hex[] = "0123456789abcdef";
+  unsigned char c;
+
+  *s++ = '"';
+  for (; (c = *v); v++) {
+    if (c == '"' || c == '\\') {
+      *s++ = '\\';
+      *s++ = c;
+    } else if (c < 0x20) {
+      s += sprintf(s, "\\u00%c%c", hex[c >> 4], hex[c & 15]);
+    } else
+      *s++ = c;
+  }
+  *s++ = '"';
+  return s;
+}
+
+/*
+ * Make a log line from msg in buf, which has room for it (see
+ * do_log()). Returns its length.
+ */
+static size_t log_format(char *buf, const char *msg)
+{
+  static time_t last;
+  static char stamp[24], zone[8];	/* The time of day for last */
+  struct timespec now, mono;
+  struct tm tm;
+  char *s = buf;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (now.tv_sec != last || stamp[0] == 0) {
+    /* localtime() only once a second. */
+    localtime_r(&now.tv_sec, &tm);
+    if (log_json) {
+      strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+      strftime(zone, sizeof(zone), "%z", &tm);
+      /* +hhmm to +hh:mm */
+      memmove(zone + 4, zone + 3, 3);
+      zone[3] = ':';
+    } else
+      strftime(stamp, sizeof(stamp), "%Y%m%d %H:%M:%S", &tm);
+    last = now.tv_sec;
+  }
+
+  if (!log_json)
+    return sprintf(buf, "%s %s\n", stamp, msg);
+
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  s += sprintf(s, "{\"time\":\"%s.%03ld%s\",\"mono_ns\":%lld,"
+               "\"pid\":%ld,\"msg\":", stamp, now.tv_nsec / 1000000, zone,
+               mono.tv_sec * 1000000000LL + mono.tv_nsec, (long)getpid());
+  s = json_str(s, msg);
+  s += sprintf(s, "}\n");
+  return s - buf;
+}
+#endif
+
+void do_log(const char *line, ...)
+{
+#ifdef LOGFILE
+/* Write a line to the log file.   jl 22.06.97 */
+  char msg[512], *m = msg, *p;
+  size_t need;
+  va_list ap;
+  int n;
+
+  if (logfname[0] == 0)
+    return;
+
+  va_start(ap, line);
+  n = vsnprintf(msg, sizeof(msg), line, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  if ((size_t)n >= sizeof(msg)) {
+    if ((m = malloc(n + 1)) == NULL)
+      return;
+    va_start(ap, line);
+    vsnprintf(m, n + 1, line, ap);
+    va_end(ap);
+  }
+  /* Room for the worst case of escaping and the rest of a JSON line. */
+  need = n * 6 + 128;
+
+  LOCK();
+  if (llen == 0)
+    log_since = time(NULL);
+  if (llen + need > lsize) {
+    if ((p = realloc(lbuf, llen + need)) == NULL)
+      goto out;
+    lbuf = p;
+    lsize = llen + need;
+  }
+  llen += log_format(lbuf + llen, m);
+
+  p = pfix_home(logfname);
+  if (strcmp(p, log_want)) {
+    snprintf(log_want, sizeof(log_want), "%s", p);
+    log_newfile = 1;
+  }
+  if (log_hupped) {
+    log_hupped = 0;
+    log_newfile = 1;
+  }
+
+  if (log_pid == 0 && atexit(log_exit) == 0)
+    log_pid = getpid();
+  if (log_mode == LOG_ASYNC)
+    log_start();
+  if (log_mode != LOG_FULL || llen >= LOG_BLOCK ||
+      time(NULL) - log_written > 1)
+    log_flush();
+out:
+  UNLOCK();
+  if (m != msg)
+    free(m);
+#else
+  /* dummy, don't do anything */
+  (void)line;
+#endif
+}
+
+/*
+ * With full buffering, write out the lines from before this second.
+ * Returns the ms until the rest is due, -1 if nothing is waiting.
+ */
+long log_tick(void)
+{
+  struct timespec now;
+  long ms = -1;
+
+  if (log_mode != LOG_FULL)
+    return -1;
+  LOCK();
+  if (llen) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec != log_since)
+      log_flush();
+    else
+      ms = 1000 - now.tv_nsec / 1000000;
+  }
+  UNLOCK();
+  return ms;
+}
+
+/*
+ * Set an option from -O log-key=value: buffer line, full or async,
+ * format text or json. Returns -1 if it is not one.
+ */
+int log_option(const char *key, const char *value)
+{
+  if (value == NULL)
+    return -1;
+
+  if (!strcmp(key, "buffer")) {
+    if (!strcmp(value, "line"))
+      log_mode = LOG_LINE;
+    else if (!strcmp(value, "full"))
+      log_mode = LOG_FULL;
+    else if (!strcmp(value, "async"))
+      log_mode = LOG_ASYNC;
+    else
+      return -1;
+  } else if (!strcmp(key, "format")) {
+    if (!strcmp(value, "text"))
+      log_json = 0;
+    else if (!strcmp(value, "json"))
+      log_json = 1;
+    else
+      return -1;
+    /* runscript writes to the same file. */
+    setenv("MINICOM_LOG_FORMAT", value, 1);
+  } else
+    return -1;
+  return 0;
+}
@@ -230,6 +230,9 @@ void term_socket_connect(void)
  */
 void term_socket_close(void)
 {
+  tx_discard();
+  rx_stop();
+  reactor_del(portfd);
   close(portfd);
   portfd_is_connected = 0;
   portfd = -1;
@@ -355,6 +358,9 @@ void device_close()
   if (portfd > 0)
     {
       lockfile_remove();
+      tx_drain();
+      rx_stop();
+      reactor_del(portfd);
       close(portfd);
     }
   portfd = -1;
@@ -446,8 +452,10 @@ nolock:
 
   /* Set Hangup on Close if program crashes. (Hehe) */
   m_hupcl(portfd, 1);
-  if (doinit > 0)
+  if (doinit > 0) {
     m_flush(portfd);
+    rx_flush();
+  }
   return 0;
 }
 
@@ -468,17 +476,8 @@ static void do_output(const char *s, int len)
     s = buf;
   }
 
-  int r;
-  int b = vt_ch_delay ? 1 : len;
-  while (len && (r = write(portfd, s, b)) >= 0)
-    {
-      s   += r;
-      len -= r;
-      if (vt_ch_delay)
-        usleep(vt_ch_delay * 1000);
-      else
-        b = len;
-    }
+  /* Character and newline delays are applied by the queue. */
+  tx_write(s, len);
 }
 
 /* Function to handle keypad mode switches. */
@@ -489,6 +488,24 @@ static void kb_handler(int a, int b)
   show_status();
 }
 
+static HIST *kept_hist;		/* From the window being reopened */
+static int kept_histline;
+
+/*
+ * Take the history from us before it is closed, for init_emul() to give
+ * to the new window.
+ */
+static void keep_hist(void)
+{
+  if (us == NULL || us->histbuf == NULL)
+    return;
+  mc_histfree(kept_hist);
+  kept_hist = us->histbuf;
+  kept_histline = us->histline;
+  us->histbuf = NULL;
+  us->histlines = 0;
+}
+
 /*
  * Initialize screen and status line.
  */
@@ -498,6 +515,8 @@ void init_emul(int type, int do_init)
   char attr = 0;
   int maxy;
   int ypos;
+  int histmax;
+  HIST *hist;
 
   if (st) {
     mc_wclose(st, 1);
@@ -509,6 +528,7 @@ void init_emul(int type, int do_init)
     x = us->curx;
     y = us->cury;
     attr = us->attr;
+    keep_hist();
     mc_wclose(us, 0);
   }
 
@@ -532,12 +552,37 @@ void init_emul(int type, int do_init)
   num_hist_lines = atoi(P_HISTSIZE);
   if (num_hist_lines < 0)
     num_hist_lines = 0;
-  if (num_hist_lines > 5000)
-    num_hist_lines = 5000;
+
+  /* On disk the history can be much larger. */
+  histmax = HIST_MAXMEM;
+  if (P_HISTDIR[0]) {
+    if (mc_histdir(pfix_home(P_HISTDIR), P_HISTGZIP[0] == 'Y') == 0)
+      histmax = HIST_MAXDISK;
+    else {
+      mc_histdir(NULL, 0);
+      werror(_("Cannot use history directory %s"), P_HISTDIR);
+    }
+  } else
+    mc_histdir(NULL, 0);
+  if (num_hist_lines > histmax)
+    num_hist_lines = histmax;
+
+  /* Keep the old history, reflowed to the new width, if it still fits. */
+  hist = kept_hist;
+  kept_hist = NULL;
+  if (hist && mc_histkeep(hist, num_hist_lines, COLS) < 0) {
+    mc_histfree(hist);
+    hist = NULL;
+  }
 
   /* Open a new main window, and define the configured history buffer size. */
-  us = mc_wopen(0, 0, COLS - 1, maxy,
-              BNONE, XA_NORMAL, tfcolor, tbcolor, 1, num_hist_lines, 0);
+  us = mc_wopen(0, 0, COLS - 1, maxy, BNONE, XA_NORMAL, tfcolor, tbcolor,
+                1, hist ? 0 : num_hist_lines, 0);
+  if (hist) {
+    us->histbuf = hist;
+    us->histlines = num_hist_lines;
+    us->histline = kept_histline;
+  }
 
   if (x >= 0) {
     mc_wlocate(us, x, y);
@@ -846,21 +891,356 @@ static void showtemp(void)
   tempst = 1;
 }
 
+/*
+ * How long the status line can do without an update: a second while
+ * something on it changes by the second or the device has to be polled,
+ * otherwise until the online time shown changes its minutes.
+ */
+static long status_clock_interval(void)
+{
+  int dcd_support = portfd_is_socket || P_HASDCD[0] == 'Y';
+
+  if (status_message_showing || dcd_support || portfd_connected() < 0)
+    return 1000;
+  if (online >= 0)
+    return (60 - online % 60) * 1000;
+  return 60000;
+}
+
+/* Write out buffered log lines when they are due, and wait for the rest. */
+static int log_clock = -1;
+
+static int log_due(int fd, void *arg)
+{
+  long ms;
+
+  (void)fd;
+  (void)arg;
+  if ((ms = log_tick()) > 0)
+    reactor_timer_set(log_clock, ms, 0);
+  return 0;
+}
+
+/*
+ * Receive buffer of the terminal loop. It is sized for about 50ms
+ * worth of data at the current line speed, and doubled whenever a
+ * read fills it up completely, i.e. when we are falling behind.
+ */
+#define RXBUF_MIN	256
+#define RXBUF_MAX	65536
+
+static char *rxbuf;	/* Data read from the port */
+static char *rxobuf;	/* Same, after charset conversion */
+static int rxbuf_size;
+
+static int rxbuf_want(void)
+{
+  long speed = linespd > 0 ? linespd : atol(P_BAUDRATE);
+  int size = RXBUF_MIN;
+
+  /* 10 bits per character, 1/20th of a second */
+  while (size < RXBUF_MAX && size < speed / 200)
+    size <<= 1;
+  return size;
+}
+
+/* Make the buffers at least 'size' bytes, keeping their contents. */
+static void rxbuf_grow(int size)
+{
+  char *p;
+
+  if (size > RXBUF_MAX)
+    size = RXBUF_MAX;
+  if (size <= rxbuf_size)
+    return;
+
+  if ((p = realloc(rxbuf, size)) == NULL)
+    return;
+  rxbuf = p;
+  if ((p = realloc(rxobuf, size)) == NULL)
+    return;
+  rxobuf = p;
+  rxbuf_size = size;
+}
+
+static int rxbuf_offset;	/* Start of a partial character kept in rxbuf */
+static int rx_pending;		/* Read by port_getkey(), not shown yet */
+static int zpos;		/* How much of the zmodem signature was seen */
+/* When the data in rxbuf came in, offsets into rxbuf. */
+static struct rxtime rxtimes[RXTIMES];
+static int nrxtimes;
+
+/*
+ * Wait for I/O or a timer. What was read from the port is in rxbuf,
+ * blen bytes. A failing read is reported as a tick too, so that the
+ * device is checked at once.
+ */
+static int rx_wait(int *blen)
+{
+  int x;
+
+  x = check_io_events(rxbuf + rxbuf_offset, rxbuf_size - rxbuf_offset, blen);
+  if (!(x & IO_PORT))
+    return x;
+  if (*blen <= 0)
+    x |= IO_TICK;
+  record_data(REC_IN, rxbuf + rxbuf_offset, *blen);
+  if (*blen > 0) {
+    const struct rxtime *t;
+    int i;
+
+    /* A partial character left over belongs to the first read. */
+    nrxtimes = read_buf_times(&t);
+    for (i = 0; i < nrxtimes; i++) {
+      rxtimes[i] = t[i];
+      rxtimes[i].off = i ? t[i].off + rxbuf_offset : 0;
+    }
+  }
+  /* A full buffer means there is a backlog: use a larger one. */
+  if (*blen > 0 && *blen >= rxbuf_size - 1 - rxbuf_offset)
+    rxbuf_grow(rxbuf_size * 2);
+  *blen += rxbuf_offset;
+  rxbuf_offset = 0;
+  return x;
+}
+
+/*
+ * Send blen bytes from rxbuf to the screen. With zauto set, stops right
+ * after a zmodem signature and returns 1.
+ */
+static int rx_show(int blen, int zauto)
+{
+  static const char zsig[] = "**\030B00";
+  char *buf = rxbuf;
+  char *obuf = rxobuf;
+  char *ptr;
+  int c, lim, pos = 0, t = 0, ret = 0;
+
+  /* Single byte charsets are converted by vt_out_buf(). */
+  if (using_iconv() && !using_iconv_table()) {
+    char *otmp = obuf;
+    size_t output_len = rxbuf_size;
+    size_t input_len = blen;
+
+    ptr = buf;
+    do_iconv(&ptr, &input_len, &otmp, &output_len);
+
+    // something happened at all?
+    if (output_len < (size_t)rxbuf_size)
+      {
+        if (input_len)
+          { // something remained, we need to adapt buf accordingly
+            memmove(buf, ptr, input_len);
+            rxbuf_offset = input_len;
+          }
+
+        blen = rxbuf_size - output_len;
+        ptr = obuf;
+        /* The offsets don't match any more: all of it gets the time
+         * of the first read. */
+        t = nrxtimes;
+        if (nrxtimes)
+          vt_settime(&rxtimes[0]);
+      }
+    else
+      ptr = buf;
+  } else {
+    ptr = buf;
+  }
+
+  if (P_PARITY[0] == 'M' || P_PARITY[0] == 'S')
+    for (c = 0; c < blen; c++)
+      ptr[c] &= 0x7f;
+
+  while (blen > 0) {
+    int n = blen;
+
+    /* Line timestamps come from when the data was read. */
+    while (t < nrxtimes && rxtimes[t].off <= pos)
+      vt_settime(&rxtimes[t++]);
+    if (t < nrxtimes && rxtimes[t].off - pos < n)
+      n = rxtimes[t].off - pos;
+    lim = n;
+
+    /* Auto zmodem detect: stop right after the signature. */
+    if (zauto)
+      for (n = 0; n < lim && zsig[zpos]; n++) {
+        if (zsig[zpos] == ptr[n])
+          zpos++;
+        else
+          zpos = 0;
+      }
+
+    if (display_hex) {
+      for (c = 0; c < n; c++) {
+        unsigned char l = ptr[c];
+        unsigned char u = l >> 4;
+        l &= 0xf;
+        vt_out(u > 9 ? 'a' + (u - 10) : '0' + u, 0);
+        vt_out(l > 9 ? 'a' + (l - 10) : '0' + l, 0);
+        vt_out(' ', 0);
+      }
+    } else
+      vt_out_buf(ptr, n);
+    blen -= n;
+    ptr += n;
+    pos += n;
+
+    if (zauto && zsig[zpos] == 0) {
+      zpos = 0;
+      ret = 1;
+      break;
+    }
+  }
+  vt_settime(NULL);
+  nrxtimes = 0;
+  return ret;
+}
+
+/*
+ * Wait for a key like wxgetch(), but keep reading from the port in the
+ * meantime, e.g. while the history is shown. Returns 1 with the key in
+ * *key, or 0 when data was read: port_show() puts it on the screen.
+ */
+int port_getkey(int *key)
+{
+  int x;
+
+  while (rxbuf_size > 0 && portfd_connected() >= 0) {
+    x = rx_wait(&rx_pending);
+    if ((x & IO_PORT) && rx_pending > 0)
+      return 0;
+    /* Leave a port that went away to the terminal loop. */
+    if (x & (IO_INPUT | IO_PORT))
+      break;
+  }
+  rx_pending = 0;
+  *key = wxgetch();
+  return 1;
+}
+
+/*
+ * Show what port_getkey() read. Zmodem is not started from here.
+ */
+void port_show(void)
+{
+  rx_show(rx_pending, 0);
+  rx_pending = 0;
+}
+
+/*
+ * Show what the reader thread read and the terminal did not, once the
+ * thread is stopped to let another program have the port. Otherwise it
+ * would only be shown afterwards, after what that program printed.
+ */
+void port_catchup(void)
+{
+  const struct rxtime *t;
+  int blen, i;
+
+  port_show();
+  while (rxbuf_size > 0 &&
+         (blen = rx_read(rxbuf + rxbuf_offset,
+                         rxbuf_size - 1 - rxbuf_offset)) > 0) {
+    record_data(REC_IN, rxbuf + rxbuf_offset, blen);
+    nrxtimes = rx_times(&t);
+    for (i = 0; i < nrxtimes; i++) {
+      rxtimes[i] = t[i];
+      rxtimes[i].off = i ? t[i].off + rxbuf_offset : 0;
+    }
+    blen += rxbuf_offset;
+    rxbuf_offset = 0;
+    rx_show(blen, 0);
+  }
+  mc_wflush();
+}
+
+/*
+ * Play back a recording made with --record: what was received is shown
+ * as if it came from the port, at speed times the pace it came in at
+ * (0 for as fast as possible). A key stops it.
+ */
+void do_replay(const char *name, double speed)
+{
+  static int replay_timer = -1;
+  WIN *w;
+  char *data;
+  long long ns, t;
+  int dir, len, n, blen;
+
+  if (replay_open(name) < 0) {
+    werror(_("Cannot play back %s: %s"), name, strerror(errno));
+    return;
+  }
+  rxbuf_grow(RXBUF_MAX);
+  if (rxbuf_size == 0)
+    leave(_("Out of memory"));
+  setcbreak(2); /* Raw, no echo */
+
+  while ((len = replay_next(&ns, &dir, &data)) >= 0) {
+    if (dir != REC_IN)
+      continue;
+    while ((n = replay_delay(ns, speed)) > 0) {
+      if (replay_timer < 0)
+        replay_timer = reactor_timer_new(IO_TICK, NULL, NULL);
+      reactor_timer_set(replay_timer, n, 0);
+      if (check_io_events(NULL, 0, &blen) & IO_INPUT) {
+        keyboard(KGETKEY, 0);
+        goto stop;
+      }
+    }
+    /* With no delay (speed max, or behind) look for a key anyway. */
+    if (check_io_input(0)) {
+      keyboard(KGETKEY, 0);
+      goto stop;
+    }
+    /* As rx_wait() leaves it, after a partial character. */
+    while (len > 0) {
+      n = rxbuf_size - rxbuf_offset;
+      if (n > len)
+        n = len;
+      memcpy(rxbuf + rxbuf_offset, data, n);
+      blen = n + rxbuf_offset;
+      rxbuf_offset = 0;
+      /* Timestamped with when it was recorded. */
+      rxtimes[0].off = 0;
+      rxtimes[0].mono.tv_sec = ns / 1000000000;
+      rxtimes[0].mono.tv_nsec = ns % 1000000000;
+      rxtimes[0].real.tv_sec = (replay_epoch() + ns) / 1000000000;
+      rxtimes[0].real.tv_nsec = (replay_epoch() + ns) % 1000000000;
+      nrxtimes = 1;
+      rx_show(blen, 0);
+      data += n;
+      len -= n;
+    }
+    mc_wframe();
+  }
+
+stop:
+  t = replay_time();
+  replay_close();
+  setcbreak(1); /* Cbreak, no echo */
+  mc_wflush();
+  w = mc_tell(_("Replay done in %lld.%03lld s"), t / 1000000000,
+              t / 1000000 % 1000);
+  wxgetch();
+  mc_wclose(w, 1);
+}
+
 /*
  * The main terminal loop:
  *	- If there are characters received send them
  *	  to the screen via the appropriate translate function.
  */
-int do_terminal(void)
+static int terminal_loop(void)
 {
-  char buf[128];
-  int buf_offset = 0;
+  static int status_clock = -1;
   int c;
   int x;
+  int tick = 1;
+  int typed = 0;
   int blen;
   int zauto = 0;
-  static const char zsig[] = "**\030B00";
-  int zpos = 0;
   const char *s;
   dirflush = 0;
   WIN *error_on_open_window = NULL;
@@ -868,6 +1248,11 @@ int do_terminal(void)
 dirty_goto:
   /* Show off or online time */
   update_status_time();
+  tick = 1;
+
+  rxbuf_grow(rxbuf_want());
+  if (rxbuf_size == 0)
+    leave(_("Out of memory"));
 
   /* If the status line was shown temporarily, delete it again. */
   if (tempst) {
@@ -891,6 +1276,9 @@ dirty_goto:
     if (size_changed) {
       wrapln = us->wrap;
       /* I got the resize code going again! Yeah! */
+      /* What is on the screen goes to the history, which is kept. */
+      mc_winclr(us);
+      keep_hist();
       mc_wclose(us, 0);
       us = NULL;
       if (st)
@@ -904,107 +1292,71 @@ dirty_goto:
       init_emul(terminal, 0);
       size_changed = 0;
     }
-    /* Update the timer. */
-    timer_update();
-
-    /* check if device is ok, if not, try to open it */
-    if (!get_device_status(portfd_connected())) {
-      /* Ok, it's gone, most probably someone unplugged the USB-serial, we
-       * need to free the FD so that a replug can get the same device
-       * filename, open it again and be back */
-      int reopen = portfd == -1;
-
-      device_close();
-      if (open_term(reopen, reopen, 1) < 0) {
-        if (!error_on_open_window)
-          error_on_open_window = mc_tell(_("Cannot open %s!"), dial_tty);
-      } else {
-        if (error_on_open_window) {
-          mc_wclose(error_on_open_window, 1);
-          error_on_open_window = NULL;
+    /* On a clock tick (or when the device might be gone) update the
+     * status line and check the device. */
+    if (tick) {
+      /* Update the timer. */
+      timer_update();
+
+      /* check if device is ok, if not, try to open it */
+      if (!get_device_status(portfd_connected())) {
+        /* Ok, it's gone, most probably someone unplugged the USB-serial, we
+         * need to free the FD so that a replug can get the same device
+         * filename, open it again and be back */
+        int reopen = portfd == -1;
+
+        device_close();
+        if (open_term(reopen, reopen, 1) < 0) {
+          if (!error_on_open_window)
+            error_on_open_window = mc_tell(_("Cannot open %s!"), dial_tty);
+        } else {
+          if (error_on_open_window) {
+            mc_wclose(error_on_open_window, 1);
+            error_on_open_window = NULL;
+          }
         }
       }
+
+      if (status_clock < 0)
+        status_clock = reactor_timer_new(IO_TICK, NULL, NULL);
+      reactor_timer_set(status_clock, status_clock_interval(), 0);
+
+      /* The line speed may have changed. */
+      rxbuf_grow(rxbuf_want());
     }
 
+    if (log_clock < 0)
+      log_clock = reactor_timer_new(0, log_due, NULL);
+    log_due(-1, NULL);
+
     /* Check for I/O or timer. */
-    x = check_io_frontend(buf + buf_offset, sizeof(buf) - buf_offset, &blen);
-    blen += buf_offset;
-    buf_offset = 0;
+    x = rx_wait(&blen);
+    tick = x & IO_TICK;
 
     /* Data from the modem to the screen. */
-    if ((x & 1) == 1) {
-      char obuf[sizeof(buf)];
-      char *ptr;
-
-      if (using_iconv()) {
-        char *otmp = obuf;
-        size_t output_len = sizeof(obuf);
-        size_t input_len = blen;
-
-        ptr = buf;
-        do_iconv(&ptr, &input_len, &otmp, &output_len);
-
-        // something happened at all?
-        if (output_len < sizeof(obuf))
-          {
-            if (input_len)
-              { // something remained, we need to adapt buf accordingly
-                memmove(buf, ptr, input_len);
-                buf_offset = input_len;
-              }
-
-            blen = sizeof(obuf) - output_len;
-            ptr = obuf;
-          }
-	else
-	  ptr = buf;
-      } else {
-        ptr = buf;
-      }
-
-      while (blen > 0) {
-	int c = *ptr;
-        /* Auto zmodem detect */
-        if (zauto) {
-          if (zsig[zpos] == c)
-            zpos++;
-          else
-            zpos = 0;
-        }
-        if (P_PARITY[0] == 'M' || P_PARITY[0] == 'S')
-          c &= 0x7f;
-        if (display_hex) {
-          unsigned char l = c;
-          unsigned char u = l >> 4;
-          l &= 0xf;
-          vt_out(u > 9 ? 'a' + (u - 10) : '0' + u, 0);
-          vt_out(l > 9 ? 'a' + (l - 10) : '0' + l, 0);
-          vt_out(' ', 0);
-
-          --blen;
-          ++ptr;
-        } else {
-          wchar_t wc;
-          size_t len = one_mbtowc(&wc, ptr, blen);
-          vt_out(c, wc);
-          blen -= len;
-          ptr += len;
-        }
-        if (zauto && zsig[zpos] == 0) {
-          dirflush = 1;
-          keyboard(KSTOP, 0);
-          updown('D', zauto - 'A');
-          dirflush = 0;
-          zpos = 0;
-          blen = 0;
-          goto dirty_goto;
-        }
+    if (x & IO_PORT) {
+      if (rx_show(blen, zauto)) {
+        dirflush = 1;
+        keyboard(KSTOP, 0);
+        reactor_signals(0);
+        updown('D', zauto - 'A');
+        reactor_signals(1);
+        dirflush = 0;
+        goto dirty_goto;
       }
-      mc_wflush();
+      /* Output is shown a frame at a time, except for the echo of
+       * something that was just typed. */
+      if (typed) {
+        mc_wflush();
+        typed = 0;
+      } else
+        mc_wframe();
     }
 
     /* Read from the keyboard and send to modem. */
-    if ((x & 2) == 2) {
+    if (x & IO_INPUT) {
+      /* Whatever one key sends goes out in one write. */
+      tx_hold(1);
       /* See which key was pressed. */
       c = keyboard(KGETKEY, 0);
       if (c == EOF)
@@ -1020,6 +1372,10 @@ dirty_goto:
 
         /* Stop keyserv process if we have it. */
         keyboard(KSTOP, 0);
+        /* Commands send what they send at once. The queue is only
+         * sent out from here, so finish it before a menu waits. */
+        tx_hold(0);
+        tx_drain();
 
         /* Show status line temporarily */
         showtemp();
@@ -1072,6 +1428,19 @@ dirty_goto:
           vt_send(c);
       } else
         vt_send(c);
+      tx_hold(0);
+      typed = 1;
     }
   }
 }
+
+int do_terminal(void)
+{
+  int c;
+
+  /* Have SIGWINCH and SIGHUP wake up the event loop */
+  reactor_signals(1);
+  c = terminal_loop();
+  reactor_signals(0);
+  return c;
+}
@@ -103,8 +103,8 @@ static void hangsig(int sig)
 {
   if (stdwin)
     werror(_("Killed by signal %d !\n"), sig);
-  if (capfp)
-    fclose(capfp);
+  cap_close();
+  record_close();
 
   keyboard(KUNINSTALL, 0);
   hangup();
@@ -112,6 +112,15 @@ static void hangsig(int sig)
   leave("\n");
 }
 
+/*
+ * SIGUSR1: reopen the log file, after logrotate moved it.
+ */
+static void logsig(int sig)
+{
+  (void)sig;
+  log_reopen();
+}
+
 /*
  * Jump to a shell
  */
@@ -182,7 +191,7 @@ static ELM *mc_getline(WIN *w, int no)
       i -= us->histlines;
     if (i < 0)
       i = us->histlines - 1;
-    return us->histbuf + (i * us->xs);
+    return mc_histline(us, i);
   }
 
   /* Get a line from the "us" window. */
@@ -221,14 +230,29 @@ static void drawhist(WIN *w, int y, int r)
   w->direct = 1;
 }
 
+/*
+ * The last search in the scrollback (see history.c), and the lines that
+ * match it. nhits is -1 until they have been looked for. Of the nmatch
+ * lines that match, only the newest MAX_HITS of the history are kept.
+ */
+#define MAX_HITS	100000
+
+static HSEARCH *look;
+static int *hits, nhits = -1, nmatch;
+
+/* Does a line of the scrollback match the search? */
+static int look_match(WIN *w, ELM *e)
+{
+  return look && mc_histmatch(look, e, w->xs);
+}
+
 /*
  * fmg 8/20/97
  * drawhist_look()
- * Redraw the window, highlight line that was found to contain
- * pattern 'look'
- * Needed by re-draw screen function after EACH find_next()
+ * Redraw the window, highlight lines that match the search.
+ * Needed by re-draw screen function after EACH find_hit()
  */
-void drawhist_look(WIN *w, int y, int r, wchar_t *look, int case_matters)
+void drawhist_look(WIN *w, int y, int r)
 {
   int f;
   ELM *tmp_e;
@@ -237,20 +261,10 @@ void drawhist_look(WIN *w, int y, int r, wchar_t *look, int case_matters)
   for (f = 0; f < w->ys; f++) {
     tmp_e = mc_getline(w, y++);
 
-    wchar_t *tmp_line;
-
-    /* First we "accumulate" the line into a variable */
-    mc_wdrawelm_var(w, tmp_e, &tmp_line);
-
-    /* Does it have what we want? */
-    if (wcslen(look) > 1 && wcslen(tmp_line) > 1) {
-      if (StrStr(tmp_line,look, case_matters))
-        mc_wdrawelm_inverse(w, f, tmp_e); /* 'inverse' it */
-      else
-        mc_wdrawelm(w, f, tmp_e); /* 'normal' output */
-    }
-
-    free(tmp_line);
+    if (look_match(w, tmp_e))
+      mc_wdrawelm_inverse(w, f, tmp_e); /* 'inverse' it */
+    else
+      mc_wdrawelm(w, f, tmp_e); /* 'normal' output */
   }
 
   if (r)
@@ -263,7 +277,7 @@ void drawhist_look(WIN *w, int y, int r, wchar_t *look, int case_matters)
  * Search history - main function that started the C-code blasphemy :-)
  * This function doesn't care about case/case-less status...
  */
-void searchhist(WIN *w_hist, wchar_t *str)
+void searchhist(WIN *w_hist, wchar_t *str, int regex)
 {
   int y;
   WIN *w_new;
@@ -280,7 +294,7 @@ void searchhist(WIN *w_hist, wchar_t *str)
   w_new->doscroll = 0;
   w_new->wrap = 0;
 
-  hline = _("SEARCH FOR (ESC=Exit)");
+  hline = regex ? _("REGEX SEARCH (ESC=Exit)") : _("SEARCH FOR (ESC=Exit)");
   mc_wprintf(w_new, "%s(%d):",hline,MAX_SEARCH);
   mc_wredraw(w_new, 1);
   mc_wflush();
@@ -306,91 +320,67 @@ void searchhist(WIN *w_hist, wchar_t *str)
 }
 
 /*
- * fmg 8/20/97
- * Move scope to next hit of pattern in the buffer.
- * Returns line-number of next "hit_line" or -1 if none found
- * (we beep elsewhere ;-)
+ * Find all lines that match the search: in the history, which has an
+ * index for it, and on the screen (the lines after it).
  */
-int find_next(WIN *w, WIN *w_hist,
-              int hit_line,     /* 'current' Match line */
-              wchar_t *look,    /* pattern */
-              int case_matters) /* guess... */
+static void find_all(WIN *w_hist)
 {
-  int next_line;
-  ELM *tmp_e;
-  int all_lines;
-
-  if (!look)
-    return(++hit_line); /* next line */
-
-  hit_line++;           /* we NEED this so we don't search only same line! */
-  all_lines = w->histlines + w_hist->ys;
-
-  if (hit_line >= all_lines) {	/* Make sure we've got a valid line! */
-    werror(_("Search Wrapping Around to Start!"));
-    hit_line = 0;
-  }
-
-  for (next_line = hit_line; next_line <= all_lines; next_line++) {
-    /* we do 'something' here... :-) */
-    tmp_e = mc_getline(w_hist, next_line);
-
-    wchar_t *tmp_line;
-
-    /*
-     * First we "accumulate" the line into a variable.
-     * To see 'why', see what an 'ELM' structure looks like!
-     */
-    mc_wdrawelm_var(w, tmp_e, &tmp_line);
-
-    /* Does it have what we want? */
-    if (wcslen(tmp_line) > 1 && wcslen(look) > 1)
-      if (StrStr(tmp_line, look, case_matters))
-        {
-          free(tmp_line);
-          return next_line;
-        }
-
-    free(tmp_line);
-  }
-
-  if (hit_line >= all_lines) {	/* Make sure we've got a valid line! */
-    werror(_("Search Wrapping Around to Start!"));
-    hit_line = 0;
+  int no, *p;
+
+  free(hits);
+  hits = NULL;
+  nmatch = 0;
+  if (us->histlines &&
+      (nmatch = mc_histgrep(us, look, MAX_HITS, &hits)) < 0)
+    nmatch = 0;
+  nhits = nmatch < MAX_HITS ? nmatch : MAX_HITS;
+
+  for (no = us->histlines; no < us->histlines + w_hist->ys; no++) {
+    if (!look_match(w_hist, mc_getline(w_hist, no)))
+      continue;
+    if ((p = realloc(hits, (nhits + 1) * sizeof(int))) == NULL)
+      break;
+    hits = p;
+    hits[nhits++] = no;
+    nmatch++;
   }
-
-  return -1; /* nothing found! */
 }
 
 /*
- * fmg 8/22/97
- * Needed this for the case-less comparison... and Linux libc
- * doesn't seem to have a strnstr function... so we fudge.. ;-)
+ * The next (dir > 0) or previous match from line y, going round at the
+ * end. Returns its index in hits, or -1 if nothing matches.
  */
-const wchar_t *upcase(wchar_t *dest, wchar_t *src)
+static int find_hit(int y, int dir)
 {
-  wchar_t *d = dest;
-
-  while (*src)
-    *d++ = towupper(*src++);
-  *d = '\0';
-  return dest;
-}
-
-/*
- * fmg 8/22/97
- * Needed this for the case-less comparison... and Linux libc
- * doesn't seem to have a strnstr function... so we fudge.. ;-)
- */
-wchar_t *StrStr(wchar_t *str1, wchar_t *str2, int case_matters)
-{
-  if (case_matters)
-    return wcsstr(str1, str2);
-
-  size_t len1 = wcslen(str1) + 1;
-  size_t len2 = wcslen(str2) + 1;
-  wchar_t tmpstr1[len1], tmpstr2[len2];
-  return wcsstr(upcase(tmpstr1, str1), upcase(tmpstr2, str2));
+  int lo = 0, hi = nhits, m;
+
+  if (nhits <= 0)
+    return -1;
+
+  /* The first hit after y, or before it. */
+  while (lo < hi) {
+    m = (lo + hi) / 2;
+    if (dir > 0 ? hits[m] <= y : hits[m] < y)
+      lo = m + 1;
+    else
+      hi = m;
+  }
+  if (dir > 0) {
+    if (lo == nhits) {
+      werror(_("Search Wrapping Around to Start!"));
+      lo = 0;
+    }
+    return lo;
+  }
+  if (lo == 0) {
+    if (nmatch > nhits)
+      werror(_("Only the newest %d matches are kept,\n  wrapping around to End!"),
+             nhits);
+    else
+      werror(_("Search Wrapping Around to End!"));
+    lo = nhits;
+  }
+  return lo - 1;
 }
 
 static void drawcite(WIN *w, int y, int citey, int start, int end)
@@ -439,13 +429,44 @@ static void do_cite(WIN *w, int start, int end)
   }
 }
 
-/* Scroll back */
+/*
+ * Show the help line of the scrollback, with whether it follows new
+ * lines or how many came in below the view at the right.
+ */
+static void show_hline(WIN *w, const char *hline, int follow, int fresh)
+{
+  char tag[64];
+  int x;
+
+  tag[0] = 0;
+  if (follow)
+    snprintf(tag, sizeof(tag), " %s ", _("TAIL"));
+  else if (fresh > 0)
+    snprintf(tag, sizeof(tag), _(" %d new lines below "), fresh);
+  x = w->xs - mbswidth(tag);
+
+  mc_wlocate(w, 0, 0);
+  mc_wprintf(w, "%s", hline);
+  mc_wclreol(w);
+  if (tag[0] && x > 0) {
+    mc_wlocate(w, x, 0);
+    mc_wputs(w, tag);
+  }
+  mc_wredraw(w, 1);
+}
+
+/*
+ * Scroll back. Data from the port is still shown on the screen under
+ * the history window meanwhile; the view stays on the same lines, or
+ * with T on goes along with the end.
+ */
 static void scrollback(void)
 {
   int y,c;
   WIN *b_us, *b_st;
   ELM *tmp_e;
-  int case_matters=0;	/* fmg: case-importance, needed for 'N' */
+  int flags;
+  char err[128];
   static wchar_t look_for[MAX_SEARCH];	/* fmg: last used search pattern */
   int citemode = 0;
   int cite_ystart = 1000000,
@@ -453,9 +474,12 @@ static void scrollback(void)
       cite_y = 0;
   int inverse;
   int loop = 1;
+  int follow = 0, fresh = 0;
+  int direct;
+  long long added;
 
-  char hline0[128], hline1[128], *hline;
-  static int hit=0;
+  char hline0[128], hline1[128], hline2[128], *hline;
+  int hit;
 
   /* Find out how big a window we must open. */
   y = us->y2;
@@ -481,44 +505,85 @@ static void scrollback(void)
    * Hope you like it :-)
    */
   strcpy(hline0,
-         _("HISTORY: U=Up D=Down F=PgDn B=PgUp s=Srch S=CaseLess N=Next C=Cite ESC=Exit "));
+         _("HISTORY: U=Up D=Down F=PgDn B=PgUp s=Srch r=Regex N=Next C=Cite T=Tail ESC=Exit"));
 
   if (b_st->xs < 127)
     hline0[b_st->xs] = 0;
   hline = hline0;
-  mc_wprintf(b_st, "%s", hline);
-  mc_wredraw(b_st, 1);
+  show_hline(b_st, hline, follow, fresh);
   mc_wflush();
 
   /* And do the job. */
   y = us->histlines;
 
-  /* fmg 8/20/97
-   * Needed for N)extSearch, keeps track of line on which current "hit"
-   * is... we advance it to 'N'ext hit in find_next(). We start at "top"
-   * of history stack
-   */
-  hit = 0;
+  /* The history has changed since the last time. */
+  nhits = -1;
 
   drawhist(b_us, y, 0);
 
   while (loop) {
-    c = wxgetch();
+    if (!port_getkey(&c)) {
+      /* Data came in: put it on the screen under the view. */
+      added = mc_histcount(us);
+      mc_wswap(b_us);
+      mc_wswap(b_st);
+      if (tempst)
+        mc_wswap(st);
+      direct = us->direct;
+      us->direct = 0;
+      port_show();
+      us->direct = direct;
+      if (tempst)
+        mc_wswap(st);
+      mc_wswap(b_st);
+      mc_wswap(b_us);
+      added = mc_histcount(us) - added;
+      if (added > us->histlines)
+        added = us->histlines;
+
+      /* The lines moved up in the history. */
+      nhits = -1;
+      if (hline == hline2)
+        hline = hline0;
+      if (follow && !citemode)
+        y = us->histlines;
+      else {
+        y -= added;
+        fresh += added;
+        if (cite_ystart != 1000000) {
+          cite_ystart -= added;
+          cite_yend -= added;
+        }
+        if (y < 0)
+          y = 0;
+        if (fresh > us->histlines - y)
+          fresh = us->histlines - y;
+      }
+      if (citemode) {
+        drawcite_whole(b_us, y, cite_ystart, cite_yend);
+        mc_wlocate(b_us, 0, cite_y);
+      } else if (look && us->histline)
+        drawhist_look(b_us, y, 1);
+      else
+        drawhist(b_us, y, 1);
+      show_hline(b_st, hline, follow, fresh);
+      if (citemode)
+        mc_wlocate(b_us, 0, cite_y);
+      mc_wflush();
+      continue;
+    }
     switch (c) {
       /*
        * fmg 8/22/97
-       * Take care of the search key: Caseless
+       * Take care of the search keys: S and R are caseless, r and R
+       * take a regular expression.
        */
       case '\\':
       case 'S':
-        case_matters = 0; /* case-importance, ie. none :-) */
-        /*
-         * fmg 8/22/97
-         * Take care of the search key: Exact Match
-         */
-	/* FALLTHRU */
       case '/':
       case 's':
+      case 'r':
+      case 'R':
         if (!us->histlines) {
           mc_wbell();
           werror(_("History buffer Disabled!"));
@@ -532,34 +597,25 @@ static void scrollback(void)
         if (citemode)
           break;
 
-        /* we need this for the case-importance-toggle to work.. */
-        if (c == '/' || c == 's')
-          case_matters=1; /* case-importance, ie. DOES */
+        flags = (c == 'S' || c == '\\' || c == 'R' ? HS_ICASE : 0) |
+                (c == 'r' || c == 'R' ? HS_REGEX : 0);
 
         /* open up new search window... */
-        searchhist(b_us, look_for);
+        searchhist(b_us, look_for, flags & HS_REGEX);
         /* must redraw status line... */
-        mc_wlocate(b_st, 0, 0); /* move back to column 0! */
-        mc_wprintf(b_st, "%s", hline); /* and show the above-defined hline */
-        mc_wredraw(b_st, 1); /* again... */
-        /* highlight any matches */
-        if (wcslen(look_for) > 1) {
-          hit = find_next(us, b_us, y, look_for, case_matters);
-
-          if (hit == -1) {
-            mc_wbell();
-            mc_wflush();
-            hit = 0;
-            break;
-          }
-          drawhist_look(b_us, hit, 1, look_for, case_matters);
-          y = hit;
-        } else {
+        show_hline(b_st, hline, follow, fresh);
+        if (look_for[0] == 0) {
           mc_wbell();
           break;
         }
-        mc_wflush();
-        break;
+        mc_histsearchfree(look);
+        if ((look = mc_histsearch(look_for, flags, err, sizeof(err))) == NULL) {
+          mc_wbell();
+          werror(_("Bad search pattern: %s"), err);
+          break;
+        }
+        find_all(b_us);
+        /* FALLTHRU */
         /*
          * fmg 8/22/97
          * Take care of the Next Hit key...
@@ -568,24 +624,36 @@ static void scrollback(void)
          */
       case 'n':
       case 'N':
-        /* highlight NEXT match */
+      case 'p':
+      case 'P':
+        /* highlight NEXT (or previous) match */
         if (citemode)
           break;
-        if (wcslen(look_for) > 1) {
-          hit = find_next(us, b_us, y, look_for, case_matters);
-
-          if (hit == -1) {
-            mc_wbell();
-            mc_wflush();
-            hit = 0;
-            break;
-          }
-          drawhist_look(b_us, hit, 1, look_for, case_matters);
-          y = hit;
-        } else	{ /* no search pattern... */
+        if (look == NULL) { /* no search pattern... */
           mc_wbell();
           werror(_("No previous search!\n  Please 's' or 'S' first!"));
+          break;
         }
+        if (nhits < 0)
+          find_all(b_us);
+        if ((hit = find_hit(y, c == 'p' || c == 'P' ? -1 : 1)) < 0) {
+          mc_wbell();
+          mc_wflush();
+          break;
+        }
+        y = hits[hit];
+        drawhist_look(b_us, y, 1);
+
+        /* Where we are. */
+        snprintf(hline2, sizeof(hline2),
+                 _("HISTORY: match %d of %d  N=Next P=Prev s=Srch r=Regex C=Cite ESC=Exit"),
+                 hit + 1 + nmatch - nhits, nmatch);
+        if (b_st->xs < 127)
+          hline2[b_st->xs] = 0;
+        hline = hline2;
+        if (y < us->histlines)
+          follow = 0;
+        show_hline(b_st, hline, follow, fresh);
         mc_wflush();
         break;
 
@@ -619,15 +687,7 @@ static void scrollback(void)
           inverse = (y+cite_y >= cite_ystart && y+cite_y <= cite_yend);
         } else {
           tmp_e = mc_getline(b_us, y);
-          if (wcslen(look_for) > 1) {
-            /* quick scan for pattern match */
-            wchar_t *tmp_line;
-            mc_wdrawelm_var(b_us, tmp_e, &tmp_line);
-            inverse = (wcslen(tmp_line)>1 &&
-                         StrStr(tmp_line, look_for, case_matters));
-            free(tmp_line);
-          } else
-            inverse = 0;
+          inverse = look_match(b_us, tmp_e);
         }
 
         if (inverse)
@@ -669,15 +729,7 @@ static void scrollback(void)
           inverse = (y+cite_y >= cite_ystart && y+cite_y <= cite_yend);
         } else {
           tmp_e = mc_getline(b_us, y + b_us->ys - 1);
-          if (wcslen(look_for) > 1) {
-            /* quick scan for pattern match */
-            wchar_t *tmp_line;
-            mc_wdrawelm_var(b_us, tmp_e, &tmp_line);
-            inverse = (wcslen(tmp_line)>1 &&
-                         StrStr(tmp_line, look_for, case_matters));
-            free(tmp_line);
-          } else
-            inverse = 0;
+          inverse = look_match(b_us, tmp_e);
         }
 
         if (inverse)
@@ -707,8 +759,8 @@ static void scrollback(void)
          * the lines that have the pattern we wanted... it's just nice.
          * Highlight any matches
          */
-        if (wcslen(look_for) > 1 && us->histline)
-          drawhist_look(b_us, y, 1, look_for, case_matters);
+        if (look && us->histline)
+          drawhist_look(b_us, y, 1);
         else
           drawhist(b_us, y, 1);
 
@@ -733,8 +785,8 @@ static void scrollback(void)
          * the lines that have the pattern we wanted... it's just nice.
          * Highlight any matches
          */
-        if (wcslen(look_for) > 1 && us->histline)
-          drawhist_look(b_us, y, 1, look_for, case_matters);
+        if (look && us->histline)
+          drawhist_look(b_us, y, 1);
         else
           drawhist(b_us, y, 1);
         if (citemode)
@@ -742,6 +794,7 @@ static void scrollback(void)
         break;
       case 'C': case 'c': /* start citation mode */
         if (citemode ^= 1) {
+          follow = 0;
           cite_y = 0;
           cite_ystart = 1000000;
           cite_yend = -1;
@@ -752,9 +805,7 @@ static void scrollback(void)
         } else {
           hline = hline0;
         }
-        mc_wlocate(b_st, 0, 0);
-        mc_wprintf(b_st, "%s", hline);
-        mc_wredraw(b_st, 1);
+        show_hline(b_st, hline, follow, fresh);
         if (citemode)
           mc_wlocate(b_us, 0, cite_y);
         break;
@@ -772,12 +823,26 @@ static void scrollback(void)
           loop = 0;
           break;
         }
-        mc_wlocate(b_st, 0, 0);
-        mc_wprintf(b_st, "%s", hline);
-        mc_wredraw(b_st, 1);
+        show_hline(b_st, hline, follow, fresh);
         mc_wdrawelm_inverse(b_us, cite_y, mc_getline(b_us, cite_ystart));
         mc_wlocate(b_us, 0, cite_y);
         break;
+      case 't':
+      case 'T':
+        /* Follow new lines, or stay where we are. */
+        if (citemode)
+          break;
+        if ((follow ^= 1) && y != us->histlines) {
+          y = us->histlines;
+          if (look && us->histline)
+            drawhist_look(b_us, y, 1);
+          else
+            drawhist(b_us, y, 1);
+        }
+        fresh = 0;
+        show_hline(b_st, hline, follow, fresh);
+        mc_wflush();
+        break;
       case K_ESC:
         if (!citemode) {
           loop = 0;
@@ -791,13 +856,23 @@ static void scrollback(void)
           strcpy(hline1, _("  CITATION: ENTER=select start line ESC=exit                               "));
         }
         drawcite_whole(b_us, y, cite_ystart, cite_yend);
-        mc_wlocate(b_st, 0, 0);
-        mc_wprintf(b_st, "%s", hline);
-        mc_wredraw(b_st, 1);
+        show_hline(b_st, hline, follow, fresh);
         if (citemode)
           mc_wlocate(b_us, 0, cite_y);
         break;
     }
+
+    /* Moved up, or down to the new lines. */
+    if ((follow && y < us->histlines) || fresh > us->histlines - y) {
+      if (y < us->histlines)
+        follow = 0;
+      if (fresh > us->histlines - y)
+        fresh = us->histlines - y;
+      show_hline(b_st, hline, follow, fresh);
+      if (citemode)
+        mc_wlocate(b_us, 0, cite_y);
+      mc_wflush();
+    }
   }
   /* Cleanup. */
   if (citemode)
@@ -856,6 +931,9 @@ static void helpthem(void)
     "  -p, --ptty=TTYP        : connect to pseudo terminal\n"
     "  -C, --capturefile=FILE : start capturing to FILE\n"
     "  --capturefile-buffer-mode=MODE : set buffering mode of capture file\n"
+    "  --record=FILE          : record the session with its timing to FILE\n"
+    "  --replay=FILE          : play back a recording instead of using a port\n"
+    "  --replay-speed=SPEED   : play it back SPEED times as fast, or 'max'\n"
     "  -F, --statlinefmt      : format of status line\n"
     "  -R, --remotecharset    : character set of communication partner\n"
     "  -v, --version          : output version information and exit\n"
@@ -943,11 +1021,57 @@ static void do_iconv_just_copy(char **inbuf, size_t *inbytesleft,
 static iconv_t iconv_rem2local;
 static int iconv_enabled;
 
+/* What each byte of a single byte remote charset converts to */
+static unsigned char iconv_first[256];	/* First byte in the local charset */
+static wchar_t iconv_wc[256];
+static int iconv_table;
+
 int using_iconv(void)
 {
   return iconv_enabled;
 }
 
+/* Is the remote charset converted by vt_out_buf() rather than iconv? */
+int using_iconv_table(void)
+{
+  return iconv_table;
+}
+
+/*
+ * If every byte of the remote charset converts to one character on its
+ * own, fill in iconv_first and iconv_wc. Returns 0 for multibyte and
+ * stateful charsets, which still need iconv() on the data stream.
+ */
+static int init_iconv_table(void)
+{
+  char in, out[MB_LEN_MAX * 4], *ip, *op;
+  size_t il, ol;
+  int b, ok = 1;
+
+  for (b = 0; b < 256 && ok; b++) {
+    in = b;
+    ip = &in;
+    il = 1;
+    op = out;
+    ol = sizeof(out);
+    iconv(iconv_rem2local, NULL, NULL, NULL, NULL);
+    if (iconv(iconv_rem2local, &ip, &il, &op, &ol) == (size_t)-1) {
+      /* Not a complete character: a multibyte charset. */
+      if (errno != EILSEQ)
+        ok = 0;
+      /* No mapping: passed on as is, as do_iconv() does. */
+      out[0] = b;
+      op = out + 1;
+    }
+    /* Nothing (a shift sequence?) or more than one character? */
+    if (op == out || one_mbtowc(&iconv_wc[b], out, op - out) != (size_t)(op - out))
+      ok = 0;
+    iconv_first[b] = out[0];
+  }
+  iconv(iconv_rem2local, NULL, NULL, NULL, NULL);
+  return ok;
+}
+
 static void init_iconv(const char *remote_charset)
 {
   char local_charset[40];
@@ -980,9 +1104,12 @@ static void init_iconv(const char *remote_charset)
     }
 
   iconv_rem2local = iconv_open(local_charset, remote_charset);
-  if (iconv_rem2local != (iconv_t)-1)
+  if (iconv_rem2local != (iconv_t)-1) {
     iconv_enabled = 1;
-  else
+    iconv_table = init_iconv_table();
+    if (iconv_table)
+      vt_remote_charset(iconv_first, iconv_wc);
+  } else
     {
       fprintf(stderr, _("Activating iconv failed with: %s (%d)\n"),
               strerror(errno), errno);
@@ -1019,6 +1146,11 @@ int using_iconv(void)
   return 0;
 }
 
+int using_iconv_table(void)
+{
+  return 0;
+}
+
 static void init_iconv(const char *remote_charset)
 {
   (void)remote_charset;
@@ -1093,6 +1225,10 @@ static int parse_timestamp_option(const char *option)
     line_timestamp = TIMESTAMP_LINE_PER_SECOND;
   else if (!strcmp(option, "extended"))
     line_timestamp = TIMESTAMP_LINE_EXTENDED;
+  else if (!strcmp(option, "usec"))
+    line_timestamp = TIMESTAMP_LINE_USEC;
+  else if (!strcmp(option, "nsec"))
+    line_timestamp = TIMESTAMP_LINE_NSEC;
   else
     ret = -1;
   return ret;
@@ -1113,6 +1249,10 @@ const char *timestamp_option_idstring(const int o)
       return "persecond";
     case TIMESTAMP_LINE_DELTA:
       return "delta";
+    case TIMESTAMP_LINE_USEC:
+      return "usec";
+    case TIMESTAMP_LINE_NSEC:
+      return "nsec";
     }
 }
 
@@ -1132,6 +1272,16 @@ static void parse_options(char *option)
           else
             usage_and_exit_if(true, "Unknown timestamp variant '%s'.\n", o);
         }
+      else if (!strncmp(key, "capture-", 8))
+        {
+          if (cap_option(key + 8, o) < 0)
+            usage_and_exit_if(true, "Bad capture option '%s'.\n", key);
+        }
+      else if (!strncmp(key, "log-", 4))
+        {
+          if (log_option(key + 4, o) < 0)
+            usage_and_exit_if(true, "Bad log option '%s'.\n", key);
+        }
       else
         usage_and_exit_if(true, "Unknown option '%s'.\n", key);
     }
@@ -1158,6 +1308,12 @@ const char *line_timestamp_description(void)
     case TIMESTAMP_LINE_DELTA:
       s = _("Timestamp delta between lines");
       break;
+    case TIMESTAMP_LINE_USEC:
+      s = _("Timestamp every line (usec)");
+      break;
+    case TIMESTAMP_LINE_NSEC:
+      s = _("Timestamp every line (nsec)");
+      break;
     }
   return s;
 }
@@ -1181,11 +1337,18 @@ int main(int argc, char **argv)
   char *cmdline_baudrate = NULL;/* Baudrate given on the command line via -b */
   char *cmdline_device = NULL;  /* Device/Port given on the command line via -D */
   char *remote_charset = NULL;  /* Remote charset given on the command line via -R */
+  char *cmdline_capfile = NULL; /* Capture file given on the command line via -C */
+  char *record_file = NULL;     /* --record */
+  char *replay_file = NULL;     /* --replay */
+  double replay_speed = 1;      /* --replay-speed, 0 = as fast as possible */
   char pseudo[64];
   /* char* console_encoding = getenv ("LC_CTYPE"); */
 
   enum {
     OPT_CAP_BUF_MODE = 256,
+    OPT_RECORD,
+    OPT_REPLAY,
+    OPT_REPLAY_SPEED,
   };
 
   static struct option long_options[] =
@@ -1217,6 +1380,9 @@ int main(int argc, char **argv)
     { "option",                  required_argument, NULL, 'O' },
     { "statlinefmt",             required_argument, NULL, 'F' },
     { "capturefile-buffer-mode", required_argument, NULL, OPT_CAP_BUF_MODE },
+    { "record",                  required_argument, NULL, OPT_RECORD },
+    { "replay",                  required_argument, NULL, OPT_REPLAY },
+    { "replay-speed",            required_argument, NULL, OPT_REPLAY_SPEED },
     { NULL, 0, NULL, 0 }
   };
 
@@ -1227,7 +1393,6 @@ int main(int argc, char **argv)
 
   /* Initialize global variables */
   portfd =  -1;
-  capfp = NULL;
   docap = 0;
   capbuf = _IONBF;
   online = -1;
@@ -1412,11 +1577,7 @@ int main(int argc, char **argv)
           use_status = 1;
           break;
         case 'C': /* Capturing */
-          capfp = fopen(optarg, "a");
-          if (capfp == NULL) {
-            fprintf(stderr, _("Cannot open capture file\n"));
-            exit(1);
-          }
+          cmdline_capfile = optarg;
           docap = 1;
           vt_set(addlf, -1, docap, -1, -1, -1, -1, -1, addcr);
           break;
@@ -1437,6 +1598,25 @@ int main(int argc, char **argv)
               break;
           }
           break;
+        case OPT_RECORD:
+          record_file = optarg;
+          break;
+        case OPT_REPLAY:
+          replay_file = optarg;
+          break;
+        case OPT_REPLAY_SPEED:
+          if (strcasecmp(optarg, "max") == 0)
+            replay_speed = 0;
+          else {
+            char *end;
+
+            replay_speed = strtod(optarg, &end);
+            if (*end || end == optarg || replay_speed <= 0) {
+              fprintf(stderr, _("Invalid replay speed '%s'\n"), optarg);
+              exit(1);
+            }
+          }
+          break;
         case 'S': /* start Script */
           strncpy(scr_name, optarg, sizeof(scr_name) - 1);
           scr_name[sizeof(scr_name) - 1] = 0;
@@ -1480,8 +1660,16 @@ int main(int argc, char **argv)
     /* Loop again if more options */
   } while (optind < argk);
 
-  if (capfp)
-    setvbuf(capfp, NULL, capbuf, BUFSIZ);
+  if (record_file && record_open(record_file) < 0) {
+    fprintf(stderr, _("Cannot open recording file %s\n"), record_file);
+    exit(1);
+  }
+
+  /* Opened now that the -O capture options are known. */
+  if (cmdline_capfile && cap_open(cmdline_capfile) < 0) {
+    fprintf(stderr, _("Cannot open capture file\n"));
+    exit(1);
+  }
 
   init_iconv(remote_charset);
 
@@ -1560,6 +1748,7 @@ int main(int argc, char **argv)
 
   vt_ch_delay = atoi(P_MSG_CH_DELAY);
   vt_nl_delay = atoi(P_MSG_NL_DELAY);
+  mc_wsetframe(atoi(P_FRAMERATE), strcasecmp(P_SYNCOUTPUT, "yes") == 0);
 
   stdwin = NULL; /* It better be! */
 
@@ -1570,7 +1759,9 @@ int main(int argc, char **argv)
     st_attr = XA_REVERSE;
   }
 
-  if (dial_tty == NULL) {
+  if (replay_file)
+    ; /* No port, the data comes from the recording. */
+  else if (dial_tty == NULL) {
     if (!dosetup) {
       while ((dial_tty = get_port(P_PORT)) != NULL && open_term(doinit, 1, 0) < 0)
         ;
@@ -1605,6 +1796,7 @@ int main(int argc, char **argv)
   /* Signal handling */
   signal(SIGTERM, hangsig);
   signal(SIGHUP, hangsig);
+  signal(SIGUSR1, logsig);
   signal(SIGINT, SIG_IGN);
   signal(SIGQUIT, SIG_IGN);
   signal(SIGPIPE, SIG_IGN);
@@ -1637,6 +1829,9 @@ int main(int argc, char **argv)
 
   keyboard(KINSTALL, 0);
 
+  if (reactor_init() < 0)
+    leave(_("Could not initialize the event loop.\n"));
+
   if (strcmp(P_BACKSPACE, "BS") != 0)
     keyboard(KSETBS, P_BACKSPACE[0] == 'B' ? 8 : 127);
   if (alt_override)
@@ -1661,7 +1856,7 @@ int main(int argc, char **argv)
 
   init_emul(VT100, 1);
 
-  if (doinit)
+  if (doinit && !replay_file)
     modeminit();
 
   mc_wprintf(us, "\n%s %s\r\n", _("Welcome to minicom"), VERSION);
@@ -1705,6 +1900,11 @@ int main(int argc, char **argv)
   set_addlf(addlf);
   set_line_timestamp(line_timestamp);
 
+  if (replay_file) {
+    do_replay(replay_file, replay_speed);
+    quit = NORESET;
+  }
+
   /* The main loop calls do_terminal and gets a function key back. */
   while (!quit) {
     c = do_terminal();
@@ -1780,30 +1980,27 @@ dirty_goto:
         }
         break;
       case 'l': /* Capture file */
-        if (capfp == (FILE *)0 && !docap) {
+        if (!cap_isopen() && !docap) {
           s = input(_("Capture to which file? "), capname, sizeof(capname));
           if (s == NULL || *s == 0)
             break;
-          if ((capfp = fopen(s, "a")) == (FILE *)NULL) {
+          if (cap_open(s) < 0) {
             werror(_("Cannot open capture file"));
             break;
           }
-          setvbuf(capfp, NULL, capbuf, BUFSIZ);
           docap = 1;
-        } else if (capfp != (FILE *)0 && !docap) {
+        } else if (cap_isopen() && !docap) {
           c = ask(_("Capture file"), c3);
           if (c == 0) {
-            fclose(capfp);
-            capfp = (FILE *)NULL;
+            cap_close();
             docap = 0;
           }
           if (c == 1)
             docap = 1;
-        } else if (capfp != (FILE *)0 && docap) {
+        } else if (cap_isopen() && docap) {
           c = ask(_("Capture file"), c2);
           if (c == 0) {
-            fclose(capfp);
-            capfp = (FILE *)NULL;
+            cap_close();
             docap = 0;
           }
           if (c == 1)
@@ -1888,8 +2085,8 @@ dirty_goto:
 #endif
   signal(SIGQUIT, SIG_DFL);
 
-  if (capfp != (FILE *)0)
-    fclose(capfp);
+  cap_close();
+  record_close();
   mc_wclose(us, 0);
   mc_wclose(st, 0);
   mc_wclose(stdwin, 1);
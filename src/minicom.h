@@ -74,7 +74,6 @@ EXTERN int keypadmode;	/* Mode of keypad */
 EXTERN int cursormode;	/* Mode of cursor (arrow) keys */
 
 EXTERN int docap;	/* Capture data to capture file */
-EXTERN FILE *capfp;	/* File to capture to */
 EXTERN int capbuf;	/* Buffering mode of capture file */
 EXTERN int addlf;	/* Add LF after CR */
 EXTERN int addcr;	/* Insert CR before LF */
@@ -149,6 +148,8 @@ extern unsigned char vt_outmap[256], vt_inmap[256];
 
 /* MARK updated 02/17/95 - history buffer */
 EXTERN int num_hist_lines;  /* History buffer size */
+#define HIST_MAXMEM	250000	   /* Limits of the size, see history.c */
+#define HIST_MAXDISK	100000000
 
 /* fmg 1/11/94 colors - convert color word to # */
 
@@ -182,11 +183,17 @@ int  speed_valid(unsigned int);
 
 /* Prototypes from file: common.c */
 char *pfix_home( char *s);
-void do_log(const char *line, ...);
 size_t one_mbtowc (wchar_t *pwc, const char *s, size_t n);
 size_t one_wctomb (char *s, wchar_t wchar);
 size_t mbswidth(const char *s);
 
+/* Prototypes from file: log.c */
+void do_log(const char *line, ...);
+int log_option(const char *key, const char *value);
+void log_reopen(void);
+long log_tick(void);
+void log_close(void);
+
 /* Prototypes from file: dial.c */
 void mputs(const char *s , int how);
 void modeminit(void);
@@ -211,12 +218,77 @@ char *get_port(char *);
 /* Prototypes from file: help.c */
 int help(void);
 
+/*
+ * When data from the port came in, from the clock once per read():
+ * bytes from off on in the buffer, up to the next one.
+ */
+struct rxtime {
+  int off;
+  struct timespec mono, real;
+};
+#define RXTIMES	64	/* At most this many per buffer */
+
 /* Prototypes from file: ipc.c */
 int check_io_frontend(char *buf, int buf_size, int *bytes_red);
+int check_io_events(char *buf, int buf_size, int *bytes_read);
 bool check_io_input(int timeout_ms);
 int read_buf(int fd, char *buf, int bufsize);
+int read_buf_times(const struct rxtime **t);
 int keyboard(int cmd, int arg);
 
+/* Prototypes from file: reactor.c */
+
+/* Events returned by reactor_wait() and check_io_*() */
+#define IO_PORT		1	/* Data from the modem */
+#define IO_INPUT	2	/* Key pressed */
+#define IO_TICK		4	/* Status line clock */
+#define IO_RESIZE	8	/* Window size changed */
+
+typedef int (*reactor_fn)(int fd, void *arg);
+int  reactor_init(void);
+int  reactor_add(int fd, int ev, reactor_fn fn, void *arg);
+void reactor_del(int fd);
+int  reactor_timer_new(int ev, reactor_fn fn, void *arg);
+void reactor_timer_set(int id, long ms, long interval);
+void reactor_signals(int on);
+int  reactor_wait(int tmout);
+
+/* Prototypes from file: capture.c */
+int  cap_open(const char *name);
+void cap_close(void);
+int  cap_isopen(void);
+void cap_write(const char *s, size_t len);
+void cap_putc(int c);
+int  cap_option(const char *key, const char *value);
+
+/* Prototypes from file: record.c */
+#define REC_IN	0	/* Received from the port */
+#define REC_OUT	1	/* Sent to it */
+int  record_open(const char *name);
+void record_close(void);
+void record_data(int dir, const char *s, int len);
+int  replay_open(const char *name);
+int  replay_next(long long *ns, int *dir, char **data);
+int  replay_delay(long long ns, double speed);
+long long replay_time(void);
+long long replay_epoch(void);
+void replay_close(void);
+
+/* Prototypes from file: rxthread.c */
+int  rx_start(int fd);
+void rx_stop(void);
+void rx_flush(void);
+int  rx_read(char *buf, int len);
+int  rx_times(const struct rxtime **t);
+int  rx_notify_fd(void);
+int  rx_active(int fd);
+
+/* Prototypes from file: txqueue.c */
+void tx_write(const char *s, int len);
+void tx_hold(int on);
+void tx_drain(void);
+void tx_discard(void);
+
 /* Prototypes from file: keyserv.c */
 void handler(int dummy);
 void sendstr(char *s);
@@ -234,6 +306,10 @@ void show_status(void);
 void set_status_line_format(const char *s);
 void scriptname(const char *s);
 int  do_terminal(void);
+void do_replay(const char *name, double speed);
+int  port_getkey(int *key);
+void port_show(void);
+void port_catchup(void);
 void status_set_display(const char *text, int duration_s);
 
 /* Prototypes from file: minicom.c */
@@ -244,16 +320,13 @@ void set_local_echo(int val);
 void set_addlf(int val);
 void set_addcr(int val);
 
-void drawhist_look(WIN *w, int y, int r, wchar_t *look, int case_matters);
-void searchhist(WIN *w_hist, wchar_t *str);
-int  find_next(WIN *w, WIN *w_hist, int hit_line, wchar_t *look,
-               int case_matters);
-const wchar_t *upcase(wchar_t *dest, wchar_t *src);
-wchar_t *StrStr(wchar_t *str1, wchar_t *str2, int case_matters);
+void drawhist_look(WIN *w, int y, int r);
+void searchhist(WIN *w_hist, wchar_t *str, int regex);
 
 void do_iconv(char **inbuf, size_t *inbytesleft,
               char **outbuf, size_t *outbytesleft);
 int  using_iconv(void);
+int  using_iconv_table(void);
 
 /* Prototypes from file: rwconf.c */
 int writepars(FILE *fp, int all);
@@ -273,6 +346,7 @@ void m_nohang(int fd);
 void m_hupcl(int fd, int on);
 void m_flush(int fd);
 void m_flush_script( int fd);
+int  m_readchk(int fd);
 unsigned m_getmaxspd(void);
 void m_setparms(int fd, char *baudr, char *par, char *bits, char *stopb,
                 int hwf, int swf, int rs485en);
@@ -335,6 +409,8 @@ enum {
   TIMESTAMP_LINE_EXTENDED,
   TIMESTAMP_LINE_PER_SECOND,
   TIMESTAMP_LINE_DELTA,
+  TIMESTAMP_LINE_USEC,
+  TIMESTAMP_LINE_NSEC,
   TIMESTAMP_LINE_NR_OF_OPTIONS, // must be last
 };
 
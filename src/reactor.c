@@ -0,0 +1,377 @@
+/*
+ * reactor.c	Event loop for the terminal main loop.
+ *
+ *		Entry points:
+ *
+ *		reactor_init()       - set up the event set (stdin, signals)
+ *		reactor_add(fd, ...) - watch an fd for input
+ *		reactor_del(fd)      - stop watching an fd (before close!)
+ *		reactor_timer_new()  - allocate a timer
+ *		reactor_timer_set()  - (re)arm or disarm a timer
+ *		reactor_signals(on)  - route SIGWINCH/SIGHUP through the loop
+ *		reactor_wait(tmout)  - wait for events, return IO_* bits
+ *
+ *		On Linux this is backed by epoll, with timerfd for timers
+ *		and signalfd for SIGWINCH and SIGHUP, so the registration
+ *		is done once and not for every pass through the main loop.
+ *		Elsewhere select() with computed timeouts is used.
+ *
+ *		This file is part of the minicom communications package,
+ *		Copyright 1991-1995 Miquel van Smoorenburg.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <config.h>
+
+#include <stdint.h>
+
+#include "port.h"
+#include "minicom.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H) \
+    && defined(HAVE_SYS_SIGNALFD_H)
+#  define USE_EPOLL 1
+#  include <sys/epoll.h>
+#  include <sys/timerfd.h>
+#  include <sys/signalfd.h>
+#endif
+
+#define MAX_WATCH	16
+#define MAX_TIMERS	8
+
+struct watch {
+  int fd;		/* -1 = free slot */
+  int ev;		/* IO_* bit to report */
+  reactor_fn fn;	/* Optional callback */
+  void *arg;
+  int always;		/* Not pollable (regular file): always ready */
+};
+
+struct timer {
+  int used;
+  int ev;
+  reactor_fn fn;
+  void *arg;
+#ifdef USE_EPOLL
+  int fd;		/* timerfd */
+#else
+  long long due;	/* Absolute expiry in ms, 0 = disarmed */
+  long interval;
+#endif
+};
+
+static struct watch watches[MAX_WATCH];
+static struct timer timers[MAX_TIMERS];
+static int initialized;
+
+#ifdef USE_EPOLL
+static int epfd = -1;
+static int sigfd = -1;
+static sigset_t sigs;
+
+/* epoll data.u32 tags: watches are 0.., timers start at TIMER_TAG */
+#define TIMER_TAG	0x100
+#define SIGNAL_TAG	0x200
+#endif
+
+#ifndef USE_EPOLL
+static long long now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+#endif
+
+int reactor_init(void)
+{
+  int i;
+
+  if (initialized)
+    return 0;
+
+  for (i = 0; i < MAX_WATCH; i++)
+    watches[i].fd = -1;
+
+#ifdef USE_EPOLL
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    return -1;
+
+  sigemptyset(&sigs);
+#ifdef SIGWINCH
+  sigaddset(&sigs, SIGWINCH);
+#endif
+  sigaddset(&sigs, SIGHUP);
+  sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigfd >= 0) {
+    struct epoll_event e;
+
+    e.events = EPOLLIN;
+    e.data.u32 = SIGNAL_TAG;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &e);
+  }
+#endif
+  initialized = 1;
+
+  /* The keyboard is always watched. */
+  return reactor_add(0, IO_INPUT, NULL, NULL);
+}
+
+/*
+ * Watch fd for input. When it becomes readable, 'ev' is or-ed into
+ * the result of reactor_wait() and fn (if any) is called.
+ */
+int reactor_add(int fd, int ev, reactor_fn fn, void *arg)
+{
+  int i, slot = -1;
+
+  if (fd < 0)
+    return -1;
+
+  for (i = 0; i < MAX_WATCH; i++) {
+    if (watches[i].fd == fd)
+      return -1;
+    if (slot < 0 && watches[i].fd < 0)
+      slot = i;
+  }
+  if (slot < 0)
+    return -1;
+
+#ifdef USE_EPOLL
+  struct epoll_event e;
+
+  e.events = EPOLLIN;
+  e.data.u32 = slot;
+  watches[slot].always = 0;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e) < 0) {
+    if (errno != EPERM)
+      return -1;
+    watches[slot].always = 1;
+  }
+#endif
+
+  watches[slot].fd = fd;
+  watches[slot].ev = ev;
+  watches[slot].fn = fn;
+  watches[slot].arg = arg;
+  return 0;
+}
+
+/*
+ * Stop watching fd. Must be called before the fd is closed, otherwise
+ * a new fd with the same number would be mistaken for the old one.
+ */
+void reactor_del(int fd)
+{
+  int i;
+
+  for (i = 0; i < MAX_WATCH; i++)
+    if (watches[i].fd == fd && fd >= 0) {
+#ifdef USE_EPOLL
+      epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+      watches[i].fd = -1;
+    }
+}
+
+/*
+ * Allocate a timer. Returns its id, or -1.
+ */
+int reactor_timer_new(int ev, reactor_fn fn, void *arg)
+{
+  int i;
+
+  for (i = 0; i < MAX_TIMERS; i++)
+    if (!timers[i].used)
+      break;
+  if (i == MAX_TIMERS)
+    return -1;
+
+#ifdef USE_EPOLL
+  struct epoll_event e;
+
+  timers[i].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timers[i].fd < 0)
+    return -1;
+  e.events = EPOLLIN;
+  e.data.u32 = TIMER_TAG + i;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, timers[i].fd, &e) < 0) {
+    close(timers[i].fd);
+    return -1;
+  }
+#else
+  timers[i].due = 0;
+#endif
+  timers[i].used = 1;
+  timers[i].ev = ev;
+  timers[i].fn = fn;
+  timers[i].arg = arg;
+  return i;
+}
+
+/*
+ * Arm a timer to expire in 'ms' milliseconds, then every 'interval'
+ * milliseconds (0 = one-shot). ms == 0 disarms it.
+ */
+void reactor_timer_set(int id, long ms, long interval)
+{
+  if (id < 0 || id >= MAX_TIMERS || !timers[id].used)
+    return;
+
+#ifdef USE_EPOLL
+  struct itimerspec its;
+
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  its.it_interval.tv_sec = interval / 1000;
+  its.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+  timerfd_settime(timers[id].fd, 0, &its, NULL);
+#else
+  timers[id].due = ms ? now_ms() + ms : 0;
+  timers[id].interval = interval;
+#endif
+}
+
+/*
+ * Route SIGWINCH and SIGHUP through the event loop (on != 0) or back
+ * to their signal handlers (on == 0). While routed, the signals are
+ * blocked, so there is no window in which one can slip in between
+ * checking size_changed and going to sleep.
+ */
+void reactor_signals(int on)
+{
+#ifdef USE_EPOLL
+  if (sigfd >= 0)
+    sigprocmask(on ? SIG_BLOCK : SIG_UNBLOCK, &sigs, NULL);
+#else
+  (void)on;
+#endif
+}
+
+#ifdef USE_EPOLL
+static int read_signals(void)
+{
+  struct signalfd_siginfo si;
+  int ev = 0;
+
+  while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+#ifdef SIGWINCH
+    if (si.ssi_signo == SIGWINCH) {
+      size_changed = 1;
+      ev |= IO_RESIZE;
+    }
+#endif
+    if (si.ssi_signo == SIGHUP) {
+      /* Let the installed handler deal with it, as before. */
+      reactor_signals(0);
+      raise(SIGHUP);
+    }
+  }
+  return ev;
+}
+#endif
+
+static int fire_timer(int i)
+{
+  int ev = timers[i].ev;
+
+  if (timers[i].fn)
+    ev |= timers[i].fn(-1, timers[i].arg);
+  return ev;
+}
+
+static int fire_watch(int i)
+{
+  int ev = watches[i].ev;
+
+  if (watches[i].fn)
+    ev |= watches[i].fn(watches[i].fd, watches[i].arg);
+  return ev;
+}
+
+/*
+ * Wait for something to happen, at most tmout milliseconds
+ * (-1 = until an event). Callbacks of ready fds and expired timers
+ * are run and the or-ed IO_* bits of everything that fired is
+ * returned; 0 on timeout or interruption.
+ */
+int reactor_wait(int tmout)
+{
+  int ev = 0;
+  int i;
+
+  if (!initialized && reactor_init() < 0)
+    return 0;
+
+#ifdef USE_EPOLL
+  struct epoll_event evs[MAX_WATCH + MAX_TIMERS + 1];
+  int n;
+
+  for (i = 0; i < MAX_WATCH; i++)
+    if (watches[i].fd >= 0 && watches[i].always) {
+      ev |= fire_watch(i);
+      tmout = 0;
+    }
+
+  n = epoll_wait(epfd, evs, ARRAY_SIZE(evs), tmout);
+  for (i = 0; i < n; i++) {
+    unsigned tag = evs[i].data.u32;
+
+    if (tag == SIGNAL_TAG)
+      ev |= read_signals();
+    else if (tag >= TIMER_TAG) {
+      uint64_t expirations;
+      int t = tag - TIMER_TAG;
+
+      if (read(timers[t].fd, &expirations, sizeof(expirations)) > 0)
+        ev |= fire_timer(t);
+    } else if (watches[tag].fd >= 0)
+      ev |= fire_watch(tag);
+  }
+  return ev;
+#else
+  struct timeval tv, *tvp = NULL;
+  fd_set fds;
+  int maxfd = -1;
+  long long now = now_ms(), due = -1;
+
+  FD_ZERO(&fds);
+  for (i = 0; i < MAX_WATCH; i++)
+    if (watches[i].fd >= 0) {
+      FD_SET(watches[i].fd, &fds);
+      if (watches[i].fd > maxfd)
+        maxfd = watches[i].fd;
+    }
+  for (i = 0; i < MAX_TIMERS; i++)
+    if (timers[i].used && timers[i].due && (due < 0 || timers[i].due < due))
+      due = timers[i].due;
+
+  if (due >= 0 && (tmout < 0 || due - now < tmout))
+    tmout = due > now ? due - now : 0;
+  if (tmout >= 0) {
+    tv.tv_sec = tmout / 1000;
+    tv.tv_usec = (tmout % 1000) * 1000L;
+    tvp = &tv;
+  }
+
+  if (select(maxfd + 1, &fds, NULL, NULL, tvp) > 0)
+    for (i = 0; i < MAX_WATCH; i++)
+      if (watches[i].fd >= 0 && FD_ISSET(watches[i].fd, &fds))
+        ev |= fire_watch(i);
+
+  now = now_ms();
+  for (i = 0; i < MAX_TIMERS; i++)
+    if (timers[i].used && timers[i].due && timers[i].due <= now) {
+      timers[i].due = timers[i].interval ? now + timers[i].interval : 0;
+      ev |= fire_timer(i);
+    }
+  return ev;
+#endif
+}
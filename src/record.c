@@ -0,0 +1,228 @@
+/*
+ * record.c	Recording a session with its timing, and reading it back.
+ *
+ *		Entry points:
+ *
+ *		record_open(name)  - record to name from now on
+ *		record_close()     - stop recording
+ *		record_data(dir, s, len) - record a chunk received (REC_IN)
+ *		                     or sent (REC_OUT)
+ *		replay_open(name)  - open a recording to play back
+ *		replay_next(&ns, &dir, &data) - the next chunk in it
+ *		replay_delay(ns, speed) - ms until a chunk at ns is due
+ *		replay_time()      - ns since replay_open()
+ *		replay_epoch()     - when the recording was started
+ *		replay_close()     - close it again
+ *
+ *		A recording starts with REC_MAGIC and the time it was
+ *		started, in ns since the epoch (8 bytes, low byte first).
+ *		Each chunk follows as
+ *
+ *			varint	ns since the chunk before it
+ *			varint	length * 2 + direction
+ *			data
+ *
+ *		where a varint is written 7 bits at a time, low bits
+ *		first, with the top bit set in all but the last byte.
+ *		The times come from the monotonic clock.
+ *
+ *		This file is part of the minicom communications package,
+ *		Copyright 1991-1995 Miquel van Smoorenburg.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <config.h>
+#include <limits.h>
+
+#include "port.h"
+#include "minicom.h"
+
+#define REC_MAGIC	"MCREC\0\0\1"
+#define REC_MAGICLEN	8
+
+static FILE *recfp;
+static long long rec_last;	/* Time of the last chunk */
+
+static FILE *playfp;
+static long long play_start;	/* When it was opened */
+static long long play_epoch;	/* When it was recorded, from the header */
+static long long play_ns;
+static char *play_buf;
+static size_t play_size;
+
+static long long mono_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void put_varint(unsigned long long v)
+{
+  while (v >= 0x80) {
+    putc((v & 0x7f) | 0x80, recfp);
+    v >>= 7;
+  }
+  putc(v, recfp);
+}
+
+static int get_varint(unsigned long long *v)
+{
+  int c, shift = 0;
+
+  *v = 0;
+  do {
+    if ((c = getc(playfp)) == EOF || shift > 63)
+      return -1;
+    *v |= (unsigned long long)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 0;
+}
+
+/*
+ * Start recording to name, replacing what is there.
+ */
+int record_open(const char *name)
+{
+  struct timespec ts;
+  unsigned long long t;
+  int i;
+
+  record_close();
+  if ((recfp = fopen(name, "w")) == NULL)
+    return -1;
+  setvbuf(recfp, NULL, _IOFBF, 65536);
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  t = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  fwrite(REC_MAGIC, 1, REC_MAGICLEN, recfp);
+  for (i = 0; i < 8; i++)
+    putc((t >> (8 * i)) & 0xff, recfp);
+  rec_last = mono_ns();
+  return 0;
+}
+
+void record_close(void)
+{
+  if (recfp == NULL)
+    return;
+  fclose(recfp);
+  recfp = NULL;
+}
+
+void record_data(int dir, const char *s, int len)
+{
+  long long now;
+
+  if (recfp == NULL || len <= 0)
+    return;
+  now = mono_ns();
+  put_varint(now - rec_last);
+  put_varint((unsigned long long)len * 2 + dir);
+  fwrite(s, 1, len, recfp);
+  rec_last = now;
+}
+
+/*
+ * Open a recording to play it back.
+ */
+int replay_open(const char *name)
+{
+  unsigned char magic[REC_MAGICLEN + 8];
+  int i;
+
+  replay_close();
+  if ((playfp = fopen(name, "r")) == NULL)
+    return -1;
+  if (fread(magic, 1, sizeof(magic), playfp) != sizeof(magic) ||
+      memcmp(magic, REC_MAGIC, REC_MAGICLEN) != 0) {
+    fclose(playfp);
+    playfp = NULL;
+    errno = EINVAL;
+    return -1;
+  }
+  play_epoch = 0;
+  for (i = 7; i >= 0; i--)
+    play_epoch = play_epoch << 8 | magic[REC_MAGICLEN + i];
+  play_ns = 0;
+  play_start = mono_ns();
+  return 0;
+}
+
+/*
+ * The next chunk: when it came, in ns since the start, its direction
+ * and the data, which stays valid until the next call. Returns its
+ * length, or -1 at the end.
+ */
+int replay_next(long long *ns, int *dir, char **data)
+{
+  unsigned long long delta, v;
+  size_t len;
+  char *p;
+
+  if (playfp == NULL || get_varint(&delta) < 0 || get_varint(&v) < 0)
+    return -1;
+  len = v >> 1;
+  if (len > INT_MAX)
+    return -1;
+  if (len > play_size) {
+    if ((p = realloc(play_buf, len)) == NULL)
+      return -1;
+    play_buf = p;
+    play_size = len;
+  }
+  if (fread(play_buf, 1, len, playfp) != len)
+    return -1;
+
+  play_ns += delta;
+  *ns = play_ns;
+  *dir = v & 1;
+  *data = play_buf;
+  return len;
+}
+
+/*
+ * How many ms until a chunk that came ns after the start of the
+ * recording should be shown, playing it at speed times the original
+ * pace. Speed 0 is as fast as possible.
+ */
+int replay_delay(long long ns, double speed)
+{
+  long long d;
+
+  if (speed <= 0)
+    return 0;
+  d = play_start + (long long)(ns / speed) - mono_ns();
+  return d > 0 ? (d + 999999) / 1000000 : 0;
+}
+
+long long replay_time(void)
+{
+  return mono_ns() - play_start;
+}
+
+/*
+ * When the recording was started, in ns since the epoch.
+ */
+long long replay_epoch(void)
+{
+  return play_epoch;
+}
+
+void replay_close(void)
+{
+  if (playfp)
+    fclose(playfp);
+  playfp = NULL;
+  free(play_buf);
+  play_buf = NULL;
+  play_size = 0;
+}
@@ -199,6 +199,13 @@ struct pars mpars[MPARS_MAX + 1] = {
   { "0",		0,    "msg_ch_delay" },
   { "0",		0,    "msg_nl_delay" },
 
+  { "60",		0,    "framerate" },
+  { "Yes",		0,    "syncoutput" },
+
+  /* History in segment files, see history.c */
+  { "",			0,    "histdir" },
+  { "No",		0,    "histgzip" },
+
   /* That's all folks */
   { "",                 0,         NULL },
 };
@@ -0,0 +1,358 @@
+/*
+ * rxthread.c	Read the serial port in the background.
+ *
+ *		Entry points:
+ *
+ *		rx_start(fd)     - start reading fd into the receive ring
+ *		rx_stop()        - stop reading (before handing the port to
+ *		                   another program, or closing it)
+ *		rx_flush()       - throw away what is in the ring
+ *		rx_read(buf, n)  - take data from the ring
+ *		rx_times(&t)     - when what rx_read() took came in
+ *		rx_notify_fd()   - becomes readable when there is data
+ *
+ *		A thread reads the port into a single producer, single
+ *		consumer ring buffer as soon as data arrives, so nothing
+ *		is lost while the user sits in a menu or the screen is
+ *		slow. The main loop sleeps on rx_notify_fd() instead of
+ *		on the port itself.
+ *
+ *		Each read() is timestamped as it is done, so line
+ *		timestamps show when the data came, not when it was
+ *		displayed.
+ *
+ *		Without pthreads rx_start() fails and the port is read
+ *		directly, as before.
+ *
+ *		This file is part of the minicom communications package,
+ *		Copyright 1991-1995 Miquel van Smoorenburg.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <config.h>
+
+#include "port.h"
+#include "minicom.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <poll.h>
+
+/* About a second at 4 Mbps. Must be a power of two. */
+#define RING_SIZE	(1 << 19)
+
+static char *ring;
+/* head is only written by the reader thread, tail only by the main
+ * thread. Both only ever increase; the index is taken modulo RING_SIZE. */
+static size_t head, tail;
+static int ring_eof;		/* Set by the thread on EOF or error */
+static int pending;		/* A wakeup is in the notify pipe */
+
+static pthread_t rx_tid;
+static int rx_running;
+static int rx_fd = -1;
+static int notify_pipe[2] = { -1, -1 };
+static int stop_pipe[2] = { -1, -1 };
+
+/* When each read() was done: pos is where in the ring its data starts.
+ * stamp_head is written by the thread, stamp_tail by the main thread.
+ * When it is full, the data is counted with the read before it. */
+#define STAMPS		1024
+static struct stamp {
+  size_t pos;
+  struct timespec mono, real;
+} stamps[STAMPS];
+static size_t stamp_head, stamp_tail;
+
+/* For rx_times(). */
+static struct rxtime rd_times[RXTIMES];
+static int rd_ntimes;
+
+#define LOAD(v)		__atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x)	__atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+
+/* Wake up the main thread, unless it has a wakeup coming already. */
+static void notify(void)
+{
+  char c = 0;
+
+  if (__atomic_exchange_n(&pending, 1, __ATOMIC_SEQ_CST) == 0
+      && write(notify_pipe[1], &c, 1) < 0)
+    pending = 0;
+}
+
+static void *rx_loop(void *arg)
+{
+  struct pollfd pfd[2];
+  size_t h, sh, room, n;
+  ssize_t r;
+  struct stamp *s;
+
+  (void)arg;
+  pfd[0].fd = rx_fd;
+  pfd[1].fd = stop_pipe[0];
+  pfd[1].events = POLLIN;
+
+  h = head;
+  sh = stamp_head;
+  while (1) {
+    room = RING_SIZE - (h - LOAD(tail));
+    /* When the ring is full, wait for the main thread to catch up. */
+    pfd[0].events = room ? POLLIN : 0;
+    if (poll(pfd, 2, room ? -1 : 10) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (pfd[1].revents)
+      break;
+    if (room == 0 || pfd[0].revents == 0)
+      continue;
+
+    /* Read into the contiguous free part of the ring. */
+    n = RING_SIZE - (h & (RING_SIZE - 1));
+    if (n > room)
+      n = room;
+    r = read(rx_fd, ring + (h & (RING_SIZE - 1)), n);
+    if (r < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (r <= 0) {
+      STORE(ring_eof, 1);
+      notify();
+      break;
+    }
+
+    if (sh - LOAD(stamp_tail) < STAMPS) {
+      s = &stamps[sh & (STAMPS - 1)];
+      s->pos = h;
+      clock_gettime(CLOCK_MONOTONIC, &s->mono);
+      clock_gettime(CLOCK_REALTIME, &s->real);
+      STORE(stamp_head, ++sh);
+    }
+    h += r;
+    STORE(head, h);
+    notify();
+  }
+  return NULL;
+}
+
+/*
+ * Start reading fd in the background. Does nothing if that is already
+ * being done. Returns -1 if it can't be done.
+ */
+int rx_start(int fd)
+{
+  sigset_t all, old;
+  int i;
+
+  if (rx_running)
+    return rx_fd == fd ? 0 : -1;
+  if (fd < 0)
+    return -1;
+  if (ring == NULL && (ring = malloc(RING_SIZE)) == NULL)
+    return -1;
+
+  if (pipe(notify_pipe) < 0)
+    return -1;
+  if (pipe(stop_pipe) < 0) {
+    close(notify_pipe[0]);
+    close(notify_pipe[1]);
+    return -1;
+  }
+  for (i = 0; i < 2; i++) {
+    fcntl(notify_pipe[i], F_SETFL, O_NONBLOCK);
+    fcntl(notify_pipe[i], F_SETFD, FD_CLOEXEC);
+    fcntl(stop_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  rx_fd = fd;
+  ring_eof = 0;
+  pending = 0;
+  /* The port is read by the thread from now on. */
+  reactor_del(fd);
+
+  /* Signals are for the main thread only. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  i = pthread_create(&rx_tid, NULL, rx_loop, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (i != 0) {
+    for (i = 0; i < 2; i++) {
+      close(notify_pipe[i]);
+      close(stop_pipe[i]);
+    }
+    notify_pipe[0] = -1;
+    rx_fd = -1;
+    return -1;
+  }
+  rx_running = 1;
+  return 0;
+}
+
+/*
+ * Stop the reader thread. Whatever it has read stays in the ring.
+ */
+void rx_stop(void)
+{
+  char c = 0;
+  int i;
+
+  if (!rx_running)
+    return;
+
+  if (write(stop_pipe[1], &c, 1) == 1)
+    pthread_join(rx_tid, NULL);
+  reactor_del(notify_pipe[0]);
+  for (i = 0; i < 2; i++) {
+    close(notify_pipe[i]);
+    close(stop_pipe[i]);
+  }
+  notify_pipe[0] = -1;
+  rx_running = 0;
+  rx_fd = -1;
+}
+
+/*
+ * Discard the data in the ring, as m_flush() does for the kernel buffer.
+ */
+void rx_flush(void)
+{
+  STORE(tail, LOAD(head));
+}
+
+/*
+ * Take up to len bytes from the ring. Like read(), returns 0 at EOF
+ * and -1 with errno set to EAGAIN when there is nothing (yet).
+ */
+int rx_read(char *buf, int len)
+{
+  char c[64];
+  size_t h, t, n, off, sh, st;
+  struct stamp *s;
+
+  /* Clear the wakeup before looking at head, so that data stored
+   * after that always causes a new one. */
+  if (__atomic_exchange_n(&pending, 0, __ATOMIC_SEQ_CST))
+    while (read(notify_pipe[0], c, sizeof(c)) > 0)
+      ;
+
+  h = LOAD(head);
+  t = tail;
+  if (h == t) {
+    /* The thread is gone; it is started again on the next check. */
+    if (LOAD(ring_eof)) {
+      rx_stop();
+      return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+  }
+
+  n = h - t;
+  if (n > (size_t)len)
+    n = len;
+  off = t & (RING_SIZE - 1);
+  if (off + n > RING_SIZE) {
+    memcpy(buf, ring + off, RING_SIZE - off);
+    memcpy(buf + RING_SIZE - off, ring, n - (RING_SIZE - off));
+  } else
+    memcpy(buf, ring + off, n);
+
+  /* The stamps for t up to t + n. Keep the last one at or before
+   * t + n: it is for the start of the next read. */
+  sh = LOAD(stamp_head);
+  st = stamp_tail;
+  while (sh - st > 1 && stamps[(st + 1) & (STAMPS - 1)].pos <= t)
+    st++;
+  for (rd_ntimes = 0; st != sh && rd_ntimes < RXTIMES; st++) {
+    s = &stamps[st & (STAMPS - 1)];
+    if (s->pos >= t + n)
+      break;
+    rd_times[rd_ntimes].off = s->pos > t ? s->pos - t : 0;
+    rd_times[rd_ntimes].mono = s->mono;
+    rd_times[rd_ntimes].real = s->real;
+    rd_ntimes++;
+  }
+  if (st != stamp_tail)
+    STORE(stamp_tail, st - 1);
+  STORE(tail, t + n);
+
+  /* Come back for the rest. */
+  if (t + n != h)
+    notify();
+  return n;
+}
+
+/*
+ * When the data that rx_read() returned last came in.
+ */
+int rx_times(const struct rxtime **t)
+{
+  *t = rd_times;
+  return rd_ntimes;
+}
+
+/*
+ * The fd to wait on for data, or -1 if the port should be read directly.
+ */
+int rx_notify_fd(void)
+{
+  return rx_running ? notify_pipe[0] : -1;
+}
+
+/*
+ * Is fd being read by the thread?
+ */
+int rx_active(int fd)
+{
+  return rx_running && fd >= 0 && fd == rx_fd;
+}
+
+#else
+
+int rx_start(int fd)
+{
+  (void)fd;
+  return -1;
+}
+
+void rx_stop(void)
+{
+}
+
+void rx_flush(void)
+{
+}
+
+int rx_read(char *buf, int len)
+{
+  (void)buf;
+  (void)len;
+  errno = EAGAIN;
+  return -1;
+}
+
+int rx_times(const struct rxtime **t)
+{
+  (void)t;
+  return 0;
+}
+
+int rx_notify_fd(void)
+{
+  return -1;
+}
+
+int rx_active(int fd)
+{
+  (void)fd;
+  return 0;
+}
+
+#endif
@@ -30,6 +30,8 @@
 #include <config.h>
 #include <sys/wait.h>
 #include <stdarg.h>
+#include <regex.h>
+#include <poll.h>
 
 #include "port.h"
 #include "minicom.h"
@@ -41,29 +43,103 @@
 #define BREAK	2
 
 enum {
+  CAPTURE        = 253,		/* Followed by the digit of $(0)..$(9) */
   NULL_CHARACTER = 254,
   SKIP_NEWLINE   = 255,
 };
 
 struct line {
   char *line;
-  int labelcount;
   int lineno;
-  struct line *next;
 };
 
 struct var {
   char *name;
   int value;
-  struct var *next;
+  int set;			/* Has it been set yet? */
+  struct var *next;		/* In the same hash chain */
+};
+
+struct label {
+  char *name;
+  int line;
+  struct label *next;		/* In the same hash chain */
+};
+
+/* A number in a command: a constant, a variable or $?. */
+enum { NUM_CONST, NUM_VAR, NUM_STATUS };
+
+struct num {
+  int type;
+  int value;
+  struct var *var;
+  int scale;			/* For times: ms per unit */
+};
+
+struct insn;
+
+/* One line in an expect block. */
+struct pattern {
+  char *word;
+  regex_t *re;			/* For -re, else word is literal */
+  struct insn *action;		/* What to do, or NULL */
+};
+
+/*
+ * The literal patterns of an expect, as an Aho-Corasick automaton:
+ * a trie of the patterns, where each node also knows the longest
+ * suffix of its string that is in the trie too (fail), and the first
+ * pattern that ends there (match).
+ */
+struct acnode {
+  int child;			/* First child */
+  int sibling;			/* Next child of the same parent */
+  int fail;
+  int match;			/* Pattern, or -1 */
+  unsigned char c;		/* The char that leads here */
+};
+
+/*
+ * A compiled command. Every line of the script is compiled into one
+ * of these when it is read, so running it needs no parsing.
+ */
+enum {
+  OP_NOP, OP_ERROR, OP_EXPECT, OP_SEND, OP_PIPEDSHELL, OP_SHELL,
+  OP_GOTO, OP_GOSUB, OP_RETURN, OP_EXIT, OP_PRINT, OP_SET, OP_INC,
+  OP_DEC, OP_IF, OP_TIMEOUT, OP_VERBOSE, OP_SLEEP, OP_BREAK, OP_CALL,
+  OP_LOG,
+};
+
+struct insn {
+  int op;
+  int lineno;
+  int flag;			/* exit, set, expect: has a number;
+				   if: the operator; verbose: on */
+  int target;			/* goto, gosub: the label's line;
+				   expect: the line with the } */
+  struct num a, b;
+  char *text;			/* Text to send, print, run or log,
+				   or the error message */
+  int len;
+  struct var *var;		/* set, inc, dec */
+  struct insn *sub;		/* if: the command;
+				   expect: what to do on a timeout */
+  struct pattern *pat;		/* expect */
+  int npat;
+  struct acnode *ac;		/* expect: the literals in pat */
+  int nre;			/* expect: how many pats are -re */
 };
 
 /*
  * Structure describing the script we are currently executing.
  */
 struct env {
-  struct line *lines;		/* Start of all lines */
-  struct var *vars;		/* Start of all variables */
+  struct line *lines;		/* All lines */
+  struct insn *code;		/* And what they compiled to */
+  int nlines;
+  struct var **vars;		/* Hash table of all variables */
+  struct label **labels;	/* And of all labels */
+  unsigned hashmask;		/* Their size - 1 */
   const char *scriptname;	/* Name of this script */
   int verbose;			/* Are we verbose? */
   jmp_buf ebuf;			/* For exit */
@@ -71,22 +147,27 @@ struct env {
 };
 
 struct env *curenv;		/* Execution environment */
-int gtimeout = 120;		/* Global Timeout */
-int etimeout = 0;		/* Timeout in expect routine */
-jmp_buf ejmp;			/* To jump to if expect times out */
 int inexpect = 0;		/* Are we in the expect routine */
-const char *newline;		/* What to print for '\n'. */
 const char *s_login = "name";	/* User's login name */
 const char *s_pass = "password";/* User's password */
-struct line *thisline;		/* Line to be executed */
+int pc;				/* Line being executed */
 int laststatus = 0;		/* Status of last command */
 char homedir[256];		/* Home directory */
 char logfname[PARS_VAL_LEN];	/* Name of logfile */
 
-static char inbuf[65];		/* Input buffer. */
+/*
+ * What has been read but not matched yet. It is cleared by a send and
+ * grows until a pattern matches, up to MAXWINDOW.
+ */
+#define MAXWINDOW	(1024 * 1024)
+
+static char *win;
+static size_t wlen, wsize;
+static char *capture[10];	/* $(0)..$(9) of the last match */
 
 /* Forward declarations */
-int s_exec(char *);
+static void compile(struct insn *, char *, int);
+static int run(struct insn *);
 int execscript(const char *);
 
 /*
@@ -129,7 +210,7 @@ const char *mygetenv(char *env)
 void syntaxerr(const char *s)
 {
   fprintf(stderr, _("script \"%s\": syntax error in line %d %s%s\n"),
-          curenv->scriptname, thisline->lineno, s, "\r");
+          curenv->scriptname, curenv->code[pc].lineno, s, "\r");
   exit(1);
 }
 
@@ -143,21 +224,99 @@ void skipspace(char **s)
 }
 
 /*
- * Our clock. This gets called every second.
+ * Timers, in ms on the monotonic clock, 0 if not set. The global
+ * timeout is always running; expect and sleep have their own.
  */
-void myclock(int dummy)
+enum { T_GLOBAL, T_EXPECT, T_SLEEP, NTIMERS };
+#define T_INPUT		NTIMERS		/* For wait_event() */
+
+static long long timers[NTIMERS];
+static int ineof;			/* Nothing more to read */
+static int rxfd = -1;			/* Read before the port, see main() */
+
+static long long now_ms(void)
 {
-  (void)dummy;
-  signal(SIGALRM, myclock);
-  alarm(1);
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-  if (--gtimeout == 0) {
+/* Set a timer to go off in ms; if that is not > 0, never. */
+static void settimer(int t, long long ms)
+{
+  timers[t] = ms > 0 ? now_ms() + ms : 0;
+}
+
+static void checkglobal(long long now)
+{
+  if (timers[T_GLOBAL] && now >= timers[T_GLOBAL]) {
     fprintf(stderr, _("script \"%s\": global timeout%s\n"),
             curenv->scriptname,"\r");
     exit(1);
   }
-  if (inexpect && etimeout && --etimeout == 0)
-    siglongjmp(ejmp, 1);
+}
+
+/*
+ * Running a program or writing to the port can block, and not in
+ * wait_event(). While they do, the global timeout is a SIGALRM too.
+ */
+static void globalsig(int dummy)
+{
+  (void)dummy;
+  checkglobal(timers[T_GLOBAL]);
+}
+
+static void backstop(int on)
+{
+  struct itimerval it;
+  long long left;
+
+  memset(&it, 0, sizeof(it));
+  if (on && timers[T_GLOBAL]) {
+    if ((left = timers[T_GLOBAL] - now_ms()) < 1)
+      left = 1;
+    it.it_value.tv_sec = left / 1000;
+    it.it_value.tv_usec = left % 1000 * 1000;
+    signal(SIGALRM, globalsig);
+  }
+  setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/*
+ * The event loop: wait until one of the timers in mask goes off, or
+ * input comes in if T_INPUT is in it, and return which. The global
+ * timeout ends the script when it goes off. Other timers that went
+ * off stay that way until they are waited for.
+ */
+static int wait_event(int mask)
+{
+  struct pollfd pfd;
+  long long now, when;
+  int t;
+
+  if ((mask & (1 << T_INPUT)) && rxfd >= 0)
+    return T_INPUT;
+  pfd.fd = 0;
+  pfd.events = POLLIN;
+  while (1) {
+    now = now_ms();
+    checkglobal(now);
+    when = timers[T_GLOBAL];
+    for (t = T_GLOBAL + 1; t < NTIMERS; t++) {
+      if (!(mask & (1 << t)) || timers[t] == 0)
+        continue;
+      if (now >= timers[t])
+        return t;
+      if (when == 0 || timers[t] < when)
+        when = timers[t];
+    }
+    if (when && when - now > INT_MAX)
+      when = now + INT_MAX;
+    if (poll(&pfd, (mask & (1 << T_INPUT)) && !ineof,
+             when ? (int)(when - now) : -1) > 0)
+      return T_INPUT;
+  }
 }
 
 static char *buffer; /* The buffer is only growing and never freed... */
@@ -188,6 +347,8 @@ static inline char *buf()
   return buffer;
 }
 
+static int badword;		/* getword() saw an open quote or \ */
+
 /*
  * Read a word and advance pointer.
  * Also processes quoting, variable substituting, and \ escapes.
@@ -203,6 +364,7 @@ char *getword(char **s)
   const char *env;
   char envbuf[32];
 
+  badword = 0;
   if (**s == 0)
     return NULL;
 
@@ -262,6 +424,13 @@ char *getword(char **s)
     if (t[len] == '$' && t[len + 1] == '(') {
       for(f = len; t[f] && t[f] != ')'; f++)
         ;
+      if (t[f] == ')' && f - len == 3 && isdigit(t[len + 2])) {
+        /* $(0)..$(9) are filled in when the line is run. */
+        buf_wr(idx++, CAPTURE);
+        buf_wr(idx++, t[len + 2]);
+        len = f;
+        continue;
+      }
       if (t[f] == ')') {
         strncpy(envbuf, &t[len + 2], f - len - 2);
         envbuf[f - len - 2] = 0;
@@ -290,8 +459,7 @@ char *getword(char **s)
   buf_wr(idx, 0);
   *s += len;
   skipspace(s);
-  if (sawesc || sawq)
-    syntaxerr(_("(word contains ESC or quote)"));
+  badword = sawesc || sawq;
   return buf();
 }
 
@@ -312,24 +480,77 @@ char *strsave(char *s)
   return t;
 }
 
+static void nomem(void)
+{
+  fprintf(stderr, _("script \"%s\": out of memory%s\n"),
+          curenv->scriptname, "\r");
+  exit(1);
+}
+
+static void *xmalloc(size_t n)
+{
+  void *p;
+
+  if ((p = calloc(1, n)) == NULL)
+    nomem();
+  return p;
+}
+
+static void freeinsn(struct insn *in)
+{
+  int f;
+
+  free(in->text);
+  if (in->sub) {
+    freeinsn(in->sub);
+    free(in->sub);
+  }
+  for (f = 0; f < in->npat; f++) {
+    free(in->pat[f].word);
+    if (in->pat[f].re) {
+      regfree(in->pat[f].re);
+      free(in->pat[f].re);
+    }
+    if (in->pat[f].action) {
+      freeinsn(in->pat[f].action);
+      free(in->pat[f].action);
+    }
+  }
+  free(in->pat);
+  free(in->ac);
+}
+
 /*
  * Throw away all malloced memory.
  */
 void freemem(void)
 {
-  struct line *l, *nextl;
   struct var *v, *nextv;
+  struct label *l, *nextl;
+  unsigned h;
+  int f;
 
-  for (l = curenv->lines; l; l = nextl) {
-    nextl = l->next;
-    free(l->line);
-    free(l);
+  for (h = 0; curenv->vars && h <= curenv->hashmask; h++) {
+    for (v = curenv->vars[h]; v; v = nextv) {
+      nextv = v->next;
+      free(v->name);
+      free(v);
+    }
+    for (l = curenv->labels[h]; l; l = nextl) {
+      nextl = l->next;
+      free(l->name);
+      free(l);
+    }
   }
-  for (v = curenv->vars; v; v = nextv) {
-    nextv = v->next;
-    free(v->name);
-    free(v);
+  free(curenv->vars);
+  free(curenv->labels);
+  for (f = 0; f < curenv->nlines; f++) {
+    free(curenv->lines[f].line);
+    if (curenv->code)
+      freeinsn(&curenv->code[f]);
   }
+  free(curenv->lines);
+  free(curenv->code);
 }
 
 /*
@@ -338,17 +559,18 @@ void freemem(void)
 static int readscript(const char *s)
 {
   FILE *fp;
-  struct line *tl, *prev = NULL;
+  struct line *tl;
   char *t;
   char buf[500]; /* max length of a line - this should be dynamically! */
   int lineno = 0;
+  int size = 0;
 
   if ((fp = fopen(s, "r")) == NULL) {
     fprintf(stderr, _("runscript: couldn't open \"%s\"%s\n"), s, "\r");
     exit(1);
   }
 
-  /* Read all the lines into a linked list in memory. */
+  /* Read all the lines into an array in memory. */
   while ((t = fgets(buf, sizeof(buf), fp)) != NULL) {
     lineno++;
     if (strlen(t) == sizeof(buf) - 1) {
@@ -363,276 +585,893 @@ static int readscript(const char *s)
     skipspace(&t);
     if (*t == '\n' || *t == '#')
       continue;
-    if (((tl = (struct line *)malloc(sizeof (struct line))) == NULL) ||
-        ((tl->line = strsave(t)) == NULL)) {
-      fprintf(stderr, _("script \"%s\": out of memory%s\n"), s, "\r");
-      exit(1);
-    }
-    if (prev)
-      prev->next = tl;
-    else
+    if (curenv->nlines == size) {
+      size = size ? 2 * size : 64;
+      if ((tl = realloc(curenv->lines, size * sizeof(struct line))) == NULL)
+        nomem();
       curenv->lines = tl;
-    tl->next = NULL;
-    tl->labelcount = 0;
+    }
+    tl = &curenv->lines[curenv->nlines];
+    if ((tl->line = strsave(t)) == NULL)
+      nomem();
     tl->lineno = lineno;
-    prev = tl;
+    curenv->nlines++;
   }
   fclose(fp);
   return 0;
 }
 
-/* Read one character, and store it in the buffer. */
-void readchar(void)
+static unsigned hash(const char *s, int len)
+{
+  unsigned h = 2166136261u;
+
+  while (len-- > 0)
+    h = (h ^ (unsigned char)*s++) * 16777619u;
+  return h & curenv->hashmask;
+}
+
+/*
+ * Does the line start an expect block, i.e. end in "expect {"?
+ */
+static int expectblock(char *t)
+{
+  char *w;
+  int wasexpect = 0;
+
+  while ((w = getword(&t)) != NULL) {
+    if (wasexpect && !strcmp(w, "{") && *t == 0)
+      return 1;
+    wasexpect = !strcmp(w, "expect");
+  }
+  return 0;
+}
+
+/*
+ * Make the symbol tables, big enough for the script, and enter
+ * the labels: lines whose first word ends in ':', except in expect
+ * blocks, where that is a pattern.
+ */
+static void findlabels(void)
+{
+  struct label *l;
+  char *t, *w;
+  unsigned h;
+  int f, len, inblock = 0;
+
+  for (h = 16; h < (unsigned)curenv->nlines; h *= 2)
+    ;
+  curenv->hashmask = h - 1;
+  curenv->vars = xmalloc(h * sizeof(struct var *));
+  curenv->labels = xmalloc(h * sizeof(struct label *));
+
+  for (f = 0; f < curenv->nlines; f++) {
+    t = curenv->lines[f].line;
+    if (inblock) {
+      w = getword(&t);
+      inblock = w == NULL || strcmp(w, "}");
+      continue;
+    }
+    if (expectblock(t)) {
+      inblock = 1;
+      continue;
+    }
+    len = strcspn(t, " \t");
+    if (len < 2 || t[len - 1] != ':')
+      continue;
+    h = hash(t, --len);
+    for (l = curenv->labels[h]; l; l = l->next)
+      if (!strncmp(l->name, t, len) && l->name[len] == 0) {
+        fprintf(stderr, _("script \"%s\" line %d: label \"%s\" already "
+                          "defined in line %d%s\n"),
+                curenv->scriptname, curenv->lines[f].lineno, l->name,
+                curenv->lines[l->line].lineno, "\r");
+        exit(1);
+      }
+    l = xmalloc(sizeof(struct label));
+    if ((l->name = strndup(t, len)) == NULL)
+      nomem();
+    l->line = f;
+    l->next = curenv->labels[h];
+    curenv->labels[h] = l;
+  }
+}
+
+/*
+ * Read what is there, at least one char, and add it to the window.
+ * Returns how much was dropped from the start of the window.
+ */
+static size_t readdata(void)
 {
+  char buf[4096];
+  ssize_t n, i;
+  size_t dropped = 0;
+  char *p;
+
+  while ((n = read(rxfd >= 0 ? rxfd : 0, buf, sizeof(buf))) < 0 &&
+         errno == EINTR)
+    ;
+  if (n <= 0 && rxfd >= 0) {
+    /* On to the port. */
+    close(rxfd);
+    rxfd = -1;
+    return 0;
+  }
+  if (n <= 0) {
+    /* Nothing will ever match now, wait for the timeout. */
+    ineof = 1;
+    return 0;
+  }
+  if (curenv->verbose) {
+    fwrite(buf, 1, n, stderr);
+    fflush(stderr);
+  }
+
+  if (wlen + n > MAXWINDOW) {
+    /* Forget the oldest half. */
+    i = wlen > MAXWINDOW / 2 ? wlen - MAXWINDOW / 2 : wlen;
+    memmove(win, win + i, wlen - i);
+    wlen -= i;
+    dropped = i;
+  }
+  if (wlen + n + 1 > wsize) {
+    if ((p = realloc(win, wlen + n + 1 + 4096)) == NULL)
+      nomem();
+    win = p;
+    wsize = wlen + n + 1 + 4096;
+  }
+  /* A NUL would end the string for the regexes. */
+  for (i = 0; i < n; i++)
+    if (buf[i])
+      win[wlen++] = buf[i];
+  return dropped;
+}
+
+/*
+ * Remember the captures of a match and drop the window up to its end.
+ */
+static void consume(const regmatch_t *rm)
+{
+  char name[8];
+  int f;
+
+  for (f = 0; f < 10; f++) {
+    free(capture[f]);
+    capture[f] = NULL;
+    snprintf(name, sizeof(name), "MATCH%d", f);
+    if (rm[f].rm_so >= 0) {
+      if ((capture[f] = strndup(win + rm[f].rm_so,
+                                rm[f].rm_eo - rm[f].rm_so)) == NULL)
+        nomem();
+      /* For ! and !< */
+      setenv(name, capture[f], 1);
+    } else
+      unsetenv(name);
+  }
+  wlen -= rm[0].rm_eo;
+  memmove(win, win + rm[0].rm_eo, wlen);
+}
+
+/* The next state of the automaton after char c. */
+static int acstep(const struct acnode *ac, int s, unsigned char c)
+{
+  int t;
+
+  while (1) {
+    for (t = ac[s].child; t; t = ac[t].sibling)
+      if (ac[t].c == c)
+        return t;
+    if (s == 0)
+      return 0;
+    s = ac[s].fail;
+  }
+}
+
+/*
+ * Build the automaton for the literal patterns of an expect.
+ */
+static void acbuild(struct insn *in)
+{
+  struct acnode *ac;
+  int *queue;
+  int n = 1, f, s, t, head = 0, tail = 0;
+  unsigned char *w;
+
+  for (f = 0; f < in->npat; f++)
+    if (!in->pat[f].re)
+      n += strlen(in->pat[f].word);
+  ac = in->ac = xmalloc(n * sizeof(struct acnode));
+  queue = xmalloc(n * sizeof(int));
+  ac[0].match = -1;
+
+  /* The trie. */
+  n = 1;
+  for (f = 0; f < in->npat; f++) {
+    if (in->pat[f].re)
+      continue;
+    s = 0;
+    for (w = (unsigned char *)in->pat[f].word; *w; w++) {
+      for (t = ac[s].child; t; t = ac[t].sibling)
+        if (ac[t].c == *w)
+          break;
+      if (t == 0) {
+        t = n++;
+        ac[t].c = *w;
+        ac[t].match = -1;
+        ac[t].sibling = ac[s].child;
+        ac[s].child = t;
+      }
+      s = t;
+    }
+    if (ac[s].match < 0)
+      ac[s].match = f;
+  }
+
+  /*
+   * The fail links, breadth first so that those of shorter strings
+   * are there already. A node also matches what its fail node does.
+   */
+  for (t = ac[0].child; t; t = ac[t].sibling)
+    queue[tail++] = t;
+  while (head < tail) {
+    s = queue[head++];
+    if (ac[s].match < 0 ||
+        (ac[ac[s].fail].match >= 0 && ac[ac[s].fail].match < ac[s].match))
+      ac[s].match = ac[ac[s].fail].match;
+    for (t = ac[s].child; t; t = ac[t].sibling) {
+      ac[t].fail = acstep(ac, ac[s].fail, ac[t].c);
+      queue[tail++] = t;
+    }
+  }
+  free(queue);
+}
+
+/*
+ * Look for the patterns in the window. The literals are scanned from
+ * *scanned on in state *state; a regex counts if it ends no later
+ * than the first literal. Returns the pattern that matched first,
+ * with where in rm, or -1.
+ */
+static int findmatch(struct insn *in, int *state, size_t *scanned,
+                     regmatch_t *rm)
+{
+  regmatch_t r[10];
+  size_t pos, lim, end = wlen;
+  int f, m = -1;
   char c;
-  int n;
 
-  while ((n = read(0, &c, 1)) != 1)
-    if (errno != EINTR)
+  for (pos = *scanned; pos < wlen; pos++) {
+    *state = acstep(in->ac, *state, win[pos]);
+    if ((f = in->ac[*state].match) >= 0) {
+      m = f;
+      end = pos + 1;
+      rm[0].rm_so = end - strlen(in->pat[f].word);
+      rm[0].rm_eo = end;
+      for (f = 1; f < 10; f++)
+        rm[f].rm_so = -1;
       break;
+    }
+  }
+  *scanned = pos;
+
+  if (in->nre == 0 || win == NULL)
+    return m;
+  lim = end;
+  c = win[lim];
+  win[lim] = 0;
+  for (f = 0; f < in->npat; f++) {
+    if (in->pat[f].re == NULL ||
+        regexec(in->pat[f].re, win, 10, r, REG_NOTEOL) != 0)
+      continue;
+    if ((size_t)r[0].rm_eo < end ||
+        ((size_t)r[0].rm_eo == end && (m < 0 || f < m))) {
+      m = f;
+      end = r[0].rm_eo;
+      memcpy(rm, r, sizeof(r));
+    }
+  }
+  win[lim] = c;
+  return m;
+}
 
-  if (n <= 0)
-    return;
+/*
+ * Find a variable in the list. If it is not there, create it; it is
+ * unknown until it is set.
+ */
+static struct var *intern(const char *name)
+{
+  struct var *v;
+  unsigned h = hash(name, strlen(name));
 
-  /* Shift character into the buffer. */
-#ifdef _SYSV
-  memcpy(inbuf, inbuf + 1, 63);
-#else
-#  ifdef _BSD43
-  bcopy(inbuf + 1, inbuf, 63);
-#  else
-  /* This is Posix, I believe. */
-  memmove(inbuf, inbuf + 1, 63);
-#  endif
-#endif
-  if (curenv->verbose)
-    fputc(c, stderr);
-  inbuf[63] = c;
+  for (v = curenv->vars[h]; v; v = v->next)
+    if (!strcmp(v->name, name))
+      return v;
+  v = xmalloc(sizeof(struct var));
+  if ((v->name = strdup(name)) == NULL)
+    nomem();
+  v->next = curenv->vars[h];
+  curenv->vars[h] = v;
+  return v;
 }
 
-/* See if a string just came in. */
-int expfound(const char *word)
+/*
+ * Check that a variable has been set.
+ */
+static struct var *getvar(struct var *v)
 {
-  int len;
-
-  if (word == NULL) {
-    fprintf(stderr, _("NULL paramenter to %s!"), __func__);
+  if (!v->set) {
+    fprintf(stderr, _("script \"%s\" line %d: unknown variable \"%s\"%s\n"),
+            curenv->scriptname, curenv->code[pc].lineno, v->name, "\r");
     exit(1);
   }
+  return v;
+}
 
-  len = strlen(word);
-  if (len > 64)
-    len = 64;
+/*
+ * The value of a number or variable.
+ */
+static int getnum(const struct num *n)
+{
+  if (n->type == NUM_STATUS)
+    return laststatus;
+  if (n->type == NUM_VAR)
+    return getvar(n->var)->value;
+  return n->value;
+}
 
-  return !strcmp(inbuf + 64 - len, word);
+/*
+ * The value of a time, in ms.
+ */
+static long long getms(const struct num *n)
+{
+  return (long long)getnum(n) * n->scale;
 }
 
 /*
- * Send text to a file (stdout or stderr).
+ * Compiling. Errors are not reported yet: the line becomes an
+ * OP_ERROR that prints the message if it is run, as it always did.
  */
-int output(char *text, FILE *fp)
+static jmp_buf *cjmp;		/* Where to go on an error */
+static struct insn *cin;	/* What we are compiling */
+static int clineno;		/* And its line number */
+
+static void cerror(const char *fmt, ...)
+{
+  char msg[512];
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  freeinsn(cin);
+  memset(cin, 0, sizeof(*cin));
+  cin->op = OP_ERROR;
+  cin->lineno = clineno;
+  if ((cin->text = strdup(msg)) == NULL)
+    nomem();
+  longjmp(*cjmp, 1);
+}
+
+static void csyntax(const char *s)
+{
+  cerror(_("script \"%s\": syntax error in line %d %s%s\n"),
+         curenv->scriptname, clineno, s, "\r");
+}
+
+static char *cword(char **s)
+{
+  char *w = getword(s);
+
+  if (badword)
+    csyntax(_("(word contains ESC or quote)"));
+  return w;
+}
+
+/*
+ * Read a number or variable.
+ */
+static void cnum(struct num *n, const char *text)
+{
+  if (!strcmp(text, "$?"))
+    n->type = NUM_STATUS;
+  else if ((n->value = atoi(text)) != 0 || *text == '0')
+    n->type = NUM_CONST;
+  else {
+    n->type = NUM_VAR;
+    n->var = intern(text);
+  }
+}
+
+/*
+ * Read a time: seconds, possibly with a fraction, or ms with "ms"
+ * after it. Variables and $? are in seconds.
+ */
+static void cmsec(struct num *n, const char *text)
+{
+  char *end;
+  double d;
+
+  if (isdigit(*text) || *text == '.') {
+    d = strtod(text, &end);
+    if (!strcmp(end, "ms") || (*end == 0 && strchr(text, '.'))) {
+      if (*end == 0)
+        d *= 1000;
+      n->type = NUM_CONST;
+      n->value = d > INT_MAX ? INT_MAX : (int)d;
+      n->scale = 1;
+      return;
+    }
+  }
+  cnum(n, text);
+  n->scale = 1000;
+}
+
+static char *csave(const char *text)
+{
+  char *s;
+
+  if ((s = strdup(text)) == NULL)
+    nomem();
+  return s;
+}
+
+/*
+ * Text for send or print: the words with single spaces between them
+ * and nl for each '\n', and at the end unless there is a \c.
+ */
+static void ctext(struct insn *in, char *text, const char *nl)
 {
   unsigned char *w;
+  char *s;
   int first = 1;
   int donl = 1;
-
-  while ((w = (unsigned char *)getword(&text)) != NULL) {
+  size_t size = 64, len = 0, nllen = strlen(nl);
+
+  s = xmalloc(size);
+  while ((w = (unsigned char *)cword(&text)) != NULL) {
+    /* Room for all of w, each char possibly a newline. */
+    if (len + (strlen((char *)w) + 2) * nllen + 1 > size) {
+      size = 2 * (len + (strlen((char *)w) + 2) * nllen + 1);
+      if ((s = realloc(s, size)) == NULL)
+        nomem();
+    }
     if (!first)
-      fputc(' ', fp);
+      s[len++] = ' ';
     first = 0;
     for(; *w; w++) {
       if (*w == SKIP_NEWLINE) {
         donl = 0;
         continue;
       }
-      if (*w == '\n')
-        fputs(newline, fp);
-      else if (*w == NULL_CHARACTER)
-        fputc('\0', fp);
+      if (*w == CAPTURE && w[1]) {
+        /* Filled in by emit(). */
+        s[len++] = *w++;
+        s[len++] = *w;
+        in->flag = 1;
+      } else if (*w == '\n') {
+        memcpy(s + len, nl, nllen);
+        len += nllen;
+      } else if (*w == NULL_CHARACTER)
+        s[len++] = 0;
       else
-        fputc(*w, fp);
+        s[len++] = *w;
     }
   }
-  if (donl)
-    fputs(newline, fp);
-  fflush(fp);
-  return OK;
+  if (donl) {
+    if (len + nllen > size && (s = realloc(s, len + nllen)) == NULL)
+      nomem();
+    memcpy(s + len, nl, nllen);
+    len += nllen;
+  }
+  in->text = s;
+  in->len = len;
 }
 
 /*
- * Find a variable in the list.
- * If it is not there, create it.
+ * Add a pattern to an expect: w, or the word after it if w is -re.
  */
-struct var *getvar(char *name, int cr)
+static struct pattern *cpattern(struct insn *in, char *w, char **s)
 {
-  struct var *v, *end = NULL;
+  struct pattern *p;
 
-  for (v = curenv->vars; v; v = v->next) {
-    end = v;
-    if (!strcmp(v->name, name))
-      return v;
+  if ((in->npat & 15) == 0) {
+    if ((p = realloc(in->pat, (in->npat + 16) * sizeof(*p))) == NULL)
+      nomem();
+    in->pat = p;
   }
-  if (!cr) {
-    fprintf(stderr, _("script \"%s\" line %d: unknown variable \"%s\"%s\n"),
-            curenv->scriptname, thisline->lineno, name, "\r");
-    exit(1);
+  p = &in->pat[in->npat++];
+  memset(p, 0, sizeof(*p));
+
+  if (strcmp(w, "-re")) {
+    p->word = csave(w);
+    return p;
   }
-  if ((v = (struct var *)malloc(sizeof(struct var))) == NULL ||
-      (v->name = strsave(name)) == NULL) {
-    fprintf(stderr, _("script \"%s\": out of memory%s\n"),
-            curenv->scriptname, "\r");
-    exit(1);
+  if ((w = cword(s)) == NULL)
+    csyntax(_("(argument expected)"));
+  p->word = csave(w);
+  p->re = xmalloc(sizeof(regex_t));
+  if (regcomp(p->re, w, REG_EXTENDED | REG_NEWLINE) != 0) {
+    free(p->re);
+    p->re = NULL;
+    csyntax(_("(bad regular expression)"));
   }
-  if (end)
-    end->next = v;
-  else
-    curenv->vars = v;
-  v->next = NULL;
-  v->value = 0;
-  return v;
+  in->nre++;
+  return p;
 }
 
 /*
- * Read a number or variable.
+ * The expect command, on one line or with a block of lines:
+ *
+ *	expect {
+ *		[-re] pattern [command]
+ *		timeout n [command]
+ *	}
  */
-int getnum(char *text)
+static void c_expect(struct insn *in, char *text, int line)
 {
-  int val;
+  char exit1[] = "exit 1";
+  struct pattern *p;
+  char *s, *w;
+  int f, c;
 
-  if (!strcmp(text, "$?"))
-    return laststatus;
-  if ((val = atoi(text)) != 0 || *text == '0')
-    return val;
-  return getvar(text, 0)->value;
+  in->target = line;
+  if ((w = cword(&text)) == NULL)
+    csyntax(_("(argument expected)"));
+
+  if (strcmp(w, "{")) {
+    cpattern(in, w, &text);
+  } else {
+    if (*text)
+      csyntax(_("(garbage after {)"));
+    for (f = line + 1; ; f++) {
+      if (f >= curenv->nlines)
+        cerror(_("script \"%s\": unexpected end of file%s\n"),
+               curenv->scriptname, "\r");
+      clineno = curenv->lines[f].lineno;
+      s = curenv->lines[f].line;
+      w = cword(&s);
+      if (!strcmp(w, "}")) {
+        if (*s)
+          csyntax(_("(garbage after })"));
+        break;
+      }
+
+      /* The first timeout line sets the timeout. */
+      if (!in->flag && !strncmp(curenv->lines[f].line, "timeout", 7) &&
+          ((c = curenv->lines[f].line[7]) == ' ' || c == '\t')) {
+        s = curenv->lines[f].line + 7;
+        skipspace(&s);
+        if ((w = cword(&s)) == NULL)
+          csyntax(_("(argument expected)"));
+        cmsec(&in->a, w);
+        in->flag = 1;
+        skipspace(&s);
+        if (*s) {
+          in->sub = xmalloc(sizeof(struct insn));
+          compile(in->sub, s, f);
+        }
+        continue;
+      }
+
+      p = cpattern(in, w, &s);
+      if (*s) {
+        p->action = xmalloc(sizeof(struct insn));
+        compile(p->action, s, f);
+      }
+    }
+    in->target = f;
+    clineno = in->lineno;
+  }
+  acbuild(in);
+  if (in->sub == NULL) {
+    in->sub = xmalloc(sizeof(struct insn));
+    compile(in->sub, exit1, line);
+  }
 }
 
+static void c_send(struct insn *in, char *text, int line)
+{
+  (void)line;
+  ctext(in, text, "\r");
+}
+
+static void c_print(struct insn *in, char *text, int line)
+{
+  (void)line;
+  ctext(in, text, "\r\n");
+}
+
+/* Commands that take the rest of the line as it is. */
+static void c_raw(struct insn *in, char *text, int line)
+{
+  (void)line;
+  in->text = csave(text);
+}
+
+/* Where text has a $(0)..$(9), or NULL. */
+static char *findcapture(char *text)
+{
+  for (; (text = strstr(text, "$(")) != NULL; text++)
+    if (isdigit(text[2]) && text[3] == ')')
+      return text;
+  return NULL;
+}
+
+static void c_log(struct insn *in, char *text, int line)
+{
+  c_raw(in, text, line);
+  in->flag = findcapture(text) != NULL;
+}
+
+static void c_call(struct insn *in, char *text, int line)
+{
+  if (*text == 0)
+    csyntax(_("(argument expected)"));
+  c_raw(in, text, line);
+}
 
 /*
- * Get the lines following "expect" into memory.
+ * Find the label for goto and gosub.
  */
-struct line **buildexpect(void)
+static void c_goto(struct insn *in, char *text, int line)
 {
-  static struct line *seq[17];
-  int f;
-  char *w, *t;
+  struct label *l;
+  char *w;
 
-  for(f = 0; f < 16; f++) {
-    if (thisline == NULL) {
-      fprintf(stderr, _("script \"%s\": unexpected end of file%s\n"),
-              curenv->scriptname, "\r");
-      exit(1);
+  (void)line;
+  w = cword(&text);
+  if (w == NULL || *text)
+    csyntax(_("(in goto/gosub label)"));
+  for (l = curenv->labels[hash(w, strlen(w))]; l; l = l->next)
+    if (!strcmp(l->name, w))
+      break;
+  if (l == NULL)
+    cerror(_("script \"%s\" line %d: label \"%s\" not found%s\n"),
+           curenv->scriptname, clineno, w, "\r");
+  in->target = l->line;
+}
+
+static void c_exit(struct insn *in, char *text, int line)
+{
+  char *w;
+
+  (void)line;
+  if ((w = cword(&text)) != NULL) {
+    cnum(&in->a, w);
+    in->flag = 1;
+  }
+}
+
+static void c_set(struct insn *in, char *text, int line)
+{
+  char *w;
+
+  (void)line;
+  w = cword(&text);
+  if (w == NULL)
+    csyntax(_("(missing var name)"));
+  in->var = intern(w);
+  if (*text) {
+    cnum(&in->a, cword(&text));
+    in->flag = 1;
+  }
+}
+
+/* inc and dec */
+static void c_var(struct insn *in, char *text, int line)
+{
+  char *w;
+
+  (void)line;
+  w = cword(&text);
+  if (w == NULL)
+    csyntax(_("(expected variable)"));
+  in->var = intern(w);
+}
+
+/*
+ * If syntax: if n1 [><=] n2 command.
+ */
+static void c_if(struct insn *in, char *text, int line)
+{
+  char *w;
+
+  if ((w = cword(&text)) == NULL)
+    csyntax("(if)");
+  cnum(&in->a, w);
+  if ((w = cword(&text)) == NULL)
+    csyntax("(if)");
+  if (strcmp(w, "!=") == 0)
+    in->flag = '!';
+  else {
+    if (*w == 0 || w[1] != 0)
+      csyntax("(if)");
+    in->flag = *w;
+  }
+  if ((w = cword(&text)) == NULL)
+    csyntax("(if)");
+  cnum(&in->b, w);
+  if (!*text)
+    csyntax(_("(expected command after if)"));
+  if (strchr("=!><", in->flag) == NULL)
+    csyntax(_("(unknown operator)"));
+
+  in->sub = xmalloc(sizeof(struct insn));
+  compile(in->sub, text, line);
+}
+
+static void c_timeout(struct insn *in, char *text, int line)
+{
+  char *w;
+
+  (void)line;
+  w = cword(&text);
+  if (w == NULL)
+    csyntax(_("(argument expected)"));
+  cmsec(&in->a, w);
+}
+
+static void c_verbose(struct insn *in, char *text, int line)
+{
+  char *w;
+
+  (void)line;
+  if ((w = cword(&text)) != NULL) {
+    if (!strcmp(w, "on")) {
+      in->flag = 1;
+      return;
     }
-    t = thisline->line;
-    w = getword(&t);
-    if (!strcmp(w, "}")) {
-      if (*t)
-        syntaxerr(_("(garbage after })"));
-      seq[f] = NULL;
-      return seq;
+    if (!strcmp(w, "off"))
+      return;
+  }
+  csyntax(_("(unexpected argument)"));
+}
+
+static void c_sleep(struct insn *in, char *text, int line)
+{
+  (void)line;
+  cmsec(&in->a, text);
+}
+
+/* KEYWORDS */
+static const struct kw {
+  const char *command;
+  int op;
+  void (*fn)(struct insn *, char *, int);
+} keywords[] = {
+  { "expect",	OP_EXPECT,	c_expect },
+  { "send",	OP_SEND,	c_send },
+  { "!<",	OP_PIPEDSHELL,	c_raw },
+  { "!",	OP_SHELL,	c_raw },
+  { "goto",	OP_GOTO,	c_goto },
+  { "gosub",	OP_GOSUB,	c_goto },
+  { "return",	OP_RETURN,	NULL },
+  { "exit",	OP_EXIT,	c_exit },
+  { "print",	OP_PRINT,	c_print },
+  { "set",	OP_SET,		c_set },
+  { "inc",	OP_INC,		c_var },
+  { "dec",	OP_DEC,		c_var },
+  { "if",	OP_IF,		c_if },
+  { "timeout",	OP_TIMEOUT,	c_timeout },
+  { "verbose",	OP_VERBOSE,	c_verbose },
+  { "sleep",	OP_SLEEP,	c_sleep },
+  { "break",	OP_BREAK,	NULL },
+  { "call",	OP_CALL,	c_call },
+  { "log",	OP_LOG,		c_log },
+  { NULL,	OP_NOP,		NULL }
+};
+
+/*
+ * Compile the command in text, which is (part of) line.
+ */
+static void compile(struct insn *in, char *text, int line)
+{
+  jmp_buf jb, *oldjmp = cjmp;
+  struct insn *oldin = cin;
+  int oldlineno = clineno;
+  const struct kw *k;
+  char *w;
+
+  memset(in, 0, sizeof(*in));
+  in->lineno = clineno = curenv->lines[line].lineno;
+  cjmp = &jb;
+  cin = in;
+
+  if (setjmp(jb) == 0) {
+    w = cword(&text);
+
+    /* If it is a label or a comment, skip it. */
+    if (w == NULL || *w == '#' || w[strlen(w) - 1] == ':')
+      in->op = OP_NOP;
+    else {
+      /* See which command it is. */
+      for (k = keywords; k->command; k++)
+        if (!strcmp(w, k->command))
+          break;
+      if (k->command == NULL)
+        cerror(_("script \"%s\" line %d: unknown command \"%s\"%s\n"),
+               curenv->scriptname, clineno, w, "\r");
+      in->op = k->op;
+      if (k->fn)
+        k->fn(in, text, line);
     }
-    seq[f] = thisline;
-    thisline = thisline->next;
   }
-  if (f == 16)
-    syntaxerr(_("(too many arguments)"));
-  return seq;
+  cjmp = oldjmp;
+  cin = oldin;
+  clineno = oldlineno;
 }
 
 /*
  * Our "expect" function.
  */
-int expect(char *text)
+static int expect(struct insn *in)
 {
-  char *s, *w;
-  struct line **volatile seq;
-  struct line oneline;
-  struct line *dflseq[2];
-  char *volatile toact = "exit 1";
-  volatile int found = 0;
-  int f, val, c;
-  char *action = NULL;
+  struct insn *action;
+  regmatch_t rm[10];
+  size_t scanned, dropped;
+  long long ms = 120000;
+  int f, c, state, found = 0;
 
   if (inexpect) {
     fprintf(stderr, _("script \"%s\" line %d: nested expect%s\n"),
-            curenv->scriptname, thisline->lineno, "\r");
+            curenv->scriptname, curenv->code[pc].lineno, "\r");
     exit(1);
   }
-  etimeout = 120;
   inexpect = 1;
 
-  s = getword(&text);
-  if (!strcmp(s, "{")) {
-    if (*text)
-      syntaxerr(_("(garbage after {)"));
-    thisline = thisline->next;
-    seq = buildexpect();
-  } else {
-    oneline.line = s;
-    oneline.next = NULL;
-    dflseq[0] = &oneline;
-    dflseq[1] = NULL;
-    seq = dflseq;
-  }
-  /* Seek a timeout command */
-  for (f = 0; seq[f]; f++) {
-    if (!strncmp(seq[f]->line, "timeout", 7)) {
-      c = seq[f]->line[7];
-      if (c == 0 || (c != ' ' && c != '\t'))
-        continue;
-      s = seq[f]->line + 7;
-      /* seq[f] = NULL; */
-      skipspace(&s);
-      w = getword(&s);
-      if (w == NULL)
-        syntaxerr(_("(argument expected)"));
-      val = getnum(w);
-      if (val == 0)
-        syntaxerr(_("(invalid argument)"));
-      etimeout = val;
-      skipspace(&s);
-      if (*s != 0)
-        toact = s;
-      break;
-    }
-  }
-  if (sigsetjmp(ejmp, 1) != 0) {
-    f = s_exec(toact);
-    inexpect = 0;
-    return f;
-  }
+  /* Go on after the block, unless an action jumps elsewhere. */
+  pc = in->target;
+  if (in->flag && (ms = getms(&in->a)) == 0)
+    syntaxerr(_("(invalid argument)"));
+  settimer(T_EXPECT, ms);
 
   /* Alright. Now do the expect. */
   c = OK;
+  state = 0;
+  scanned = 0;
   while (!found) {
-    action = NULL;
-    readchar();
-    for (f = 0; seq[f]; f++) {
-      s = seq[f]->line;
-      w = getword(&s);
-      if (expfound(w)) {
-        action = s;
-        found = 1;
+    if ((f = findmatch(in, &state, &scanned, rm)) < 0) {
+      if (wait_event(1 << T_EXPECT | 1 << T_INPUT) == T_EXPECT) {
+        timers[T_EXPECT] = 0;
+        laststatus = 0;
+        c = run(in->sub);
         break;
       }
+      if ((dropped = readdata()) > scanned) {
+        state = 0;
+        dropped = scanned;
+      }
+      scanned -= dropped;
+      continue;
     }
-    if (action != NULL && *action) {
+    /* $? is the pattern that matched, from 1. */
+    consume(rm);
+    laststatus = f + 1;
+    state = 0;
+    scanned = 0;
+    action = in->pat[f].action;
+    found = 1;
+    if (action != NULL) {
       found = 0;
       /* Maybe BREAK or RETURN */
-      if ((c = s_exec(action)) != OK)
+      if ((c = run(action)) != OK)
         found = 1;
     }
   }
   inexpect = 0;
-  etimeout = 0;
+  timers[T_EXPECT] = 0;
   return c;
 }
 
 /*
  * Jump to a shell and run a command.
  */
-int shell(char *text)
+static int shell(char *text)
 {
-  int status = system(text);
+  int status;
+
+  backstop(1);
+  status = system(text);
+  backstop(0);
   if (WIFEXITED(status))
     laststatus = WEXITSTATUS(status);
   else if (WIFSIGNALED(status))
@@ -645,11 +1484,13 @@ int shell(char *text)
 /*
  * Run a command and send its stdout to stdout ( = modem).
  */
-int pipedshell(char *text)
+static int pipedshell(char *text)
 {
+  backstop(1);
   FILE *fp = popen(text, "r");
   if (fp == NULL) {
     laststatus = errno;
+    backstop(0);
     return OK;
   }
 
@@ -669,6 +1510,7 @@ int pipedshell(char *text)
   }
 
   int status = pclose(fp);
+  backstop(0);
   if (WIFEXITED(status))
     laststatus = WEXITSTATUS(status);
   else if (WIFSIGNALED(status))
@@ -678,11 +1520,35 @@ int pipedshell(char *text)
   return OK;
 }
 
+/*
+ * Write the text of a send or print, with $(0)..$(9) filled in.
+ */
+static void emit(struct insn *in, FILE *fp)
+{
+  const char *s = in->text;
+  int len = in->len;
+
+  if (!in->flag) {
+    fwrite(s, 1, len, fp);
+    return;
+  }
+  for (; len > 0; s++, len--) {
+    if ((unsigned char)*s == CAPTURE && len > 1) {
+      if (capture[s[1] - '0'])
+        fputs(capture[s[1] - '0'], fp);
+      s++;
+      len--;
+    } else
+      fputc(*s, fp);
+  }
+}
+
 /*
  * Send output to stdout ( = modem)
  */
-int dosend(char *text)
+static int dosend(struct insn *in)
 {
+  backstop(1);
 #ifdef HAVE_USLEEP
   /* 200 ms delay. */
   usleep(200000);
@@ -690,77 +1556,69 @@ int dosend(char *text)
 
   /* Before we send anything, flush input buffer. */
   m_flush(0);
-  memset(inbuf, 0, sizeof(inbuf));
-
-  newline = "\r";
-  return output(text, stdout);
-}
-
-/*
- * Exit from the script, possibly with a value.
- */
-int doexit(char *text)
-{
-  char *w;
-  int ret = 0;
+  if (rxfd >= 0) {
+    close(rxfd);
+    rxfd = -1;
+  }
+  wlen = 0;
 
-  w = getword(&text);
-  if (w != NULL)
-    ret = getnum(w);
-  curenv->exstat = ret;
-  longjmp(curenv->ebuf, 1);
-  return 0;
+  emit(in, stdout);
+  fflush(stdout);
+  backstop(0);
+  return OK;
 }
 
 /*
- * Goto a specific label.
+ * Write to the log, with $(0)..$(9) filled in.
  */
-int dogoto(char *text)
+static void dolog(struct insn *in)
 {
-  char *w;
-  struct line *l;
-  char buf[32];
-  int len;
+  char *s, *t, *out;
+  const char *c;
+  size_t len, size;
 
-  w = getword(&text);
-  if (w == NULL || *text)
-    syntaxerr(_("(in goto/gosub label)"));
-  snprintf(buf, sizeof(buf), "%s:", w);
-  len = strlen(buf);
-  for (l = curenv->lines; l; l = l->next)
-    if (!strncmp(l->line, buf, len))
-      break;
-  if (l == NULL) {
-    fprintf(stderr, _("script \"%s\" line %d: label \"%s\" not found%s\n"),
-            curenv->scriptname, thisline->lineno, w, "\r");
-    exit(1);
+  if (!in->flag) {
+    do_log("%s", in->text);
+    return;
   }
-  thisline = l;
-  /* We return break, to automatically break out of expect loops. */
-  return BREAK;
+  size = strlen(in->text) + 1;
+  for (s = in->text; (t = findcapture(s)) != NULL; s = t + 4)
+    if ((c = capture[t[2] - '0']) != NULL)
+      size += strlen(c);
+  out = xmalloc(size);
+  len = 0;
+  for (s = in->text; (t = findcapture(s)) != NULL; s = t + 4) {
+    memcpy(out + len, s, t - s);
+    len += t - s;
+    if ((c = capture[t[2] - '0']) != NULL) {
+      strcpy(out + len, c);
+      len += strlen(c);
+    }
+  }
+  strcpy(out + len, s);
+  do_log("%s", out);
+  free(out);
 }
 
 /*
  * Goto a subroutine.
  */
-int dogosub(char *text)
+static int dogosub(struct insn *in)
 {
-  struct line *oldline;
+  int oldpc = pc;
   int ret = OK;
 
-  oldline = thisline;
-  dogoto(text);
-
+  pc = in->target;
   while (ret != ERR) {
-    if ((thisline = thisline->next) == NULL) {
+    if (++pc >= curenv->nlines) {
       fprintf(stderr, _("script \"%s\": no return from gosub%s\n"),
               curenv->scriptname, "\r");
       exit(1);
     }
-    ret = s_exec(thisline->line);
+    ret = run(&curenv->code[pc]);
     if (ret == RETURN) {
       ret = OK;
-      thisline = oldline;
+      pc = oldpc;
       break;
     }
   }
@@ -768,286 +1626,137 @@ int dogosub(char *text)
 }
 
 /*
- * Return from a subroutine.
- */
-int doreturn(char *text)
-{
-  (void)text;
-  return RETURN;
-}
-
-/*
- * Print text to stderr.
- */
-int print(char *text)
-{
-  newline = "\r\n";
-
-  return output(text, stderr);
-}
-
-/*
- * Declare a variable (integer)
- */
-int doset(char *text)
-{
-  char *w;
-  struct var *v;
-
-  w = getword(&text);
-  if (w == NULL)
-    syntaxerr(_("(missing var name)"));
-  v = getvar(w, 1);
-  if (*text)
-    v->value = getnum(getword(&text));
-  return OK;
-}
-
-/*
- * Lower the value of a variable.
- */
-int dodec(char *text)
-{
-  char *w;
-  struct var *v;
-
-  w = getword(&text);
-  if (w == NULL)
-    syntaxerr(_("(expected variable)"));
-  v = getvar(w, 0);
-  v->value--;
-  return OK;
-}
-
-/*
- * Increase the value of a variable.
- */
-int doinc(char *text)
-{
-  char *w;
-  struct var *v;
-
-  w = getword(&text);
-  if (w == NULL)
-    syntaxerr(_("(expected variable)"));
-  v = getvar(w, 0);
-  v->value++;
-  return OK;
-}
-
-/*
- * If syntax: if n1 [><=] n2 command.
+ * Sleep for a certain number of ms.
  */
-int doif(char *text)
+static int dosleep(long long ms)
 {
-  char *w;
-  int n1;
-  int n2;
-  char op;
-
-  if ((w = getword(&text)) == NULL)
-    syntaxerr("(if)");
-  n1 = getnum(w);
-  if ((w = getword(&text)) == NULL)
-    syntaxerr("(if)");
-  if (strcmp(w, "!=") == 0)
-    op = '!';
-  else {
-    if (*w == 0 || w[1] != 0)
-      syntaxerr("(if)");
-    op = *w;
-  }
-  if ((w = getword(&text)) == NULL)
-    syntaxerr("(if)");
-  n2 = getnum(w);
-  if (!*text)
-    syntaxerr(_("(expected command after if)"));
-
-  if (op == '=') {
-    if (n1 != n2)
-      return OK;
-  } else if (op == '!') {
-    if (n1 == n2)
-      return OK;
-  } else if (op == '>') {
-    if (n1 <= n2)
-      return OK;
-  } else if (op == '<') {
-    if (n1 >= n2)
-      return OK;
-  } else
-    syntaxerr(_("(unknown operator)"));
-
-  return s_exec(text);
-}
-
-/*
- * Set the global timeout-time.
- */
-int dotimeout(char *text)
-{
-  char *w;
-  int val;
-
-  w = getword(&text);
-  if (w == NULL)
-    syntaxerr(_("(argument expected)"));
-  if ((val = getnum(w)) == 0)
-    syntaxerr(_("(invalid argument)"));
-  gtimeout = val;
-  return OK;
-}
-
-/*
- * Turn verbose on/off (= echo stdin to stderr)
- */
-int doverbose(char *text)
-{
-  char *w;
-
-  curenv->verbose = 1;
-
-  if ((w = getword(&text)) != NULL) {
-    if (!strcmp(w, "on"))
-      return OK;
-    if (!strcmp(w, "off")) {
-      curenv->verbose = 0;
-      return OK;
-    }
-  }
-  syntaxerr(_("(unexpected argument)"));
-  return ERR;
-}
-
-/*
- * Sleep for a certain number of seconds.
- */
-int dosleep(char *text)
-{
-  int foo, tm;
-
-  tm = getnum(text);
-  foo = gtimeout - tm;
-
-  /* The alarm goes off every second.. */
-  while (gtimeout != foo)
-    pause();
+  if (ms <= 0)
+    return OK;
+  settimer(T_SLEEP, ms);
+  while (wait_event(1 << T_SLEEP) != T_SLEEP)
+    ;
+  timers[T_SLEEP] = 0;
   return OK;
 }
 
-/*
- * Break out of an expect loop.
- */
-int dobreak(char *dummy)
-{
-  (void)dummy;
-  if (!inexpect) {
-    fprintf(stderr, _("script \"%s\" line %d: break outside of expect%s\n"),
-            curenv->scriptname, thisline->lineno, "\r");
-    exit(1);
-  }
-  return BREAK;
-}
-
 /*
  * Call another script!
  */
-int docall(char *text)
+static int docall(char *text)
 {
-  struct line *oldline;
   struct env *oldenv;
+  int oldpc;
   int er;
 
-  if (*text == 0)
-    syntaxerr(_("(argument expected)"));
-
   if (inexpect) {
     fprintf(stderr, _("script \"%s\" line %d: call inside expect%s\n"),
-            curenv->scriptname, thisline->lineno, "\r");
+            curenv->scriptname, curenv->code[pc].lineno, "\r");
     exit(1);
   }
 
-  oldline = thisline;
+  oldpc = pc;
   oldenv = curenv;
   if ((er = execscript(text)) != 0)
     exit(er);
-  /* freemem(); */
-  thisline = oldline;
+  pc = oldpc;
   curenv = oldenv;
   return 0;
 }
 
-static int do_log_wrapper(char *s)
-{
-  do_log("%s", s);
-  return 0;
-}
-
-/* KEYWORDS */
-struct kw {
-  const char *command;
-  int (*fn)(char *);
-} keywords[] = {
-  { "expect",	expect },
-  { "send",	dosend },
-  { "!<",	pipedshell },
-  { "!",	shell },
-  { "goto",	dogoto },
-  { "gosub",	dogosub },
-  { "return",	doreturn },
-  { "exit",	doexit },
-  { "print",	print },
-  { "set",	doset },
-  { "inc",	doinc },
-  { "dec",	dodec },
-  { "if",	doif },
-  { "timeout",	dotimeout },
-  { "verbose",	doverbose },
-  { "sleep",	dosleep },
-  { "break",	dobreak },
-  { "call",	docall },
-  { "log",	do_log_wrapper },
-  { NULL,	(int(*)(char *))0 }
-};
-
 /*
- * Execute one line.
+ * Execute one command.
  */
-int s_exec(char *text)
+static int run(struct insn *in)
 {
-  char *w;
-  struct kw *k;
-
-  w = getword(&text);
-
-  /* If it is a label or a comment, skip it. */
-  if (w == NULL || *w == '#' || w[strlen(w) - 1] == ':')
-    return OK;
+  long long ms;
+  int n1, n2;
 
-  /* See which command it is. */
-  for (k = keywords; k->command; k++)
-    if (!strcmp(w, k->command))
+  checkglobal(now_ms());
+  switch (in->op) {
+    case OP_NOP:
+      break;
+    case OP_ERROR:
+      fputs(in->text, stderr);
+      exit(1);
+    case OP_EXPECT:
+      return expect(in);
+    case OP_SEND:
+      return dosend(in);
+    case OP_PIPEDSHELL:
+      return pipedshell(in->text);
+    case OP_SHELL:
+      return shell(in->text);
+    case OP_GOTO:
+      pc = in->target;
+      /* We return break, to automatically break out of expect loops. */
+      return BREAK;
+    case OP_GOSUB:
+      return dogosub(in);
+    case OP_RETURN:
+      return RETURN;
+    case OP_EXIT:
+      curenv->exstat = in->flag ? getnum(&in->a) : 0;
+      longjmp(curenv->ebuf, 1);
+    case OP_PRINT:
+      backstop(1);
+      emit(in, stderr);
+      fflush(stderr);
+      backstop(0);
+      break;
+    case OP_SET:
+      in->var->set = 1;
+      if (in->flag)
+        in->var->value = getnum(&in->a);
+      break;
+    case OP_INC:
+      getvar(in->var)->value++;
+      break;
+    case OP_DEC:
+      getvar(in->var)->value--;
+      break;
+    case OP_IF:
+      n1 = getnum(&in->a);
+      n2 = getnum(&in->b);
+      if ((in->flag == '=' && n1 == n2) || (in->flag == '!' && n1 != n2) ||
+          (in->flag == '>' && n1 > n2) || (in->flag == '<' && n1 < n2))
+        return run(in->sub);
+      break;
+    case OP_TIMEOUT:
+      if ((ms = getms(&in->a)) == 0)
+        syntaxerr(_("(invalid argument)"));
+      settimer(T_GLOBAL, ms);
+      break;
+    case OP_VERBOSE:
+      curenv->verbose = in->flag;
+      break;
+    case OP_SLEEP:
+      return dosleep(getms(&in->a));
+    case OP_BREAK:
+      if (!inexpect) {
+        fprintf(stderr, _("script \"%s\" line %d: break outside of expect%s\n"),
+                curenv->scriptname, curenv->code[pc].lineno, "\r");
+        exit(1);
+      }
+      return BREAK;
+    case OP_CALL:
+      return docall(in->text);
+    case OP_LOG:
+      dolog(in);
       break;
-
-  /* Command not found? */
-  if (k->command == NULL) {
-    fprintf(stderr, _("script \"%s\" line %d: unknown command \"%s\"%s\n"),
-            curenv->scriptname, thisline->lineno, w, "\r");
-    exit(1);
   }
-  return (*(k->fn))(text);
+  return OK;
 }
 
 /*
- * Run the script by continuously executing "thisline".
+ * Compile the script, then run it by executing one line after
+ * the other.
  */
 int execscript(const char *s)
 {
   volatile int ret = OK;
+  int f;
 
-  curenv = (struct env *)malloc(sizeof(struct env));
-  curenv->lines = NULL;
-  curenv->vars  = NULL;
+  curenv = (struct env *)calloc(1, sizeof(struct env));
   curenv->verbose = 1;
   curenv->scriptname = s;
 
@@ -1056,15 +1765,18 @@ int execscript(const char *s)
     free(curenv);
     return ERR;
   }
+  findlabels();
+  curenv->code = xmalloc((curenv->nlines + 1) * sizeof(struct insn));
+  for (f = 0; f < curenv->nlines; f++)
+    compile(&curenv->code[f], curenv->lines[f].line, f);
 
-  signal(SIGALRM, myclock);
-  alarm(1);
   if (setjmp(curenv->ebuf) == 0) {
-    thisline = curenv->lines;
-    while (thisline != NULL && (ret = s_exec(thisline->line)) != ERR)
-      thisline = thisline->next;
+    for (pc = 0; pc < curenv->nlines &&
+                 (ret = run(&curenv->code[pc])) != ERR; pc++)
+      ;
   } else
     ret = curenv->exstat ? ERR : 0;
+  freemem();
   free(curenv);
   return ret;
 }
@@ -1082,12 +1794,22 @@ void do_args(int argc, char **argv)
   }
 }
 
+/*
+ * SIGUSR1: reopen the log file, after logrotate moved it.
+ */
+static void logsig(int sig)
+{
+  (void)sig;
+  log_reopen();
+}
+
 int main(int argc, char **argv)
 {
   char *s;
 #if 0 /* Shouldn't need this.. */
   signal(SIGHUP, SIG_IGN);
 #endif
+  signal(SIGUSR1, logsig);
   /* On some Linux systems SIGALRM is masked by default. Unmask it */
   sigset_t ss;
   sigemptyset(&ss);
@@ -1100,11 +1822,11 @@ int main(int argc, char **argv)
   textdomain(PACKAGE);
 
   init_env();
+  /* The global timeout starts now. */
+  settimer(T_GLOBAL, 120000);
 
   do_args(argc, argv);
 
-  memset(inbuf, 0, sizeof(inbuf));
-
   if (argc > 2) {
     strncpy(logfname, argv[2], sizeof(logfname));
     logfname[sizeof(logfname) - 1] = '\0';
@@ -1118,6 +1840,14 @@ int main(int argc, char **argv)
   }
   else
     logfname[0] = 0;
+  /* What minicom had already read from the port when it started us. */
+  if ((s = getenv("MINICOM_RXDATA")) != NULL) {
+    rxfd = atoi(s);
+    unsetenv("MINICOM_RXDATA");
+  }
+  /* minicom passes on its -O log-format. */
+  if ((s = getenv("MINICOM_LOG_FORMAT")) != NULL)
+    log_option("format", s);
 
   return execscript(argv[1]) != OK;
 }
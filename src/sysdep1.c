@@ -370,24 +370,15 @@ void m_hupcl(int fd, int on)
 int m_readchk(int fd)
 {
 #ifdef FIONREAD
-  long i = -1;
-
-  ioctl(fd, FIONREAD, &i);
-  return (int)i;
-#else
-#  if defined(F_GETFL) && defined(O_NDELAY)
-  int i, old;
-  char c;
-
-  old = fcntl(fd, F_GETFL, 0);
-  fcntl(fd, F_SETFL, old | O_NDELAY);
-  i = read(fd, &c, 1);
-  fcntl(fd, F_SETFL, old);
+  int i = -1;
 
+  if (ioctl(fd, FIONREAD, &i) < 0)
+    return -1;
   return i;
-#  else
+#else
+  /* Peeking with a non-blocking read would eat the character. */
+  (void)fd;
   return -1;
-#  endif
 #endif
 }
 
@@ -0,0 +1,248 @@
+/*
+ * txqueue.c	Paced output to the serial port.
+ *
+ *		Entry points:
+ *
+ *		tx_write(s, len) - queue data for the port
+ *		tx_hold(on)      - collect output, write it when turned off
+ *		tx_drain()       - write out everything now (blocking)
+ *		tx_discard()     - throw away what is queued
+ *
+ *		With a character or newline delay configured, the queue
+ *		is sent out from a reactor timer, one character (or up
+ *		to the next CR when there is only a newline delay) at a
+ *		time, so the main loop keeps reading and displaying data
+ *		while a paste trickles out. Without delays output is
+ *		written at once, or with tx_hold() in a single writev().
+ *
+ *		This file is part of the minicom communications package,
+ *		Copyright 1991-1995 Miquel van Smoorenburg.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <config.h>
+
+#include <sys/uio.h>
+
+#include "port.h"
+#include "minicom.h"
+
+/* Must be a power of two. */
+#define TXQ_SIZE	65536
+
+static char txq[TXQ_SIZE];
+static size_t txq_head, txq_tail;	/* Free running, see rxthread.c */
+static int tx_timer = -1;
+static int tx_busy;			/* Timer is pacing the queue */
+static int tx_holding;
+
+#define TXQ_LEN		(txq_head - txq_tail)
+
+static int paced(void)
+{
+  return vt_ch_delay > 0 || vt_nl_delay > 0;
+}
+
+/* Delay in ms after sending character c. */
+static long delay_after(char c)
+{
+  long ms = vt_ch_delay > 0 ? vt_ch_delay : 0;
+
+  if (c == '\r' && vt_nl_delay > 0)
+    ms += vt_nl_delay;
+  return ms;
+}
+
+/*
+ * Write up to len queued bytes to the port. Returns the number of bytes
+ * taken from the queue; on a write error the whole queue is dropped.
+ */
+static size_t send_queued(size_t len)
+{
+  struct iovec iov[2];
+  size_t off, done = 0;
+  ssize_t r;
+  int n;
+
+  if (len > TXQ_LEN)
+    len = TXQ_LEN;
+
+  while (done < len) {
+    off = (txq_tail + done) & (TXQ_SIZE - 1);
+    iov[0].iov_base = txq + off;
+    iov[0].iov_len = len - done;
+    n = 1;
+    if (off + iov[0].iov_len > TXQ_SIZE) {
+      iov[0].iov_len = TXQ_SIZE - off;
+      iov[1].iov_base = txq;
+      iov[1].iov_len = len - done - iov[0].iov_len;
+      n = 2;
+    }
+    r = writev(portfd, iov, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      txq_tail = txq_head;
+      return len;
+    }
+    done += r;
+  }
+  txq_tail += done;
+  return done;
+}
+
+/*
+ * Send the next piece of the queue: one character, or everything up to
+ * and including the next CR when there is only a newline delay.
+ * Returns the delay to wait before the next piece.
+ */
+static long send_next(void)
+{
+  size_t len = 1;
+  char last;
+
+  if (vt_ch_delay <= 0) {
+    while (len < TXQ_LEN && txq[(txq_tail + len - 1) & (TXQ_SIZE - 1)] != '\r')
+      len++;
+  }
+  last = txq[(txq_tail + len - 1) & (TXQ_SIZE - 1)];
+  send_queued(len);
+  return delay_after(last);
+}
+
+static int tx_tick(int fd, void *arg)
+{
+  long ms = 0;
+
+  (void)fd;
+  (void)arg;
+  /* The delays may have been turned off in the meantime. */
+  if (!paced())
+    send_queued(TXQ_LEN);
+  else if (TXQ_LEN)
+    ms = send_next();
+  /* A piece without delay after it was the end of the queue. */
+  tx_busy = ms > 0;
+  if (tx_busy)
+    reactor_timer_set(tx_timer, ms, 0);
+  return 0;
+}
+
+/* Start sending the queue out, paced by the timer. */
+static void tx_kick(void)
+{
+  if (tx_busy || TXQ_LEN == 0)
+    return;
+  if (tx_timer < 0)
+    tx_timer = reactor_timer_new(0, tx_tick, NULL);
+  if (tx_timer < 0) {
+    tx_drain();
+    return;
+  }
+  tx_tick(-1, NULL);
+}
+
+/*
+ * Queue len bytes for the port.
+ */
+void tx_write(const char *s, int len)
+{
+  size_t off, n;
+  ssize_t r;
+
+  record_data(REC_OUT, s, len);
+
+  /* Nothing to wait for: write straight away, as before. */
+  if (!paced() && !tx_holding && TXQ_LEN == 0) {
+    while (len > 0) {
+      if ((r = write(portfd, s, len)) < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        break;
+      s += r;
+      len -= r;
+    }
+    return;
+  }
+
+  while (len > 0) {
+    /* Full: make room the old fashioned way. */
+    if (TXQ_LEN == TXQ_SIZE) {
+      if (paced())
+        usleep(1000 * send_next());
+      else
+        send_queued(TXQ_LEN);
+    }
+    off = txq_head & (TXQ_SIZE - 1);
+    n = TXQ_SIZE - off;
+    if (n > TXQ_SIZE - TXQ_LEN)
+      n = TXQ_SIZE - TXQ_LEN;
+    if (n > (size_t)len)
+      n = len;
+    memcpy(txq + off, s, n);
+    txq_head += n;
+    s += n;
+    len -= n;
+  }
+
+  if (paced())
+    tx_kick();
+  else if (!tx_holding && !tx_busy)
+    send_queued(TXQ_LEN);
+}
+
+/*
+ * While on, output is collected; turning it off writes it all in one
+ * go (or starts pacing it out).
+ */
+void tx_hold(int on)
+{
+  tx_holding = on;
+  if (on || tx_busy)
+    return;
+  if (paced())
+    tx_kick();
+  else if (TXQ_LEN)
+    send_queued(TXQ_LEN);
+}
+
+/*
+ * Write out everything that is queued, keeping to the delays. Used
+ * before the port is given to another program.
+ */
+void tx_drain(void)
+{
+  long ms;
+
+  if (tx_busy) {
+    reactor_timer_set(tx_timer, 0, 0);
+    tx_busy = 0;
+  }
+  while (TXQ_LEN) {
+    if (!paced()) {
+      send_queued(TXQ_LEN);
+      break;
+    }
+    ms = send_next();
+    if (ms > 0 && TXQ_LEN)
+      usleep(1000 * ms);
+  }
+}
+
+/*
+ * Throw away queued output, e.g. because the port is gone.
+ */
+void tx_discard(void)
+{
+  if (tx_busy) {
+    reactor_timer_set(tx_timer, 0, 0);
+    tx_busy = 0;
+  }
+  txq_tail = txq_head;
+}
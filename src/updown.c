@@ -306,6 +306,10 @@ void updown(int what, int nr)
   } else
     mc_wleave();
 
+  /* The program gets the port to itself. */
+  tx_drain();
+  rx_stop();
+  rx_flush();
   m_flush(portfd);
 
   lockfile_remove();
@@ -419,6 +423,7 @@ void updown(int what, int nr)
   /* because a BBS often displays menu text right after a download, and we */
   /* don't want the modem buffer to be lost while waiting for key to be hit */
   m_flush(portfd);
+  rx_flush();
   port_init();
   setcbreak(2); /* Raw, no echo. */
   if (win)
@@ -524,6 +529,12 @@ void kermit(void)
     return;
   }
 
+  /* Kermit can't be given what the reader thread already read, so
+   * show it before kermit takes over the screen. */
+  tx_drain();
+  rx_stop();
+  port_catchup();
+
   /* Clear screen, set keyboard modes etc. */
   mc_wleave();
 
@@ -626,6 +637,33 @@ int mc_setenv(const char *name, const char *value)
  * ask = 1 if first ask for confirmation.
  * s = scriptname, l=loginname, p=password.
  */
+/*
+ * Put what the reader thread read and nobody took yet in a temporary
+ * file, and return its fd at the start, or -1 if there is nothing.
+ */
+static int rx_tofile(void)
+{
+  char buf[4096];
+  FILE *fp = NULL;
+  int n, fd;
+
+  while ((n = rx_read(buf, sizeof(buf))) > 0) {
+    if (fp == NULL && (fp = tmpfile()) == NULL)
+      return -1;
+    /* Received while still ours, so it is in the recording. */
+    record_data(REC_IN, buf, n);
+    fwrite(buf, 1, n, fp);
+  }
+  if (fp == NULL)
+    return -1;
+  fflush(fp);
+  fd = dup(fileno(fp));
+  fclose(fp);
+  if (fd >= 0)
+    lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
 void runscript(int ask, const char *s, const char *l, const char *p)
 {
   int status;
@@ -634,11 +672,13 @@ void runscript(int ask, const char *s, const char *l, const char *p)
   char buf[81];
   char scr_lines[7];
   char cmdline[160];
+  char rxfdname[16];
   struct pollfd fds[2];
   char *translated_cmdline;
   char *ptr;
   WIN *w;
   int done = 0;
+  int rxfd;
   char *msg = _("Same as last");
   char *username = _(" A -   Username        :"),
        *password = _(" B -   Password        :"),
@@ -719,6 +759,13 @@ void runscript(int ask, const char *s, const char *l, const char *p)
   if (mcd(P_SCRIPTDIR) < 0)
     return;
 
+  /* runscript uses the port itself. What the reader thread already
+   * read, e.g. a login prompt, would have waited for it in the kernel
+   * buffer: runscript reads it from $MINICOM_RXDATA before the port. */
+  tx_drain();
+  rx_stop();
+  rxfd = rx_tofile();
+
   snprintf(cmdline, sizeof(cmdline), "%s %s %s %s",
            P_SCRIPTPROG, scr_name, logfname, logfname[0]==0? "": homedir);
 
@@ -727,6 +774,8 @@ void runscript(int ask, const char *s, const char *l, const char *p)
       werror(_("Out of memory: could not fork()"));
       close(pipefd[0]);
       close(pipefd[1]);
+      if (rxfd >= 0)
+        close(rxfd);
       mcd("");
       return;
     case 0: /* Child */
@@ -735,6 +784,10 @@ void runscript(int ask, const char *s, const char *l, const char *p)
       dup2(pipefd[1], 2);
       close(pipefd[0]);
       close(pipefd[1]);
+      if (rxfd >= 0) {
+        snprintf(rxfdname, sizeof(rxfdname), "%d", rxfd);
+        mc_setenv("MINICOM_RXDATA", rxfdname);
+      }
 
       for (n = 1; n < _NSIG; n++)
 	signal(n, SIG_DFL);
@@ -756,6 +809,8 @@ void runscript(int ask, const char *s, const char *l, const char *p)
   enab_sig(1, 0);	       /* But enable SIGINT */
   signal(SIGINT, udcatch);
   close(pipefd[1]);
+  if (rxfd >= 0)
+    close(rxfd);
 
   /* pipe output from "runscript" program to terminal emulator */
   fds[0].fd     = pipefd[0]; /* runscript */
@@ -26,6 +26,7 @@
 #include <config.h>
 #include <time.h>
 #include <stdint.h>
+#include <limits.h>
 #include "port.h"
 #include "minicom.h"
 #include "vt100.h"
@@ -142,16 +143,19 @@ static int vt_keypad;		/* Keypad mode. */
 static int vt_cursor;		/* cursor key mode. */
 static int vt_asis;		/* 8bit clean mode. */
 static int vt_line_timestamp;	/* Timestamp each line. */
+static int vt_stamped;		/* vt_mono and vt_real are set */
+static struct timespec vt_mono, vt_real; /* When the data came in */
 static int vt_bs = 8;		/* Code that backspace key sends. */
 static int vt_insert;           /* Insert mode */
 static int vt_crlf;		/* Return sends CR/LF */
 static int vt_om;		/* Origin mode. */
 WIN *vt_win;                    /* Output window. */
 static int vt_docap;		/* Capture on/off. */
+static unsigned char last_ch;	/* Last character received. */
 static void (*vt_keyb)(int, int);/* Gets called for NORMAL/APPL switch. */
 static void (*termout)(const char *, int);/* Gets called to output a string. */
 
-static int escparms[8];		/* Accumulated escape sequence. */
+static int escparms[16];	/* Accumulated escape sequence. */
 static int ptr;                 /* Index into escparms array. */
 static unsigned vt_tabs[5];	/* Tab stops for max. 32*5 = 160 columns. */
 
@@ -159,7 +163,8 @@ static short newy1 = 0;		/* Current size of scrolling region. */
 static short newy2 = 23;
 
 /* Saved color and positions */
-static short savex, savey, saveattr = XA_NORMAL, savecol = 112;
+static short savex, savey, saveattr = XA_NORMAL;
+static unsigned short savecol = 112;
 
 static short savecharset;
 static char *savetrans[2];
@@ -410,6 +415,7 @@ static void ansi_mode(int on_off)
 static void state2(int c)
 {
   short x, y, attr, f;
+  int col, n;
   char temp[32];
 
   /* See if a number follows */
@@ -583,6 +589,30 @@ static void state2(int c)
           mc_wsetfgcol(vt_win, escparms[f] - 30);
         if (escparms[f] >= 40 && escparms[f] <= 47)
           mc_wsetbgcol(vt_win, escparms[f] - 40);
+        if (escparms[f] >= 90 && escparms[f] <= 97)
+          mc_wsetfgcol(vt_win, escparms[f] - 90 + 8);
+        if (escparms[f] >= 100 && escparms[f] <= 107)
+          mc_wsetbgcol(vt_win, escparms[f] - 100 + 8);
+        /* 38;5;n and 38;2;r;g;b, and the same with 48 */
+        if ((escparms[f] == 38 || escparms[f] == 48) && f < ptr) {
+          col = -1;
+          if (escparms[f + 1] == 5 && f + 2 <= ptr) {
+            col = escparms[f + 2] & 255;
+            n = 2;
+          } else if (escparms[f + 1] == 2 && f + 4 <= ptr) {
+            col = COL_RGB(escparms[f + 2] & 255, escparms[f + 3] & 255,
+                          escparms[f + 4] & 255);
+            n = 4;
+          }
+          if (col >= 0) {
+            if (escparms[f] == 38)
+              mc_wsetfgcol(vt_win, col);
+            else
+              mc_wsetbgcol(vt_win, col);
+            f += n;
+            continue;
+          }
+        }
         switch (escparms[f]) {
           case 0:
             attr = XA_NORMAL;
@@ -931,19 +961,110 @@ static void output_s(const char *s)
 {
   mc_wputs(vt_win, s);
   if (vt_docap == 1)
-    fputs(s, capfp);
+    cap_write(s, strlen(s));
 }
 
 static void output_c(const char c)
 {
   mc_wputc(vt_win, c);
   if (vt_docap == 1)
-    fputc(c, capfp);
+    cap_putc(c);
+}
+
+/*
+ * Data from the port came in at t (see rx_show()), or NULL: use the
+ * current time.
+ */
+void vt_settime(const struct rxtime *t)
+{
+  vt_stamped = t != NULL;
+  if (t) {
+    vt_mono = t->mono;
+    vt_real = t->real;
+  }
+}
+
+/*
+ * Put the timestamp in front of a new line.
+ */
+static void line_stamp(void)
+{
+  static struct timespec last_real, last_mono;
+  static time_t prefix_sec = -1;
+  static char prefix[24];	/* "[date time" of prefix_sec */
+  struct timespec real, mono;
+  struct tm tm;
+  char s[36];
+
+  if (vt_stamped) {
+    real = vt_real;
+    mono = vt_mono;
+  } else {
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+  }
+
+  if (vt_line_timestamp == TIMESTAMP_LINE_DELTA)
+    {
+      if (last_mono.tv_sec)
+        {
+          long long d;
+          d =   (mono.tv_sec - last_mono.tv_sec) * 1000000000LL
+              + mono.tv_nsec - last_mono.tv_nsec;
+          if (d < 0) /* Typed, before data that was waiting */
+            d = 0;
+          snprintf(s, sizeof(s), "[%lld.%03lld] ",
+                   d / 1000000000, (d % 1000000000) / 1000000);
+          output_s(s);
+        }
+      last_mono = mono;
+      last_real = real;
+      return;
+    }
+  if (   vt_line_timestamp == TIMESTAMP_LINE_PER_SECOND
+      && real.tv_sec == last_real.tv_sec)
+    return;
+
+  /* Only the fraction changes within a second. */
+  if (real.tv_sec != prefix_sec)
+    {
+      if (   !localtime_r(&real.tv_sec, &tm)
+          || !strftime(prefix, sizeof(prefix), "[%F %T", &tm))
+        prefix[0] = 0;
+      prefix_sec = real.tv_sec;
+    }
+
+  if (last_real.tv_sec && prefix[0])
+    {
+      output_s(prefix);
+      switch (vt_line_timestamp)
+        {
+        case TIMESTAMP_LINE_SIMPLE:
+          output_s("] ");
+          break;
+        case TIMESTAMP_LINE_EXTENDED:
+          snprintf(s, sizeof(s), ".%03ld] ", real.tv_nsec / 1000000);
+          output_s(s);
+          break;
+        case TIMESTAMP_LINE_USEC:
+          snprintf(s, sizeof(s), ".%06ld] ", real.tv_nsec / 1000);
+          output_s(s);
+          break;
+        case TIMESTAMP_LINE_NSEC:
+          snprintf(s, sizeof(s), ".%09ld] ", real.tv_nsec);
+          output_s(s);
+          break;
+        case TIMESTAMP_LINE_PER_SECOND:
+          output_s("\r\n");
+          break;
+        }
+    }
+  last_real = real;
+  last_mono = mono;
 }
 
 void vt_out(int ch, wchar_t wc)
 {
-  static unsigned char last_ch;
   int f;
   unsigned char c;
   int go_on = 0;
@@ -953,61 +1074,13 @@ void vt_out(int ch, wchar_t wc)
 
   if (last_ch == '\n'
       && vt_line_timestamp != TIMESTAMP_LINE_OFF)
-    {
-      struct timeval tmstmp_now;
-      static struct timeval tmstmp_last;
-      char s[36];
-      struct tm tmstmp_tm;
-
-      gettimeofday(&tmstmp_now, NULL);
-      if ((   vt_line_timestamp == TIMESTAMP_LINE_PER_SECOND
-           && tmstmp_now.tv_sec != tmstmp_last.tv_sec)
-          || vt_line_timestamp == TIMESTAMP_LINE_SIMPLE
-          || vt_line_timestamp == TIMESTAMP_LINE_EXTENDED)
-        {
-          if (   tmstmp_last.tv_sec
-              && localtime_r(&tmstmp_now.tv_sec, &tmstmp_tm)
-              && strftime(s, sizeof(s), "[%F %T", &tmstmp_tm))
-            {
-              output_s(s);
-              switch (vt_line_timestamp)
-                {
-                case TIMESTAMP_LINE_SIMPLE:
-                  output_s("] ");
-                  break;
-                case TIMESTAMP_LINE_EXTENDED:
-                  snprintf(s, sizeof(s), ".%03ld] ",
-		           (unsigned long)tmstmp_now.tv_usec / 1000);
-                  output_s(s);
-                  break;
-                case TIMESTAMP_LINE_PER_SECOND:
-                  output_s("\r\n");
-                  break;
-                };
-            }
-          tmstmp_last = tmstmp_now;
-        }
-      else if (vt_line_timestamp == TIMESTAMP_LINE_DELTA)
-        {
-          if (tmstmp_last.tv_sec)
-            {
-              unsigned long long d;
-              d =   (tmstmp_now.tv_sec * 1000000 + tmstmp_now.tv_usec)
-                  - (tmstmp_last.tv_sec * 1000000 + tmstmp_last.tv_usec);
-              snprintf(s, sizeof(s), "[%lld.%03lld] ",
-                       d / 1000000, (d % 1000000) / 1000);
-              s[sizeof(s) - 1] = 0;
-              output_s(s);
-            }
-          tmstmp_last = tmstmp_now;
-        }
-    }
+    line_stamp();
 
   c = (unsigned char)ch;
   last_ch = c;
 
   if (vt_docap == 2) /* Literal. */
-    fputc(c, capfp);
+    cap_putc(c);
 
   /* Process <31 chars first, even in an escape sequence. */
   switch (c) {
@@ -1032,7 +1105,7 @@ void vt_out(int ch, wchar_t wc)
         f = vt_win->xs - 1;
       mc_wlocate(vt_win, f, vt_win->cury);
       if (vt_docap == 1)
-        fputc(c, capfp);
+        cap_putc(c);
       break;
     case 013: /* Old Minix: CTRL-K = up */
       mc_wlocate(vt_win, vt_win->curx, vt_win->cury - 1);
@@ -1082,7 +1155,7 @@ void vt_out(int ch, wchar_t wc)
   switch (esc_s) {
     case 0: /* Normal character */
       if (vt_docap == 1)
-        fputc(P_CONVCAP[0] == 'Y' ? vt_inmap[c] : c, capfp);
+        cap_putc(P_CONVCAP[0] == 'Y' ? vt_inmap[c] : c);
       if (!using_iconv()) {
         c = vt_inmap[c];    /* conversion 04.09.97 / jl */
         if (vt_type == VT100 && vt_trans[vt_charset] && vt_asis == 0)
@@ -1122,6 +1195,221 @@ void vt_out(int ch, wchar_t wc)
   }
 }
 
+/*
+ * Length of the run of plain printable ASCII characters (0x20 - 0x7e)
+ * at the start of s. Looks at a word at a time, see
+ * "Determine if a word has a byte less than / greater than n" in
+ * Sean Eron Anderson's Bit Twiddling Hacks.
+ */
+static size_t plain_run(const char *s, size_t len)
+{
+  const uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  size_t n = 0;
+  uint64_t w;
+
+  for (; n + 8 <= len; n += 8) {
+    memcpy(&w, s + n, 8);
+    /* Any byte < 0x20, > 0x7e or with the high bit set? */
+    if ((((w - ones * 0x20) & ~w) | ((w + ones * (127 - 0x7e)) | w)) & highs)
+      break;
+  }
+  while (n < len && s[n] >= 0x20 && s[n] < 0x7f)
+    n++;
+  return n;
+}
+
+/* Does the conversion table leave plain characters alone? */
+static int plain_inmap(void)
+{
+  int c;
+
+  for (c = 0x20; c < 0x7f; c++)
+    if (vt_inmap[c] != c)
+      return 0;
+  return 1;
+}
+
+/*
+ * Can plain printable characters bypass vt_out()? Not if they would be
+ * translated, or inserted. This can change with every escape sequence.
+ */
+static int plain_ok(void)
+{
+  if (esc_s != 0 || vt_insert)
+    return 0;
+  if (!using_iconv() && vt_type == VT100 && vt_trans[vt_charset] && vt_asis == 0)
+    return 0;
+  return last_ch != '\n' || vt_line_timestamp == TIMESTAMP_LINE_OFF;
+}
+
+/*
+ * Multibyte decoder for vt_out_buf(). It is fed a byte at a time and
+ * keeps its state between calls, so a character that is split over
+ * two reads comes out whole. Bytes that don't form a valid character
+ * are passed on one by one, the way one_mbtowc() does.
+ */
+#define MB_UTF8		1	/* UTF-8 locale: decoded here */
+#define MB_SINGLE	2	/* Single byte locale: table lookup */
+#define MB_OTHER	3	/* Anything else: mbrtowc() */
+
+static int mb_kind;
+static unsigned char mb_pend[MB_LEN_MAX];	/* Unfinished character */
+static int mb_npend;
+static int mb_need;		/* UTF-8 continuation bytes to come */
+static wchar_t mb_wc;		/* UTF-8 code point so far */
+static mbstate_t mb_state;
+static wchar_t mb_table[256];
+
+static void mb_init(void)
+{
+  wchar_t wc;
+  wint_t w;
+  int c;
+
+  if (MB_CUR_MAX == 1) {
+    for (c = 0; c < 256; c++) {
+      w = btowc(c);
+      mb_table[c] = w == WEOF ? (wchar_t)(char)c : (wchar_t)w;
+    }
+    mb_kind = MB_SINGLE;
+  } else if (mbtowc(&wc, "\342\202\254", 3) == 3 && wc == 0x20ac)
+    mb_kind = MB_UTF8;
+  else
+    mb_kind = MB_OTHER;
+  mbtowc(NULL, NULL, 0);
+}
+
+/* Pass on the bytes of an invalid character as they are. */
+static void mb_flush_raw(void)
+{
+  int i;
+
+  for (i = 0; i < mb_npend; i++)
+    vt_out(mb_pend[i], (wchar_t)(char)mb_pend[i]);
+  mb_npend = 0;
+}
+
+static void utf8_byte(unsigned char b)
+{
+  static const wchar_t min[] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+  if (mb_npend) {
+    if ((b & 0xc0) == 0x80) {
+      mb_pend[mb_npend++] = b;
+      mb_wc = (mb_wc << 6) | (b & 0x3f);
+      if (--mb_need)
+        return;
+      /* Overlong, surrogate or out of range? */
+      if (mb_wc < min[mb_npend] || mb_wc > 0x10ffff
+          || (mb_wc >= 0xd800 && mb_wc < 0xe000))
+        mb_flush_raw();
+      else {
+        mb_npend = 0;
+        vt_out(mb_pend[0], mb_wc);
+      }
+      return;
+    }
+    mb_flush_raw();
+  }
+
+  if (b < 0x80)
+    vt_out(b, b);
+  else if (b >= 0xc2 && b <= 0xf4) {
+    mb_need = b >= 0xf0 ? 3 : b >= 0xe0 ? 2 : 1;
+    mb_wc = b & (0x3f >> mb_need);
+    mb_pend[0] = b;
+    mb_npend = 1;
+  } else
+    vt_out(b, (wchar_t)(char)b);
+}
+
+/*
+ * Received data is in a single byte charset other than the local one:
+ * byte b is shown as character wc[b], and handled by vt_out() as if it
+ * were first[b] (the first byte of wc[b] in the local charset).
+ * NULL turns this off again.
+ */
+static const unsigned char *rc_first;
+static const wchar_t *rc_wc;
+static int rc_plain;		/* Leaves printable ASCII alone */
+
+void vt_remote_charset(const unsigned char *first, const wchar_t *wc)
+{
+  int c;
+
+  rc_first = first;
+  rc_wc = wc;
+  rc_plain = 1;
+  if (wc)
+    for (c = 0x20; c < 0x7f; c++)
+      if (first[c] != c || wc[c] != c)
+        rc_plain = 0;
+}
+
+static void mb_byte(unsigned char b)
+{
+  wchar_t wc;
+  size_t r;
+
+  if (rc_wc) {
+    vt_out(rc_first[b], rc_wc[b]);
+    return;
+  }
+
+  switch (mb_kind) {
+    case MB_UTF8:
+      utf8_byte(b);
+      break;
+    case MB_SINGLE:
+      vt_out(b, mb_table[b]);
+      break;
+    default:
+      r = mbrtowc(&wc, (char *)&b, 1, &mb_state);
+      if (r == (size_t)-2 && mb_npend < MB_LEN_MAX - 1) {
+        mb_pend[mb_npend++] = b;
+        break;
+      }
+      if (r == (size_t)-1 || r == (size_t)-2) {
+        memset(&mb_state, 0, sizeof(mb_state));
+        mb_pend[mb_npend++] = b;
+        mb_flush_raw();
+        break;
+      }
+      vt_out(mb_npend ? mb_pend[0] : b, wc);
+      mb_npend = 0;
+      break;
+  }
+}
+
+/*
+ * Output a buffer of received data. Runs of plain printable characters
+ * go to the window and the capture file in one go, everything else is
+ * decoded and handed to vt_out() one character at a time.
+ */
+void vt_out_buf(const char *s, size_t len)
+{
+  const char *end = s + len;
+  int inmap = plain_inmap() && (rc_wc == NULL || rc_plain);
+  size_t n;
+
+  if (!mb_kind)
+    mb_init();
+
+  while (s < end) {
+    if (mb_npend == 0 && inmap && plain_ok()
+        && (n = plain_run(s, end - s)) > 0) {
+      if (vt_docap)
+        cap_write(s, n);
+      mc_wputrun(vt_win, s, n);
+      last_ch = s[n - 1];
+      s += n;
+      continue;
+    }
+    mb_byte(*s++);
+  }
+}
+
 /* Translate keycode to escape sequence. */
 void vt_send(int c)
 {
@@ -1142,9 +1430,8 @@ void vt_send(int c)
       s[2] = 0;
       len = 2;
     }
+    /* vt_nl_delay is applied by the output queue. */
     v_termout(s, len);
-    if (vt_nl_delay > 0 && c == '\r')
-      usleep(1000 * vt_nl_delay);
     return;
   }
 
@@ -37,6 +37,10 @@ void vt_init(int, int, int, int, int, int);
 void vt_pinit(WIN *, int, int);
 void vt_set(int, int, int, int, int, int, int, int, int);
 void vt_out(int, wchar_t);
+void vt_out_buf(const char *, size_t);
+struct rxtime;
+void vt_settime(const struct rxtime *);
+void vt_remote_charset(const unsigned char *, const wchar_t *);
 void vt_send(int ch);
 
 #endif /* ! __MINICOM__SRC__VT100_H__ */
@@ -52,7 +52,13 @@
 #include "config.h"
 #endif
 
-#define BUFFERSIZE 2048
+/* Large enough to hold a whole frame at high line speeds */
+#define BUFFERSIZE 16384
+
+/* DEC private mode 2026: synchronized update */
+#define SYNC_BEGIN	"\033[?2026h"
+#define SYNC_END	"\033[?2026l"
+#define SYNC_LEN	8
 
 #define swap(x, y) { int d = (x); (x) = (y); (y) = d; }
 
@@ -84,21 +90,38 @@ static unsigned char S_LL;
 static unsigned char S_VER;
 static unsigned char S_LR;
 
-static char _bufstart[BUFFERSIZE];
+/* Room is left on both sides for the synchronized update sequences. */
+static char _outbuf[SYNC_LEN + BUFFERSIZE + SYNC_LEN];
+#define _bufstart (_outbuf + SYNC_LEN)
 static char *_bufpos = _bufstart;
-static char *_buffend;
+static char *_buffend = _bufstart + BUFFERSIZE;
 static ELM *gmap;
+static ELM *smap;	/* What the terminal shows, see _write() */
+static char *swide;	/* Lines with wide characters on them */
+
+/* curcolor when the terminal's colors are not known */
+#define COL_UNKNOWN	0xffff
 
 static char curattr = -1;
-static char curcolor = -1;
+static unsigned short curcolor = COL_UNKNOWN;
 static int curx = -1;
 static int cury = -1;
 static int _intern = 0;
 static int _curstype = CNORMAL;
 static int _has_am = 0;
+static int _has_bce = 0;
 static int _mv_standout = 0;
 static ELM oldc;
 static int sflag = 0;
+static int owe_x = -1, owe_y;	/* Cursor position owed, see _write() */
+
+/* Frame pacing, see mc_wframe() */
+static long frame_ms;		/* 0 = flush at once */
+static int frame_sync;		/* Wrap output in SYNC_BEGIN/SYNC_END */
+static int frame_timer = -1;
+static int frame_pending;
+static int sync_open;		/* SYNC_BEGIN sent, SYNC_END not yet */
+static long long last_flush;
 
 int useattr = 1;
 int dirflush = 1;
@@ -138,15 +161,67 @@ int debug(char *s, ...)
 
 /* ===== Low level routines ===== */
 
+static void _gotoxy(int x, int y);
+static void _scrflush(void);
+
 /*
- * Flush the screen buffer
+ * Lines scr_top to scr_bot have been scrolled up scr_n times in gmap,
+ * but not yet on the terminal, see mc_wscroll().
  */
-void mc_wflush(void)
+static int scr_n, scr_top, scr_bot;
+static char scr_attr;
+static unsigned short scr_color;
+
+#define SCR_PENDING(y)	(scr_n && (y) >= scr_top && (y) <= scr_bot)
+
+static long long mono_ms(void)
 {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Write out the screen buffer. With end == 0 the buffer is just full,
+ * possibly in the middle of an escape sequence, and a synchronized
+ * update is left open until the real flush.
+ */
+static void _wflush(int end)
+{
+  char *start = _bufstart;
   int todo, done;
 
-  todo = _bufpos - _bufstart;
-  _bufpos = _bufstart;
+  if (end) {
+    if (scr_n)
+      _scrflush();
+    if (frame_pending) {
+      frame_pending = 0;
+      reactor_timer_set(frame_timer, 0, 0);
+    }
+    if (owe_x >= 0)
+      _gotoxy(owe_x, owe_y);
+  }
+  if (_bufpos == _bufstart && !(end && sync_open))
+    return;
+
+  /* Have the terminal show the whole update at once. */
+  if (frame_sync || sync_open) {
+    if (!sync_open) {
+      start -= SYNC_LEN;
+      memcpy(start, SYNC_BEGIN, SYNC_LEN);
+    }
+    sync_open = !end;
+    if (end) {
+      memcpy(_bufpos, SYNC_END, SYNC_LEN);
+      _bufpos += SYNC_LEN;
+    }
+  }
+  if (frame_ms && end)
+    last_flush = mono_ms();
+
+  todo = _bufpos - start;
+  _bufpos = start;
 
   while (todo > 0) {
     done = write(1, _bufpos, todo);
@@ -160,17 +235,96 @@ void mc_wflush(void)
   _bufpos = _bufstart;
 }
 
+/*
+ * Flush the screen buffer
+ */
+void mc_wflush(void)
+{
+  _wflush(1);
+}
+
+static int frame_done(int fd, void *arg)
+{
+  (void)fd;
+  (void)arg;
+  mc_wflush();
+  return 0;
+}
+
+/*
+ * Flush the screen buffer at the next frame, so that everything written
+ * in between goes out in one go. If the previous flush was longer than
+ * a frame ago it is done right away, so a lone line of output is not
+ * held back.
+ */
+void mc_wframe(void)
+{
+  long long now;
+
+  if (frame_pending)
+    return;
+
+  if (frame_ms) {
+    now = mono_ms();
+    if (now - last_flush < frame_ms) {
+      if (frame_timer < 0)
+        frame_timer = reactor_timer_new(0, frame_done, NULL);
+      if (frame_timer >= 0) {
+        frame_pending = 1;
+        reactor_timer_set(frame_timer, frame_ms - (now - last_flush), 0);
+        return;
+      }
+    }
+  }
+  mc_wflush();
+}
+
+/*
+ * Set the frame rate used by mc_wframe() (0 = no pacing), and whether
+ * updates are wrapped in synchronized update sequences.
+ */
+void mc_wsetframe(int hz, int sync)
+{
+  mc_wflush();
+  frame_ms = hz > 0 ? 1000 / (hz > 1000 ? 1000 : hz) : 0;
+  frame_sync = sync;
+}
+
 /*
  * Output a raw character to the screen
  */
 static int outchar(int c)
 {
+  if (scr_n)
+    _scrflush();
   *_bufpos++ = c;
   if (_bufpos >= _buffend)
-    mc_wflush();
+    _wflush(0);
   return 0;
 }
 
+/*
+ * Output len raw characters to the screen.
+ */
+static void outbuf(const char *s, int len)
+{
+  int n;
+
+  if (scr_n)
+    _scrflush();
+  while (len > 0) {
+    n = _buffend - _bufpos;
+    if (n > len)
+      n = len;
+    memcpy(_bufpos, s, n);
+    _bufpos += n;
+    s += n;
+    len -= n;
+    if (_bufpos >= _buffend)
+      _wflush(0);
+  }
+}
+
 /*
  * Output a raw string to the screen.
  */
@@ -180,6 +334,168 @@ static void outstr(const char *s)
 }
 
 
+/* ===== Colors and attributes ===== */
+
+/*
+ * Color pairs that don't fit in fg << 4 + bg are kept in colpairs[],
+ * and a cell holds 256 + their index. The table only grows; once it is
+ * full new pairs are shown in the nearest of the 16 ANSI colors.
+ */
+#define COLPAIRS_MAX	(COL_UNKNOWN - 256)
+#define COLHASH		1024
+
+static struct colpair {
+  int fg, bg;
+  unsigned short next;		/* Next pair in the hash chain, or 0 */
+} *colpairs;
+static int ncolpairs, colpairs_size;
+static unsigned short colhash[COLHASH];
+
+static int maxcolors = 8;	/* "Co" capability */
+static int truecolor;		/* Terminal takes 24 bit colors */
+
+/* The RGB value of a color. */
+static int _colrgb(int c)
+{
+  static const unsigned char ansi[16][3] = {
+    {   0,   0,   0 }, { 205,   0,   0 }, {   0, 205,   0 }, { 205, 205,   0 },
+    {   0,   0, 238 }, { 205,   0, 205 }, {   0, 205, 205 }, { 229, 229, 229 },
+    { 127, 127, 127 }, { 255,   0,   0 }, {   0, 255,   0 }, { 255, 255,   0 },
+    {  92,  92, 255 }, { 255,   0, 255 }, {   0, 255, 255 }, { 255, 255, 255 },
+  };
+  static const unsigned char level[6] = { 0, 95, 135, 175, 215, 255 };
+  int g;
+
+  if (COL_ISRGB(c))
+    return c & 0xffffff;
+  if (c < 16)
+    return (ansi[c][0] << 16) | (ansi[c][1] << 8) | ansi[c][2];
+  if (c >= 232) {
+    g = 8 + 10 * (c - 232);
+    return (g << 16) | (g << 8) | g;
+  }
+  c -= 16;
+  return (level[c / 36] << 16) | (level[c / 6 % 6] << 8) | level[c % 6];
+}
+
+/* Nearest of the 16 ANSI colors. */
+static int _col16(int c)
+{
+  int rgb, r, g, b, n = 0;
+
+  if (!COL_ISRGB(c) && c < 16)
+    return c;
+  rgb = _colrgb(c);
+  r = rgb >> 16;
+  g = (rgb >> 8) & 255;
+  b = rgb & 255;
+  if (r > 127)
+    n |= RED;
+  if (g > 127)
+    n |= GREEN;
+  if (b > 127)
+    n |= BLUE;
+  if (r > 191 || g > 191 || b > 191)
+    n += 8;
+  return n;
+}
+
+/* Nearest color of the 6x6x6 cube in the 256 color palette. */
+static int _col256(int c)
+{
+  int rgb, i, n = 0;
+
+  if (!COL_ISRGB(c))
+    return c;
+  rgb = c & 0xffffff;
+  for (i = 16; i >= 0; i -= 8) {
+    c = (rgb >> i) & 255;
+    n = 6 * n + (c < 48 ? 0 : c < 115 ? 1 : (c - 35) / 40);
+  }
+  return 16 + n;
+}
+
+/*
+ * The ELM color for a foreground/background pair.
+ */
+int mc_colpair(int fg, int bg)
+{
+  struct colpair *p;
+  unsigned h;
+  int ca;
+
+  if ((unsigned)fg < 16 && (unsigned)bg < 16)
+    return (fg << 4) + bg;
+
+  h = ((unsigned)fg * 31 + (unsigned)bg) % COLHASH;
+  for (ca = colhash[h]; ca; ca = colpairs[ca - 256].next)
+    if (colpairs[ca - 256].fg == fg && colpairs[ca - 256].bg == bg)
+      return ca;
+
+  if (ncolpairs == colpairs_size) {
+    p = NULL;
+    if (ncolpairs < COLPAIRS_MAX) {
+      colpairs_size = colpairs_size ? 2 * colpairs_size : 64;
+      if (colpairs_size > COLPAIRS_MAX)
+        colpairs_size = COLPAIRS_MAX;
+      p = realloc(colpairs, colpairs_size * sizeof(struct colpair));
+    }
+    if (p == NULL) {
+      colpairs_size = ncolpairs;
+      return (_col16(fg) << 4) + _col16(bg);
+    }
+    colpairs = p;
+  }
+  p = &colpairs[ncolpairs];
+  p->fg = fg;
+  p->bg = bg;
+  p->next = colhash[h];
+  ca = 256 + ncolpairs++;
+  colhash[h] = ca;
+  return ca;
+}
+
+/*
+ * Foreground and background of an ELM color.
+ */
+int mc_colfg(int ca)
+{
+  if (ca < 256)
+    return ca >> 4;
+  return ca - 256 < ncolpairs ? colpairs[ca - 256].fg : WHITE;
+}
+
+int mc_colbg(int ca)
+{
+  if (ca < 256)
+    return ca & 15;
+  return ca - 256 < ncolpairs ? colpairs[ca - 256].bg : BLACK;
+}
+
+/*
+ * Append the SGR parameters for color c to p, base being 30 for the
+ * foreground and 40 for the background. Colors the terminal doesn't
+ * have are replaced by the nearest one it does.
+ */
+static char *_sgrcolor(char *p, int c, int base)
+{
+  if (COL_ISRGB(c) && !truecolor)
+    c = _col256(c);
+  if (!COL_ISRGB(c) && c >= 16 && maxcolors < 256)
+    c = _col16(c);
+  if (!COL_ISRGB(c) && c >= 8 && c < 16 && maxcolors < 16)
+    c -= 8;
+
+  if (COL_ISRGB(c))
+    return p + sprintf(p, ";%d;2;%d;%d;%d", base + 8, (c >> 16) & 255,
+                       (c >> 8) & 255, c & 255);
+  if (c >= 16)
+    return p + sprintf(p, ";%d;5;%d", base + 8, c);
+  if (c >= 8)
+    return p + sprintf(p, ";%d", base + 60 + c - 8);
+  return p + sprintf(p, ";%d", base + c);
+}
+
 /*
  * Turn off all attributes
  */
@@ -219,39 +535,571 @@ static void _attron(char attr)
 /*
  * Set the colors
  */
-static void _colson(char color)
+static void _colson(unsigned short color)
 {
-  char buf[12];
-  sprintf(buf, "\033[%d;%dm", COLFG(color) + 30, COLBG(color) + 40);
-  outstr(buf);
+  char buf[48], *p;
+
+  p = _sgrcolor(buf, COLFG(color), 30);
+  p = _sgrcolor(p, COLBG(color), 40);
+  buf[0] = '[';
+  outchar('\033');
+  outbuf(buf, p - buf);
+  outchar('m');
+}
+
+/*
+ * If the attribute caps are plain ANSI SGR sequences, sgr_code[] has
+ * their numbers and a change is sent as one sequence with just what
+ * differs: "ESC [ 22 ; 31 m" instead of resetting and setting it all.
+ * The alternate character set is still switched with AS and AE.
+ */
+static int sgr_ansi;
+static int sgr_code[5];		/* For XA_BLINK up to XA_UNDERLINE */
+
+/* The number in a cap of the form ESC [ n m, or -1. */
+static int _sgrcap(const char *cap)
+{
+  int n = 0;
+
+  if (cap == NULL || strncmp(cap, "\033[", 2) != 0)
+    return -1;
+  for (cap += 2; *cap >= '0' && *cap <= '9'; cap++)
+    n = 10 * n + *cap - '0';
+  return strcmp(cap, "m") == 0 && n < 10 ? n : -1;
+}
+
+static void _sgrinit(void)
+{
+  const char *caps[5] = { MB, MD, MR, SO, US };
+  char me[16];
+  int i;
+
+  sgr_ansi = 0;
+  if (ME == NULL || strlen(ME) >= sizeof(me))
+    return;
+  /* Many sgr0 caps also switch the character set back. */
+  strcpy(me, ME);
+  if (strncmp(me, "\033(B", 3) == 0)
+    memmove(me, me + 3, strlen(me + 3) + 1);
+  if (*me && me[strlen(me) - 1] == '\017')
+    me[strlen(me) - 1] = 0;
+  if (_sgrcap(me) != 0)
+    return;
+  for (i = 0; i < 5; i++) {
+    sgr_code[i] = caps[i] ? _sgrcap(caps[i]) : 0;
+    if (sgr_code[i] < 0)
+      return;
+  }
+  sgr_ansi = 1;
+}
+
+/* Bitmap of the SGR numbers for attr. */
+static int _sgrbits(char attr)
+{
+  int i, bits = 0;
+
+  for (i = 0; i < 5; i++)
+    if ((attr & (1 << i)) && sgr_code[i] > 0)
+      bits |= 1 << sgr_code[i];
+  return bits;
+}
+
+/*
+ * Go from curattr/curcolor to attr/color with as few bytes as possible:
+ * either the differences, or a reset followed by everything that is on.
+ */
+static void _sgrdelta(char attr, unsigned short color)
+{
+  /* Number that turns off SGR attribute n. */
+  static const char off[10] = { 0, 22, 22, 23, 24, 25, 25, 27, 28, 29 };
+  char full[80], diff[80], *f = full, *d = diff;
+  int known = curattr != -1 && curcolor != COL_UNKNOWN;
+  int old, new, add, n, i;
+
+  new = _sgrbits(attr);
+  f += sprintf(f, ";0");
+  for (n = 1; n < 10; n++)
+    if (new & (1 << n))
+      f += sprintf(f, ";%d", n);
+  if (usecolor) {
+    f = _sgrcolor(f, COLFG(color), 30);
+    f = _sgrcolor(f, COLBG(color), 40);
+  }
+
+  if (known) {
+    old = _sgrbits(curattr);
+    add = new & ~old;
+    for (n = 1; n < 10; n++) {
+      if (!(old & ~new & (1 << n)))
+        continue;
+      /* 22 and 25 turn off two attributes each. */
+      for (i = 1; i < n; i++)
+        if ((old & ~new & (1 << i)) && off[i] == off[n])
+          break;
+      if (i < n)
+        continue;
+      d += sprintf(d, ";%d", off[n]);
+      for (i = 1; i < 10; i++)
+        if (off[i] == off[n])
+          add |= new & (1 << i);
+    }
+    for (n = 1; n < 10; n++)
+      if (add & (1 << n))
+        d += sprintf(d, ";%d", n);
+    if (usecolor && COLFG(color) != COLFG(curcolor))
+      d = _sgrcolor(d, COLFG(color), 30);
+    if (usecolor && COLBG(color) != COLBG(curcolor))
+      d = _sgrcolor(d, COLBG(color), 40);
+  }
+
+  if (known && d - diff <= f - full) {
+    memcpy(full, diff, d - diff);
+    f = full + (d - diff);
+  }
+  if (f > full) {
+    full[0] = '[';
+    outchar('\033');
+    outbuf(full, f - full);
+    outchar('m');
+  }
+
+  if ((!known || ((attr ^ curattr) & XA_ALTCHARSET)) &&
+      (attr & XA_ALTCHARSET ? AS : AE) != NULL)
+    outstr(attr & XA_ALTCHARSET ? AS : AE);
 }
 
 /*
  * Set global attributes, if different.
  */
-static void _setattr(char attr, char color)
+static void _setattr(char attr, unsigned short color)
 {
   if (!useattr)
     return;
 
-  if (!usecolor) {
+  if (!usecolor)
     curcolor = color;
-    if (attr == curattr)
-      return;
-    curattr = attr;
+  if (attr == curattr && color == curcolor)
+    return;
+  if (sgr_ansi)
+    _sgrdelta(attr, color);
+  else {
     _attroff();
+    if (usecolor)
+      _colson(color);
     _attron(attr);
-    return;
   }
-  if (attr == curattr && color == curcolor)
-    return;
-  _attroff();
-  _colson(color);
-  _attron(attr);
   curattr = attr;
   curcolor = color;
 }
 
+/* ===== Shadow of the physical screen ===== */
+
+/*
+ * smap holds what the terminal is showing, so that characters that are
+ * there already need not be sent again: redrawing an unchanged region,
+ * or the part of a line next to a closing window, costs nothing. Cells
+ * we are not sure about hold NOT_SHOWN and are always written.
+ *
+ * A double width character takes one cell in gmap but two columns on
+ * the terminal, so on lines that have one the cells and the columns no
+ * longer match up; everything is written there, as before.
+ */
+#define NOT_SHOWN	((wchar_t)0x7fffffff)
+
+/* Forget what is shown on lines y1 to y2. */
+static void _sforget(int y1, int y2)
+{
+  ELM *s = smap + y1 * COLS;
+  int n;
+
+  for (n = (y2 - y1 + 1) * COLS; n > 0; n--, s++)
+    s->value = NOT_SHOWN;
+}
+
+/*
+ * The terminal erased n cells. They take the current background color
+ * only if it has back_color_erase, and never any other attributes.
+ */
+static void _sblank(ELM *s, int n)
+{
+  wchar_t v = NOT_SHOWN;
+
+  if (curattr == XA_NORMAL && (_has_bce || !usecolor))
+    v = ' ';
+  for (; n > 0; n--, s++) {
+    s->value = v;
+    s->attr = curattr;
+    s->color = curcolor;
+  }
+}
+
+/* The terminal scrolled lines top to bot one line up or down. */
+static void _sscroll(int top, int bot, int dir)
+{
+  int len = (bot - top) * COLS * sizeof(ELM);
+
+  if (dir == S_UP) {
+    memmove(smap + top * COLS, smap + (top + 1) * COLS, len);
+    memmove(swide + top, swide + top + 1, bot - top);
+    _sblank(smap + bot * COLS, COLS);
+    swide[bot] = 0;
+  } else {
+    memmove(smap + (top + 1) * COLS, smap + top * COLS, len);
+    memmove(swide + top + 1, swide + top, bot - top);
+    _sblank(smap + top * COLS, COLS);
+    swide[top] = 0;
+  }
+}
+
+/* The terminal inserted or deleted a character at the cursor. */
+static void _sinsdel(int insert)
+{
+  ELM *s;
+
+  if (curx < 0 || curx >= COLS || cury < 0 || cury > LINES) {
+    _sforget(0, LINES);
+    return;
+  }
+  s = smap + cury * COLS + curx;
+  if (insert) {
+    memmove(s + 1, s, (COLS - curx - 1) * sizeof(ELM));
+    _sblank(s, 1);
+  } else {
+    memmove(s, s + 1, (COLS - curx - 1) * sizeof(ELM));
+    _sblank(smap + cury * COLS + COLS - 1, 1);
+  }
+}
+
+/* Is (c, attr, color) on the screen at s, on line y? */
+static inline int _shown(const ELM *s, int y, wchar_t c, char attr,
+                         unsigned short color)
+{
+  return s->value == c && s->attr == attr && s->color == color && !swide[y];
+}
+
+/* Character c was sent to the terminal at s, on line y. */
+static void _sput(ELM *s, int y, wchar_t c, char attr, unsigned short color)
+{
+  s->value = c;
+  s->attr = attr;
+  s->color = color;
+  if (c > 0x7e && !(attr & XA_ALTCHARSET) && wcwidth(c) != 1)
+    swide[y] = 1;
+}
+
+/* ===== Cursor motion ===== */
+
+/*
+ * Parameterized capabilities are split up at the numbers once, at
+ * startup, so that moving the cursor does not need tgoto(). Strings
+ * that can't be split (padding, odd encodings) still go through tgoto().
+ */
+typedef struct {
+  const char *cap;		/* NULL if the terminal does not have it */
+  char part[3][12];		/* The text around the numbers */
+  unsigned char plen[3];
+  unsigned char nparm;
+  unsigned char colfirst;	/* Column comes before line */
+  unsigned char base;		/* 1 for %i */
+  unsigned char compiled;
+} MOVECAP;
+
+static MOVECAP M_CM, M_RI, M_LE, M_UP, M_DO, M_SF;
+static const char *HO, *ND, *Up, *TA;
+static int tabwidth;
+
+#define MV_INF	10000
+
+/* Format m for line and column into buf, return the length. */
+static int _mvfmt(const MOVECAP *m, int line, int col, char *buf)
+{
+  int v[2], i, n, len = 0;
+  char tmp[12];
+
+  v[0] = (m->colfirst ? col : line) + m->base;
+  v[1] = (m->colfirst ? line : col) + m->base;
+  for (i = 0; i <= m->nparm; i++) {
+    memcpy(buf + len, m->part[i], m->plen[i]);
+    len += m->plen[i];
+    if (i == m->nparm)
+      break;
+    n = 0;
+    do
+      tmp[n++] = '0' + v[i] % 10;
+    while ((v[i] /= 10) > 0);
+    while (n > 0)
+      buf[len++] = tmp[--n];
+  }
+  return len;
+}
+
+static void _mvcompile(MOVECAP *m, const char *cap, int nparm)
+{
+  static const int test[][2] = { { 0, 0 }, { 9, 1 }, { 23, 79 }, { 99, 200 } };
+  char buf[64], out[64];
+  char *p, *q, *d[2], *e[2];
+  long v[2];
+  int i, n = 0;
+
+  m->cap = cap;
+  m->nparm = nparm;
+  m->compiled = 0;
+  if (cap == NULL || strstr(cap, "$<"))
+    return;
+
+  /* Find the numbers for line 45, column 123. */
+  strncpy(buf, tgoto(cap, 123, 45), sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = 0;
+  for (p = buf; *p; p = q) {
+    for (q = p; *q >= '0' && *q <= '9'; q++)
+      ;
+    if (q == p) {
+      q++;
+      continue;
+    }
+    if (n == nparm)
+      return;
+    d[n] = p;
+    e[n] = q;
+    v[n++] = strtol(p, NULL, 10);
+  }
+  if (n != nparm)
+    return;
+  if (nparm == 1 && (v[0] == 45 || v[0] == 46))
+    m->base = v[0] - 45;
+  else if (nparm == 2 && v[0] - 45 == v[1] - 123 && (v[0] == 45 || v[0] == 46))
+    m->base = v[0] - 45, m->colfirst = 0;
+  else if (nparm == 2 && v[0] - 123 == v[1] - 45 && (v[1] == 45 || v[1] == 46))
+    m->base = v[1] - 45, m->colfirst = 1;
+  else
+    return;
+
+  for (i = 0; i <= nparm; i++) {
+    p = i ? e[i - 1] : buf;
+    q = i < nparm ? d[i] : buf + strlen(buf);
+    if (q - p >= (int)sizeof(m->part[i]))
+      return;
+    memcpy(m->part[i], p, q - p);
+    m->plen[i] = q - p;
+  }
+
+  /* Make sure it comes out the same. */
+  for (i = 0; i < (int)(sizeof(test) / sizeof(test[0])); i++) {
+    out[_mvfmt(m, test[i][0], test[i][1], out)] = 0;
+    if (strcmp(out, tgoto(cap, nparm == 2 ? test[i][1] : 0, test[i][0])))
+      return;
+  }
+  m->compiled = 1;
+}
+
+/* Length of m with these parameters (a count for one parameter). */
+static int _mvlen(const MOVECAP *m, int line, int col)
+{
+  char buf[64];
+
+  if (m->cap == NULL)
+    return MV_INF;
+  if (m->compiled)
+    return _mvfmt(m, line, col, buf);
+  return strlen(tgoto(m->cap, col, line));
+}
+
+static void _mvput(const MOVECAP *m, int line, int col)
+{
+  char buf[64];
+
+  if (m->compiled)
+    outbuf(buf, _mvfmt(m, line, col, buf));
+  else
+    outstr(tgoto(m->cap, col, line));
+}
+
+/* n times s */
+static int _mvrep(const char *s, int n, int doit)
+{
+  int i;
+
+  if (s == NULL)
+    return MV_INF;
+  if (doit)
+    for (i = 0; i < n; i++)
+      outstr(s);
+  return strlen(s) * n;
+}
+
+/*
+ * Can the cells from x1 up to x2 on line y be sent again, as a way of
+ * moving the cursor over them? They must be known, plain characters in
+ * the current attributes.
+ */
+static int _mvreprint(int x1, int x2, int y)
+{
+  ELM *s = smap + y * COLS;
+  int i;
+
+  if (swide[y])
+    return 0;
+  for (i = x1; i < x2; i++)
+    if (s[i].value < ' ' || s[i].value > '~' ||
+        s[i].attr != curattr || s[i].color != curcolor)
+      return 0;
+  return 1;
+}
+
+/* Cost of moving from column x1 to x2 on line y, moving if doit. */
+static int _mvcol(int x1, int x2, int y, int tabs, int doit)
+{
+  int n = x2 - x1, best = MV_INF, how = 0, c, t = x1, tn = 0;
+
+  if (n > 0) {
+    if ((c = _mvlen(&M_RI, n, 0)) < best)
+      best = c, how = 1;
+    if ((c = _mvrep(ND, n, 0)) < best)
+      best = c, how = 2;
+    if (n < best && _mvreprint(x1, x2, y))
+      best = n, how = 3;
+    /* Tab as far as we can, then go on from there. */
+    if (tabs && TA && tabwidth > 0) {
+      for (tn = 0; (t / tabwidth + 1) * tabwidth <= x2; tn++)
+        t = (t / tabwidth + 1) * tabwidth;
+      if (tn > 0 && (c = _mvrep(TA, tn, 0) + _mvcol(t, x2, y, 0, 0)) < best)
+        best = c, how = 4;
+    }
+  } else if (n < 0) {
+    if ((c = _mvlen(&M_LE, -n, 0)) < best)
+      best = c, how = 5;
+    if ((c = _mvrep(BC, -n, 0)) < best)
+      best = c, how = 6;
+  } else
+    best = 0;
+
+  if (doit) {
+    switch (how) {
+      case 1:
+        _mvput(&M_RI, n, 0);
+        break;
+      case 2:
+        _mvrep(ND, n, 1);
+        break;
+      case 3:
+        for (; x1 < x2; x1++)
+          outchar(smap[y * COLS + x1].value);
+        break;
+      case 4:
+        _mvrep(TA, tn, 1);
+        _mvcol(t, x2, y, 0, 1);
+        break;
+      case 5:
+        _mvput(&M_LE, -n, 0);
+        break;
+      case 6:
+        _mvrep(BC, -n, 1);
+        break;
+    }
+  }
+  return best;
+}
+
+/*
+ * Cost of moving from line y1 to y2, moving if doit. NL is only used
+ * in the first column (see _gotoxy()).
+ */
+static int _mvline(int y1, int y2, int col0, int doit)
+{
+  int n = y2 - y1, best = MV_INF, how = 0, c;
+
+  if (n > 0) {
+    if ((c = _mvlen(&M_DO, n, 0)) < best)
+      best = c, how = 1;
+    if (col0 && (c = _mvrep(NL, n, 0)) < best)
+      best = c, how = 2;
+  } else if (n < 0) {
+    if ((c = _mvlen(&M_UP, -n, 0)) < best)
+      best = c, how = 3;
+    if ((c = _mvrep(Up, -n, 0)) < best)
+      best = c, how = 4;
+  } else
+    best = 0;
+
+  if (doit) {
+    switch (how) {
+      case 1:
+        _mvput(&M_DO, n, 0);
+        break;
+      case 2:
+        _mvrep(NL, n, 1);
+        break;
+      case 3:
+        _mvput(&M_UP, -n, 0);
+        break;
+      case 4:
+        _mvrep(Up, -n, 1);
+        break;
+    }
+  }
+  return best;
+}
+
+/*
+ * Move the cursor to (x, y) in as few bytes as possible: with an
+ * absolute move, or relative to where it is, to the start of the line
+ * or to the home position. Going right can be done by sending the
+ * characters that are there again, or with tabs.
+ */
+static void _mvcursor(int x, int y)
+{
+  int best, how = 0, c;
+  int known = curx >= 0 && curx < COLS && cury >= 0 && cury < LINES;
+
+  /*
+   * After wide characters the terminal may even have wrapped to the next
+   * line without us knowing, so only the old moves are used there.
+   */
+  if (cury >= 0 && cury <= LINES && swide[cury]) {
+    if (CR != NULL && y == cury && x == 0)
+      outstr(CR);
+    else if (NL != NULL && x == 0 && x == curx && y == cury + 1)
+      outstr(NL);
+    else if (BC != NULL && y == cury && x == curx - 1)
+      outstr(BC);
+    else
+      _mvput(&M_CM, y, x);
+    return;
+  }
+
+  best = _mvlen(&M_CM, y, x);
+  if (y < LINES) {
+    if (known && (c = _mvline(cury, y, curx == 0, 0) + _mvcol(curx, x, y, 1, 0)) < best)
+      best = c, how = 1;
+    /* Past the end of the line the terminal may have wrapped already. */
+    if (CR && cury >= 0 && cury < LINES && (curx < COLS || y == cury) &&
+        (c = strlen(CR) + _mvline(cury, y, 1, 0) + _mvcol(0, x, y, 1, 0)) < best)
+      best = c, how = 2;
+    if (HO && (c = strlen(HO) + _mvline(0, y, 1, 0) + _mvcol(0, x, y, 1, 0)) < best)
+      best = c, how = 3;
+  }
+
+  switch (how) {
+    case 0:
+      _mvput(&M_CM, y, x);
+      break;
+    case 1:
+      _mvline(cury, y, curx == 0, 1);
+      _mvcol(curx, x, y, 1, 1);
+      break;
+    case 2:
+      outstr(CR);
+      _mvline(cury, y, 1, 1);
+      _mvcol(0, x, y, 1, 1);
+      break;
+    case 3:
+      outstr(HO);
+      _mvline(0, y, 1, 1);
+      _mvcol(0, x, y, 1, 1);
+      break;
+  }
+}
+
 /*
  * Goto (x, y) in stdwin
  */
@@ -259,6 +1107,14 @@ static void _gotoxy(int x, int y)
 {
   int oldattr = -1;
 
+  /* Done once the pending scroll has been sent. */
+  if (scr_n) {
+    owe_x = x;
+    owe_y = y;
+    return;
+  }
+  owe_x = -1;
+
 #ifdef ST_LINE
   int tmp;
 
@@ -309,19 +1165,7 @@ static void _gotoxy(int x, int y)
     oldattr = curattr;
     _setattr(XA_NORMAL, curcolor);
   }
-  if (CR != NULL && y == cury && x == 0)
-    outstr(CR);
-#if 0 /* Hmm, sometimes NL only works in the first column */
-  else if (NL != NULL && x == curx && y == cury + 1)
-    outstr(NL);
-#else
-  else if (NL != NULL && x == 0 && x == curx && y == cury + 1)
-    outstr(NL);
-#endif
-  else if (BC != NULL && y == cury && x == curx - 1)
-    outstr(BC);
-  else
-    outstr(tgoto(CM, x, y));
+  _mvcursor(x, y);
   curx = x;
   cury = y;
   if (oldattr != -1)
@@ -334,7 +1178,13 @@ static void _gotoxy(int x, int y)
  *                 0: only write to memory, not to screen
  *                 1: write to both screen and memory
  */
-static void _write(wchar_t c, int doit, int x, int y, char attr, char color)
+/* Last character sent by _write() */
+static int _lastx = -1, _lasty = -1, _lastc = 0;
+static char _lastattr;
+static unsigned short _lastcolor;
+
+static void _write(wchar_t c, int doit, int x, int y, char attr,
+                   unsigned short color)
 {
   ELM *e;
 
@@ -349,20 +1199,32 @@ static void _write(wchar_t c, int doit, int x, int y, char attr, char color)
     oldc.attr = attr;
     oldc.color = color;
   }
+  /* Redrawn from gmap by _scrflush(). */
+  if (doit != 0 && SCR_PENDING(y)) {
+    if (doit < 0)
+      return;
+    doit = 0;
+  }
 #ifdef ST_LINE
   if (x < COLS && y <= LINES)
 #else
   if (x < COLS && y < LINES)
 #endif
   {
-    if (doit != 0) {
-      static int x0 = -1, y0 = -1, c0 = 0;
-      static char attr0, color0;
-      if (x!=x0+1 || y!=y0 || attr!=attr0 || color!=color0 || !(c0&128)) {
+    e = &smap[x + y * COLS];
+    if (doit != 0 && _shown(e, y, c, attr, color)) {
+      /* Already on the screen. The cursor is moved to where it would
+       * have ended up by the next write, or at mc_wflush(). */
+      owe_x = x < COLS - 1 ? x + 1 : x;
+      owe_y = y;
+      _lasty = -1;
+    } else if (doit != 0) {
+      if (x != _lastx + 1 || y != _lasty || attr != _lastattr ||
+          color != _lastcolor || !(_lastc & 128)) {
         _gotoxy(x, y);
         _setattr(attr, color);
       }
-      x0 = x; y0 = y; attr0 = attr; color0 = color; c0 = c;
+      _lastx = x; _lasty = y; _lastattr = attr; _lastcolor = color; _lastc = c;
       if ((attr & XA_ALTCHARSET) != 0)
         outchar((char)c);
       else {
@@ -373,6 +1235,7 @@ static void _write(wchar_t c, int doit, int x, int y, char attr, char color)
         for (i = 0; i < len; i++)
           outchar(buf[i]);
       }
+      _sput(e, y, c, attr, color);
 
       curx++;
     }
@@ -385,6 +1248,57 @@ static void _write(wchar_t c, int doit, int x, int y, char attr, char color)
   }
 }
 
+/*
+ * Send the scroll that mc_wscroll() left pending, as one counted SF if
+ * the terminal has it, and bring the region up to date from gmap. What
+ * scrolled by in between is never sent. This happens before anything
+ * else goes out, so the attributes and the cursor are put back after.
+ */
+static void _scrflush(void)
+{
+  int n = scr_n, fs, x, y;
+  char attr = curattr;
+  unsigned short color = curcolor;
+  int ox = owe_x, oy = owe_y;
+  ELM *e;
+
+  scr_n = 0;
+  _lasty = -1;
+
+  _setattr(scr_attr, scr_color);
+  fs = scr_top == 0 && scr_bot == LINES - 1;
+  if (!fs) {
+    outstr(tgoto(CS, scr_bot, scr_top));
+    curx = cury = -1;
+  }
+  _gotoxy(0, scr_bot);
+  if (n > 1 && _mvlen(&M_SF, n, 0) < n * (int)strlen(SF))
+    _mvput(&M_SF, n, 0);
+  else
+    _mvrep(SF, n, 1);
+  for (y = 0; y < n; y++)
+    _sscroll(scr_top, scr_bot, S_UP);
+  if (!fs) {
+    outstr(tgoto(CS, LINES - 1, 0));
+    curx = cury = -1;
+  }
+
+  for (y = scr_top; y <= scr_bot; y++) {
+    e = gmap + y * COLS;
+    for (x = 0; x < COLS; x++, e++)
+      _write(e->value, -1, x, y, e->attr, e->color);
+  }
+
+  if (attr != -1)
+    _setattr(attr, color);
+  if (ox >= 0)
+    _gotoxy(ox, oy);
+  else
+    owe_x = -1;
+  /* We may be in the middle of a _write(). */
+  _lasty = -1;
+}
+
 /*
  * Set cursor type.
  */
@@ -524,6 +1438,7 @@ WIN *mc_wopen(int x1, int y1, int x2, int y2, int border, int attr,
 	return NULL;
   }
   w->map = e;
+  w->wrapped = calloc(w->ys, 1);
   /* How many bytes is one line */
   bytes = (x2 - x1 + 1) * sizeof(ELM);
   /* Loop */
@@ -536,23 +1451,13 @@ WIN *mc_wopen(int x1, int y1, int x2, int y2, int border, int attr,
   w->histline = w->histlines = 0;
   w->histbuf = NULL;
   if (histlines) {
-    /* Reserve some memory. */
-    bytes = w->xs * histlines * sizeof(ELM);
-    if ((w->histbuf = malloc(bytes)) == NULL) {
+    if ((w->histbuf = mc_histnew(histlines, w->xs, attr, color)) == NULL) {
+      free(w->wrapped);
       free(w->map);
       free(w);
       return NULL;
     }
     w->histlines = histlines;
-
-    /* Clear the history buf. */
-    e = w->histbuf;
-    for (y = 0; y < w->xs * histlines; y++) {
-      e->value = ' ';
-      e->attr = attr;
-      e->color = color;
-      e++;
-    }
   }
 
   /* And draw the window */
@@ -583,6 +1488,36 @@ WIN *mc_wopen(int x1, int y1, int x2, int y2, int border, int attr,
   return w;
 }
 
+/*
+ * The n cells at e are about to be drawn from (x, y) on. If they end in
+ * a run of blanks, and the line is blank after them too, erase the run
+ * with CE; the characters are then found on the screen already.
+ */
+static void _wblankrest(int x, int y, const ELM *e, int n)
+{
+  const ELM *g;
+  unsigned short color;
+  int b, i;
+
+  if (CE == NULL || y >= LINES || n <= 0 || (usecolor && !_has_bce))
+    return;
+  color = e[n - 1].color;
+  for (b = n; b > 0 && e[b - 1].value == ' ' &&
+       e[b - 1].attr == XA_NORMAL && e[b - 1].color == color; b--)
+    ;
+  if (n - b < 8)
+    return;
+  g = gmap + y * COLS;
+  for (i = x + n; i < COLS; i++)
+    if (g[i].value != ' ' || g[i].attr != XA_NORMAL || g[i].color != color)
+      return;
+
+  _gotoxy(x + b, y);
+  _setattr(XA_NORMAL, color);
+  outstr(CE);
+  _sblank(smap + y * COLS + x + b, COLS - x - b);
+}
+
 /*
  * Close a window.
  */
@@ -618,6 +1553,7 @@ void mc_wclose(WIN *win, int replace)
         g++;
       }
       /* to here */
+      _wblankrest(win->x1, y, e, win->x2 - win->x1 + 1);
       for (x = win->x1; x <= win->x2; x++) {
         _write(e->value, 1, x, y, e->attr, e->color);
         e++;
@@ -627,12 +1563,35 @@ void mc_wclose(WIN *win, int replace)
     _setattr(win->o_attr, win->o_color);
   }
   free(win->map);
-  if (win->histbuf)
-    free(win->histbuf);
+  free(win->wrapped);
+  mc_histfree(win->histbuf);
   free(win);	/* 1.1.98 dickey@clark.net  */
   mc_wflush();
 }
 
+/*
+ * Exchange what is under a window, as kept in its map, with what it
+ * shows, without drawing anything. Done before and after output to a
+ * window underneath that is not direct, it keeps that window up to
+ * date while this one stays on top.
+ */
+void mc_wswap(WIN *win)
+{
+  ELM *e, *g, t;
+  int x, y, b;
+
+  b = (win->border != BNONE);
+  e = win->map;
+  for (y = win->y1 - b; y <= win->y2 + b; y++) {
+    g = gmap + y * COLS + win->x1 - b;
+    for (x = win->x1 - b; x <= win->x2 + b; x++) {
+      t = *g;
+      *g++ = *e;
+      *e++ = t;
+    }
+  }
+}
+
 static int oldx, oldy;
 static int ocursor;
 
@@ -670,7 +1629,7 @@ void mc_wreturn(void)
   ELM *e;
 
   curattr = -1;
-  curcolor = -1;
+  curcolor = COL_UNKNOWN;
 
   setcbreak(1); /* Cbreak, no echo */
 
@@ -684,6 +1643,8 @@ void mc_wreturn(void)
   _gotoxy(0, 0);
   _cursor(ocursor);
 
+  /* Someone else has been using the screen. */
+  _sforget(0, LINES);
   e = gmap;
   for (y = 0; y <LINES; y++) {
     for(x = 0; x < COLS; x++) {
@@ -746,11 +1707,14 @@ static int _wclreol(WIN *w)
   int y;
 
   y = w->cury + w->y1;
+  if (w->curx == 0 && w->wrapped)
+    w->wrapped[w->cury] = 0;
 
   if (w->direct && (w->x2 == COLS - 1) && CE) {
     _gotoxy(w->curx + w->x1, y);
     _setattr(w->attr, w->color);
     outstr(CE);
+    _sblank(smap + y * COLS + w->curx + w->x1, COLS - w->curx - w->x1);
     doit = 0;
   }
   for (x = w->curx + w->x1; x <= w->x2; x++) {
@@ -764,18 +1728,41 @@ static int _wclreol(WIN *w)
  */
 void mc_wscroll(WIN *win, int dir)
 {
-  ELM *e, *f;
+  ELM *e;
   char *src, *dst;
   int x, y;
   int doit = 1;
   int ocurx, fs = 0, len;
-  int phys_scr = 0;
+  int phys_scr = 0, defer;
 
+  /*
+   * Scrolling up the full width of the screen is only done in gmap here.
+   * The terminal gets all the scrolls at once, and only the lines that
+   * are still there after them, from _scrflush().
+   */
+  defer = win->direct && dir == S_UP && win->xs == COLS && SF != NULL &&
+          win->sy1 >= 0 && win->sy2 < LINES && win->sy1 < win->sy2 &&
+          (CS != NULL || (win->sy1 == 0 && win->sy2 == LINES - 1));
+  if (scr_n && (!defer || win->sy1 != scr_top || win->sy2 != scr_bot))
+    _scrflush();
+
+  if (defer) {
+    scr_top = win->sy1;
+    scr_bot = win->sy2;
+    scr_attr = win->attr;
+    scr_color = win->color;
+    if (scr_n <= scr_bot - scr_top)
+      scr_n++;
+    /* The last character is in gmap; it gets drawn when flushed. */
+    sflag = 0;
+    doit = 0;
+    phys_scr = 1;
+  }
   /*
    * If the window *is* the physical screen, we can scroll very simple.
    * This improves performance on slow screens (eg ATARI ST) dramatically.
    */
-  if (win->direct && SF != NULL &&
+  else if (win->direct && SF != NULL &&
       (dir == S_UP || SR != NULL) && (LINES == win->sy2 - win->sy1 + 1)) {
     doit = 0;
     phys_scr = 1;
@@ -787,6 +1774,7 @@ void mc_wscroll(WIN *win, int dir)
       _gotoxy(0, 0);
       outstr(SR);
     }
+    _sscroll(0, LINES - 1, dir);
   }
   /*
    * If the window is as wide as the physical screen, we can
@@ -807,7 +1795,7 @@ void mc_wscroll(WIN *win, int dir)
         fs = 1;
       if (!fs) {
         outstr(tgoto(CS, win->sy2, win->sy1));
-        cury = 0;
+        curx = cury = -1;
       }
       if (dir == S_UP) {
         _gotoxy(0, win->sy2);
@@ -816,22 +1804,27 @@ void mc_wscroll(WIN *win, int dir)
         _gotoxy(0, win->sy1);
         outstr(SR);
       }
+      _sscroll(win->sy1, win->sy2, dir);
       if (!fs) {
         outstr(tgoto(CS, LINES - 1, 0));
-        cury = 0;
+        curx = cury = -1;
       }
       _gotoxy(0, win->sy2);
     } else { /* Use insert/delete line */
       if (dir == S_UP) {
         _gotoxy(0, win->sy1);
         outstr(Dl);
+        _sscroll(win->sy1, LINES - 1, S_UP);
         _gotoxy(0, win->sy2);
         outstr(Al);
+        _sscroll(win->sy2, LINES - 1, S_DOWN);
       } else {
         _gotoxy(0, win->sy2);
         outstr(Dl);
+        _sscroll(win->sy2, LINES - 1, S_UP);
         _gotoxy(0, win->sy1);
         outstr(Al);
+        _sscroll(win->sy1, LINES - 1, S_DOWN);
       }
     }
   }
@@ -854,19 +1847,22 @@ void mc_wscroll(WIN *win, int dir)
   if (win->histbuf && dir == S_UP &&
       win->sy2 == win->y2 && win->sy1 == win->y1) {
 
-    /* Calculate screen buffer */
-    e = gmap + win->y1 * COLS + win->x1;
-
-    /* Calculate history buffer */
-    f = win->histbuf + (win->xs * win->histline);
-
     /* Copy line from screen to history buffer */
-    memcpy((char *)f, (char *)e, win->xs * sizeof(ELM));
+    mc_histadd(win, gmap + win->y1 * COLS + win->x1,
+               win->wrapped && win->wrapped[0]);
+  }
 
-    /* Position the next line in the history buffer */
-    win->histline++;
-    if (win->histline >= win->histlines)
-      win->histline = 0;
+  /* The rows that wrapped move along. */
+  if (win->wrapped) {
+    len = win->sy2 - win->sy1;
+    y = win->sy1 - win->y1;
+    if (dir == S_UP) {
+      memmove(win->wrapped + y, win->wrapped + y + 1, len);
+      win->wrapped[y + len] = 0;
+    } else {
+      memmove(win->wrapped + y + 1, win->wrapped + y, len);
+      win->wrapped[y] = 0;
+    }
   }
 
   /* If the window is screen-wide and has no border, there
@@ -874,13 +1870,14 @@ void mc_wscroll(WIN *win, int dir)
    */
   if (phys_scr) {
     len = (win->sy2 - win->sy1) * win->xs * sizeof(ELM);
+    e = gmap + win->sy1 * COLS;
     if (dir == S_UP)  {
-      dst = (char *)&gmap[0];				/* First line */
-      src = (char *)&gmap[win->xs];			/* Second line */
+      dst = (char *)e;				/* First line */
+      src = (char *)(e + win->xs);		/* Second line */
       win->cury = win->sy2 - win->y1;
     } else {
-      src = (char *)&gmap[0];				/* First line */
-      dst = (char *)&gmap[win->xs];			/* Second line */
+      src = (char *)e;				/* First line */
+      dst = (char *)(e + win->xs);		/* Second line */
       win->cury = win->sy1 - win->y1;
     }
     /* memmove copies len bytes from src to dst, even if the
@@ -992,8 +1989,11 @@ void mc_wputc(WIN *win, wchar_t c)
     default:
       /* See if we need to scroll/move. (vt100 behaviour!) */
       if (c == '\n' || (win->curx >= win->xs && win->wrap)) {
-        if (c != '\n')
+        if (c != '\n') {
           win->curx = 0;
+          if (win->wrapped)
+            win->wrapped[win->cury] = 1;
+        }
         win->cury++;
         mv++;
         if (win->cury == win->sy2 - win->y1 + 1) {
@@ -1013,7 +2013,7 @@ void mc_wputc(WIN *win, wchar_t c)
                win->cury + win->y1, win->attr, win->color);
         if (++win->curx >= win->xs && !win->wrap) {
           win->curx--;
-          curx = 0; /* Force to move */
+          curx = -1; /* Force to move */
           mv++;
         }
       }
@@ -1026,6 +2026,68 @@ void mc_wputc(WIN *win, wchar_t c)
     mc_wflush();
 }
 
+/*
+ * Print a run of printable ASCII characters in a window. Does the same
+ * as mc_wputc() for each of them, but positions the cursor and sets
+ * the attributes once per line instead of once per character.
+ */
+void mc_wputrun(WIN *win, const char *s, int len)
+{
+  int n, i, j, x, y;
+  ELM *e;
+
+  while (len > 0) {
+    x = win->x1 + win->curx;
+    y = win->y1 + win->cury;
+    n = win->xs - win->curx;
+    if (n > len)
+      n = len;
+
+    /* Wrapping, scrolling, no-wrap truncation and the last position
+     * of the screen (see _write()) are left to mc_wputc(). */
+    if (n <= 0 || !win->wrap || x + n > COLS || y > LINES
+        || (_has_am && y >= LINES - 1 && x + n > COLS - 1)) {
+      mc_wputc(win, (unsigned char)*s++);
+      len--;
+      continue;
+    }
+
+    if (win->direct && !SCR_PENDING(y)) {
+      /* Leave out what is on the screen already at both ends. */
+      e = smap + x + y * COLS;
+      for (i = 0; i < n && _shown(e + i, y, (unsigned char)s[i], win->attr, win->color); i++)
+        ;
+      for (j = n; j > i && _shown(e + j - 1, y, (unsigned char)s[j - 1], win->attr, win->color); j--)
+        ;
+      if (i < j) {
+        _gotoxy(x + i, y);
+        _setattr(win->attr, win->color);
+        outbuf(s + i, j - i);
+        curx += j - i;
+        for (; i < j; i++)
+          _sput(e + i, y, (unsigned char)s[i], win->attr, win->color);
+      }
+      if (j < n) {
+        owe_x = x + n < COLS ? x + n : COLS - 1;
+        owe_y = y;
+      }
+      _lasty = -1;
+    }
+    e = gmap + x + y * COLS;
+    for (i = 0; i < n; i++, e++) {
+      e->value = (unsigned char)s[i];
+      e->attr = win->attr;
+      e->color = win->color;
+    }
+    win->curx += n;
+    s += n;
+    len -= n;
+  }
+
+  if (win->direct && dirflush && !_intern)
+    mc_wflush();
+}
+
 /* Draw one line in a window */
 void mc_wdrawelm(WIN *w, int y, ELM *e)
 {
@@ -1433,7 +2495,7 @@ void mc_winclr(WIN *w)
 {
   int y;
   int olddir = w->direct;
-  ELM *e, *f;
+  ELM *e;
   int i;
   int m;
 
@@ -1462,11 +2524,7 @@ void mc_winclr(WIN *w)
       e = gmap + y * COLS + w->x1;
 
       /* Now copy this line. */
-      f = w->histbuf + (w->xs * w->histline); /* History buffer */
-      memcpy((char *)f, (char *)e, w->xs * sizeof(ELM));
-      w->histline++;
-      if (w->histline >= w->histlines)
-        w->histline = 0;
+      mc_histadd(w, e, w->wrapped && w->wrapped[y - w->y1]);
     }
   }
 
@@ -1478,6 +2536,8 @@ void mc_winclr(WIN *w)
     curx = 0;
     cury = 0;
     outstr(CL);
+    _sblank(smap, LINES * COLS);
+    memset(swide, 0, LINES);
   }
   for (y = w->ys - 1; y >= 0; y--) {
     w->cury = y;
@@ -1571,8 +2631,10 @@ void mc_winschar2(WIN *w, wchar_t c, int move)
   odir = w->direct;
   if (w->xs == COLS && IC != NULL) {
     /* We can use the insert character capability. */
-    if (w->direct)
+    if (w->direct) {
       outstr(IC);
+      _sinsdel(1);
+    }
 
     /* No need to draw the character if it's a space. */
     if (c == ' ')
@@ -1631,6 +2693,7 @@ void mc_wdelchar(WIN *w)
     /*_gotoxy(x - 1, y);*/
     _gotoxy(x, y);
     outstr(DC);
+    _sinsdel(0);
     doit = 0;
   }
 
@@ -1881,6 +2944,7 @@ int win_init(int fg, int bg, int attr)
   char *term;
 #endif
   static WIN _stdwin;
+  const char *colorterm;
   int f, olduseattr;
 
   if (w_init)
@@ -1995,6 +3059,13 @@ int win_init(int fg, int bg, int attr)
   if (IS != NULL)
     outstr(IS); /* Initialization string */
 
+  _sgrinit();
+  if ((maxcolors = tgetnum("Co")) < 8)
+    maxcolors = 8;
+  colorterm = getenv("COLORTERM");
+  truecolor = colorterm != NULL && (strcmp(colorterm, "truecolor") == 0 ||
+                                    strcmp(colorterm, "24bit") == 0);
+
   /* Reset attributes */
   olduseattr = useattr;
   useattr = 1;
@@ -2010,6 +3081,7 @@ int win_init(int fg, int bg, int attr)
     useattr = 0;
 
   _has_am = tgetflag("am");
+  _has_bce = tgetflag("ut");
   _mv_standout = tgetflag("ms");
   if (tgetflag("bs")) {
     if (BC == NULL)
@@ -2018,6 +3090,19 @@ int win_init(int fg, int bg, int attr)
   else
     BC = NULL;
 
+  /* Cursor motion, see _mvcursor() */
+  HO = tgetstr("ho", &_tptr);
+  ND = tgetstr("nd", &_tptr);
+  Up = tgetstr("up", &_tptr);
+  TA = tgetstr("ta", &_tptr);
+  tabwidth = tgetnum("it");
+  _mvcompile(&M_CM, CM, 2);
+  _mvcompile(&M_RI, tgetstr("RI", &_tptr), 1);
+  _mvcompile(&M_LE, tgetstr("LE", &_tptr), 1);
+  _mvcompile(&M_UP, tgetstr("UP", &_tptr), 1);
+  _mvcompile(&M_DO, tgetstr("DO", &_tptr), 1);
+  _mvcompile(&M_SF, tgetstr("SF", &_tptr), 1);
+
   /* Special IBM box-drawing characters */
   D_UL  = 201;
   D_HOR = 205;
@@ -2059,7 +3144,16 @@ int win_init(int fg, int bg, int attr)
     fprintf(stderr, _("Not enough memory\n"));
     return -1;
   };
-  _buffend = _bufstart + BUFFERSIZE;
+  if ((smap = malloc(sizeof(ELM) * (LINES + 1) * COLS)) == NULL ||
+      (swide = calloc(LINES + 1, 1)) == NULL) {
+    fprintf(stderr, _("Not enough memory\n"));
+    free(smap);
+    smap = NULL;
+    free(gmap);
+    gmap = NULL;
+    return -1;
+  };
+  _sforget(0, LINES);
 
   /* Initialize stdwin */
   stdwin = &_stdwin;
@@ -2078,6 +3172,7 @@ int win_init(int fg, int bg, int attr)
   stdwin->color    = COLATTR(fg, bg);
   stdwin->direct   = 1;
   stdwin->histbuf  = NULL;
+  stdwin->wrapped  = NULL;
 
   if (EA != NULL)
     outstr(EA);          /* Graphics init. */
@@ -2115,6 +3210,10 @@ void win_end(void)
   mc_wflush();
   free(gmap);
   gmap = NULL;
+  free(smap);
+  smap = NULL;
+  free(swide);
+  swide = NULL;
   stdwin = NULL;
   w_init = 0;
 }
@@ -28,9 +28,21 @@
 typedef struct _elm {
   wchar_t value;
   char attr;
-  char color;
+  unsigned short color;
 } ELM;
 
+/*
+ * History of a window, see history.c
+ */
+typedef struct _hist HIST;
+
+/*
+ * A search in a history, see history.c
+ */
+typedef struct _hsearch HSEARCH;
+#define HS_ICASE	1	/* Case does not matter */
+#define HS_REGEX	2	/* Extended regular expression */
+
 /*
  * Control struct of a window
  */
@@ -41,7 +53,7 @@ typedef struct _win {
   char border;		/* type of border */
   char cursor;		/* Does it have a cursor */
   char attr;		/* Current attribute of window */
-  char color;		/* Current color of window */
+  unsigned short color;	/* Current color of window */
   char autocr;		/* With '\n', do an automatic '\r' */
   char doscroll;	/* Automatically scroll up */
   char wrap;		/* Wrap around edge */
@@ -51,9 +63,10 @@ typedef struct _win {
   short o_curx;
   short o_cury;
   char o_attr;
-  char o_color;		/* Position & attributes before window was opened */
+  unsigned short o_color; /* Position & attributes before window was opened */
   ELM *map;		/* Map of contents */
-  ELM *histbuf;		/* History buffer. */
+  char *wrapped;	/* Rows that went on in the next one, may be NULL */
+  HIST *histbuf;	/* History buffer. */
   int histlines;	/* How many lines we keep in the history buffer */
   int histline;		/* Current line in the history buffer. */
 } WIN;
@@ -106,9 +119,20 @@ extern const char *J_col[]; /* Color's names */
 #define CYAN		6
 #define WHITE		7
 
-#define COLATTR(fg, bg) (((fg) << 4) + (bg))
-#define COLFG(ca)	((ca) >> 4)
-#define COLBG(ca)	((ca) % 16)
+/*
+ * Colors 8-15 are the bright versions of the above, 16-255 the rest of
+ * the xterm palette, and COL_RGB() makes a 24 bit color.
+ */
+#define COL_RGB(r, g, b) (0x1000000 | ((r) << 16) | ((g) << 8) | (b))
+#define COL_ISRGB(c)	((c) & 0x1000000)
+
+/*
+ * A foreground/background pair as kept in an ELM. Pairs of colors below
+ * 16 are fg << 4 + bg, others an index in a table of the pairs in use.
+ */
+#define COLATTR(fg, bg) mc_colpair(fg, bg)
+#define COLFG(ca)	mc_colfg(ca)
+#define COLBG(ca)	mc_colbg(ca)
 
 /*
  * Possible borders.
@@ -142,10 +166,29 @@ extern const char *J_col[]; /* Color's names */
 
 int wxgetch(void);
 
+int mc_colpair(int fg, int bg);
+int mc_colfg(int ca);
+int mc_colbg(int ca);
 void mc_wflush(void);
+int mc_histdir(const char *dir, int compress);
+void mc_histgzip(int compress);
+HIST *mc_histnew(int lines, int cols, char attr, unsigned short color);
+void mc_histfree(HIST *h);
+void mc_histadd(WIN *w, const ELM *line, int wrapped);
+ELM *mc_histline(WIN *w, int i);
+long long mc_histcount(WIN *w);
+int mc_histkeep(HIST *h, int lines, int cols);
+HSEARCH *mc_histsearch(const wchar_t *pat, int flags, char *err,
+                       size_t errlen);
+void mc_histsearchfree(HSEARCH *s);
+int mc_histmatch(HSEARCH *s, const ELM *line, int len);
+int mc_histgrep(WIN *w, HSEARCH *s, int max, int **hitsp);
+void mc_wframe(void);
+void mc_wsetframe(int hz, int sync);
 WIN *mc_wopen(int x1, int y1, int x2, int y2, int border,
            int attr, int fg, int bg, int direct, int hl, int rel);
 void mc_wclose(WIN *win, int replace);
+void mc_wswap(WIN *win);
 void mc_wleave(void);
 void mc_wreturn(void);
 void mc_wresize(WIN *w, int x, int y);
@@ -153,6 +196,7 @@ void mc_wredraw(WIN *w, int newdirect);
 void mc_wscroll(WIN *win, int dir);
 void mc_wlocate(WIN *win, int x, int y);
 void mc_wputc(WIN *win, wchar_t c);
+void mc_wputrun(WIN *win, const char *s, int len);
 void mc_wdrawelm(WIN *win, int y, ELM *e);
 void mc_wputs(WIN *win, const char *s);
 int mc_wprintf(WIN *, const char *, ...)
@@ -196,8 +240,8 @@ void mc_clear_window_simple(WIN *w);
 #define mc_wresetregion(w) ( (w)->sy1 = (w)->y1, (w)->sy2 = (w)->y2 )
 #define mc_wgetattr(w) ( (w)->attr )
 #define mc_wsetattr(w, a) ( (w)->attr = (a) )
-#define mc_wsetfgcol(w, fg) ( (w)->color = ((w)->color & 15) + ((fg) << 4))
-#define mc_wsetbgcol(w, bg) ( (w)->color = ((w)->color & 240) + (bg) )
+#define mc_wsetfgcol(w, fg) ( (w)->color = COLATTR(fg, COLBG((w)->color)) )
+#define mc_wsetbgcol(w, bg) ( (w)->color = COLATTR(COLFG((w)->color), bg) )
 #define mc_wsetam(w) ( (w)->wrap = 1 )
 #define mc_wresetam(w) ( (w)->wrap = 0 )
 